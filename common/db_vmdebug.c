@@ -45,16 +45,67 @@ OTDEF OpcodeTable[] = {
 { OP_LREF,      "LREF",     FMT_SBYTE   },
 { OP_LSET,      "LSET",     FMT_SBYTE   },
 { OP_INDEX,     "INDEX",    FMT_NONE    },
-{ OP_CALL,      "CALL",     FMT_BYTE    },
+{ OP_CALL,      "CALL",     FMT_NONE    },
 { OP_FRAME,     "FRAME",    FMT_BYTE    },
-{ OP_RETURN,    "RETURN",   FMT_NONE    },
+{ OP_RETURN,    "RETURN",   FMT_BYTE    },
 { OP_DROP,      "DROP",     FMT_NONE    },
 { OP_DUP,       "DUP",      FMT_NONE    },
 { OP_NATIVE,    "NATIVE",   FMT_LONG    },
 { OP_TRAP,      "TRAP",     FMT_BYTE    },
+{ OP_FORNEXT,   "FORNEXT",  FMT_SBYTE_BR},
+{ OP_DCALL,     "DCALL",    FMT_WORD    },
+{ OP_TCALL,     "TCALL",    FMT_BYTE2_WORD},
+{ OP_GLOAD,     "GLOAD",    FMT_BYTE    },
+{ OP_GSTORE,    "GSTORE",   FMT_BYTE    },
+{ OP_GLOADW,    "GLOADW",   FMT_WORD    },
+{ OP_GSTOREW,   "GSTOREW",  FMT_WORD    },
+{ OP_DLOAD,     "DLOAD",    FMT_NONE    },
+{ OP_DSTORE,    "DSTORE",   FMT_NONE    },
+{ OP_TLOAD,     "TLOAD",    FMT_NONE    },
+{ OP_SBRT,      "SBRT",     FMT_SBR     },
+{ OP_SBRTSC,    "SBRTSC",   FMT_SBR     },
+{ OP_SBRF,      "SBRF",     FMT_SBR     },
+{ OP_SBRFSC,    "SBRFSC",   FMT_SBR     },
+{ OP_SBR,       "SBR",      FMT_SBR     },
+{ OP_JUMPTABLE, "JUMPTABLE",FMT_BYTE    },
+{ OP_DIVP2,     "DIVP2",    FMT_BYTE    },
+{ OP_REMP2,     "REMP2",    FMT_BYTE    },
+{ OP_SWAP,      "SWAP",     FMT_NONE    },
+{ OP_INCL,      "INCL",     FMT_SBYTE2  },
+{ OP_INCG,      "INCG",     FMT_BYTE_SBYTE },
+{ OP_RADD,      "RADD",     FMT_REG3    },
+{ OP_RSUB,      "RSUB",     FMT_REG3    },
+{ OP_RMUL,      "RMUL",     FMT_REG3    },
+{ OP_RDIV,      "RDIV",     FMT_REG3    },
+{ OP_RREM,      "RREM",     FMT_REG3    },
+{ OP_RBAND,     "RBAND",    FMT_REG3    },
+{ OP_RBOR,      "RBOR",     FMT_REG3    },
+{ OP_RBXOR,     "RBXOR",    FMT_REG3    },
+{ OP_RSHL,      "RSHL",     FMT_REG3    },
+{ OP_RSHR,      "RSHR",     FMT_REG3    },
+{ OP_RLT,       "RLT",      FMT_REG3    },
+{ OP_RLE,       "RLE",      FMT_REG3    },
+{ OP_REQ,       "REQ",      FMT_REG3    },
+{ OP_RNE,       "RNE",      FMT_REG3    },
+{ OP_RGE,       "RGE",      FMT_REG3    },
+{ OP_RGT,       "RGT",      FMT_REG3    },
+{ OP_RINDEX,    "RINDEX",   FMT_REG3    },
+{ OP_RNEG,      "RNEG",     FMT_REG2    },
+{ OP_RNOT,      "RNOT",     FMT_REG2    },
+{ OP_RBNOT,     "RBNOT",    FMT_REG2    },
+{ OP_RMOV,      "RMOV",     FMT_REG2    },
+{ OP_RDLOAD,    "RDLOAD",   FMT_REG2    },
+{ OP_RDSTORE,   "RDSTORE",  FMT_REG2    },
+{ OP_RLIT,      "RLIT",     FMT_REG_LONG},
+{ OP_RBRT,      "RBRT",     FMT_REG_BR  },
+{ OP_RBRF,      "RBRF",     FMT_REG_BR  },
+{ OP_WLIT,      "WLIT",     FMT_SWORD   },
+{ OP_CLIT,      "CLIT",     FMT_BYTE    },
 { 0,            NULL,       0           }
 };
 
+static void ShowRegister(int spec);
+
 /* DecodeFunction - decode the instructions in a function code object */
 void DecodeFunction(const uint8_t *base, const uint8_t *code, int len)
 {
@@ -67,12 +118,12 @@ void DecodeFunction(const uint8_t *base, const uint8_t *code, int len)
 /* DecodeInstruction - decode a single bytecode instruction */
 int DecodeInstruction(const uint8_t *base, const uint8_t *lc)
 {
-    uint8_t opcode, bytes[sizeof(VMVALUE)];
+    uint8_t opcode, bytes[1 + sizeof(VMVALUE)];
     const OTDEF *op;
     VMVALUE value;
     VMWORD offset;
     int8_t sbyte;
-    int n, i;
+    int n, cnt, i;
 
     /* get the opcode */
     opcode = VMCODEBYTE(lc);
@@ -109,6 +160,20 @@ int DecodeInstruction(const uint8_t *base, const uint8_t *lc)
                 VM_printf("%s %d\n", op->name, sbyte);
                 n += 1;
                 break;
+            case FMT_SBYTE2:
+            case FMT_BYTE_SBYTE:
+                for (i = 0; i < 2; ++i) {
+                    bytes[i] = VMCODEBYTE(lc + i + 1);
+                    VM_printf("%02x ", bytes[i]);
+                }
+                for (i = 2; i < sizeof(VMVALUE); ++i)
+                    VM_printf("   ");
+                if (op->fmt == FMT_SBYTE2)
+                    VM_printf("%s %d %d\n", op->name, (int8_t)bytes[0], (int8_t)bytes[1]);
+                else
+                    VM_printf("%s %02x %d\n", op->name, bytes[0], (int8_t)bytes[1]);
+                n += 2;
+                break;
             case FMT_LONG:
                 for (i = 0; i < sizeof(VMVALUE); ++i) {
                     bytes[i] = VMCODEBYTE(lc + i + 1);
@@ -120,6 +185,64 @@ int DecodeInstruction(const uint8_t *base, const uint8_t *lc)
                 VM_printf("\n");
                 n += sizeof(VMVALUE);
                 break;
+            case FMT_WORD:
+                for (i = 0; i < sizeof(VMWORD); ++i) {
+                    bytes[i] = VMCODEBYTE(lc + i + 1);
+                    VM_printf("%02x ", bytes[i]);
+                }
+                for (i = sizeof(VMWORD); i < sizeof(VMVALUE); ++i)
+                    VM_printf("   ");
+                VM_printf("%s ", op->name);
+                for (i = 0; i < sizeof(VMWORD); ++i)
+                    VM_printf("%02x", bytes[i]);
+                VM_printf("\n");
+                n += sizeof(VMWORD);
+                break;
+            case FMT_SWORD:
+                for (i = 0; i < sizeof(VMWORD); ++i) {
+                    bytes[i] = VMCODEBYTE(lc + i + 1);
+                    VM_printf("%02x ", bytes[i]);
+                }
+                for (i = sizeof(VMWORD); i < sizeof(VMVALUE); ++i)
+                    VM_printf("   ");
+                VM_printf("%s %d\n", op->name, (VMWORD)((bytes[0] << 8) | bytes[1]));
+                n += sizeof(VMWORD);
+                break;
+            case FMT_BYTE2_WORD:
+                for (i = 0; i < 2 + sizeof(VMWORD); ++i) {
+                    bytes[i] = VMCODEBYTE(lc + i + 1);
+                    VM_printf("%02x ", bytes[i]);
+                }
+                for (i = 2 + sizeof(VMWORD); i < sizeof(VMVALUE); ++i)
+                    VM_printf("   ");
+                VM_printf("%s %02x %02x ", op->name, bytes[0], bytes[1]);
+                for (i = 2; i < 2 + sizeof(VMWORD); ++i)
+                    VM_printf("%02x", bytes[i]);
+                VM_printf("\n");
+                n += 2 + sizeof(VMWORD);
+                break;
+            case FMT_SBYTE_BR:
+                sbyte = (int8_t)VMCODEBYTE(lc + 1);
+                offset = 0;
+                for (i = 0; i < sizeof(VMWORD); ++i) {
+                    bytes[i] = VMCODEBYTE(lc + i + 2);
+                    offset = (offset << 8) | bytes[i];
+                }
+                VM_printf("%02x ", (uint8_t)sbyte);
+                for (i = 0; i < sizeof(VMWORD); ++i)
+                    VM_printf("%02x ", bytes[i]);
+                for (i = 1 + sizeof(VMWORD); i < sizeof(VMVALUE); ++i)
+                    VM_printf("   ");
+                VM_printf("%s %d ", op->name, sbyte);
+                for (i = 0; i < sizeof(VMWORD); ++i)
+                    VM_printf("%02x", bytes[i]);
+                value = (VMVALUE)((lc - base) + 2 + sizeof(VMWORD) + offset);
+                VM_printf(" # ");
+                for (i = sizeof(VMVALUE); --i >= 0 ; )
+                    VM_printf("%02x", (value >> (8 * i)) & 0xff);
+                VM_printf("\n");
+                n += 1 + sizeof(VMWORD);
+                break;
             case FMT_BR:
                 offset = 0;
                 for (i = 0; i < sizeof(VMWORD); ++i) {
@@ -139,6 +262,71 @@ int DecodeInstruction(const uint8_t *base, const uint8_t *lc)
                 VM_printf("\n");
                 n += sizeof(VMWORD);
                 break;
+            case FMT_SBR:
+                sbyte = (int8_t)VMCODEBYTE(lc + 1);
+                VM_printf("%02x ", (uint8_t)sbyte);
+                for (i = 1; i < sizeof(VMVALUE); ++i)
+                    VM_printf("   ");
+                VM_printf("%s %d", op->name, sbyte);
+                value = (VMVALUE)((lc - base) + 2 + sbyte);
+                VM_printf(" # ");
+                for (i = sizeof(VMVALUE); --i >= 0 ; )
+                    VM_printf("%02x", (value >> (8 * i)) & 0xff);
+                VM_printf("\n");
+                n += 1;
+                break;
+            case FMT_REG2:
+            case FMT_REG3:
+                cnt = (op->fmt == FMT_REG2 ? 2 : 3);
+                for (i = 0; i < cnt; ++i) {
+                    bytes[i] = VMCODEBYTE(lc + i + 1);
+                    VM_printf("%02x ", bytes[i]);
+                }
+                for (i = cnt; i < sizeof(VMVALUE); ++i)
+                    VM_printf("   ");
+                VM_printf("%s", op->name);
+                for (i = 0; i < cnt; ++i) {
+                    VM_printf(i == 0 ? " " : ", ");
+                    ShowRegister(bytes[i]);
+                }
+                VM_printf("\n");
+                n += cnt;
+                break;
+            case FMT_REG_LONG:
+                for (i = 0; i < 1 + sizeof(VMVALUE); ++i) {
+                    bytes[i] = VMCODEBYTE(lc + i + 1);
+                    VM_printf("%02x ", bytes[i]);
+                }
+                VM_printf("%s ", op->name);
+                ShowRegister(bytes[0]);
+                VM_printf(", ");
+                for (i = 1; i < 1 + sizeof(VMVALUE); ++i)
+                    VM_printf("%02x", bytes[i]);
+                VM_printf("\n");
+                n += 1 + sizeof(VMVALUE);
+                break;
+            case FMT_REG_BR:
+                offset = 0;
+                for (i = 0; i < 1 + sizeof(VMWORD); ++i) {
+                    bytes[i] = VMCODEBYTE(lc + i + 1);
+                    if (i > 0)
+                        offset = (offset << 8) | bytes[i];
+                    VM_printf("%02x ", bytes[i]);
+                }
+                for (i = 1 + sizeof(VMWORD); i < sizeof(VMVALUE); ++i)
+                    VM_printf("   ");
+                VM_printf("%s ", op->name);
+                ShowRegister(bytes[0]);
+                VM_printf(", ");
+                for (i = 1; i < 1 + sizeof(VMWORD); ++i)
+                    VM_printf("%02x", bytes[i]);
+                value = (VMVALUE)((lc - base) + 2 + sizeof(VMWORD) + offset);
+                VM_printf(" # ");
+                for (i = sizeof(VMVALUE); --i >= 0 ; )
+                    VM_printf("%02x", (value >> (8 * i)) & 0xff);
+                VM_printf("\n");
+                n += 1 + sizeof(VMWORD);
+                break;
             }
             return n;
         }
@@ -148,3 +336,25 @@ int DecodeInstruction(const uint8_t *base, const uint8_t *lc)
     return 1;
 }
 
+/* ShowRegister - show a register specifier */
+/* TextHash - hash the header and text of an image (identifies the code a profile was made from) */
+uint32_t TextHash(const uint8_t *text, VMUVALUE size)
+{
+    uint32_t hash = 2166136261u;
+    while (size-- > 0)
+        hash = (hash ^ *text++) * 16777619u;
+    return hash;
+}
+
+static void ShowRegister(int spec)
+{
+    if (spec < ROP_GLOBAL)
+        VM_printf("L%d", ROP_OFFSET(spec));
+    else if (spec < ROP_CONSTS)
+        VM_printf("G%d", spec - ROP_GLOBAL);
+    else if (spec != ROP_STACK)
+        VM_printf("#%d", spec - ROP_CONST);
+    else
+        VM_printf("S");
+}
+
@@ -1,8 +1,13 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include "db_compiler.h"
+#include "db_vmdebug.h"
 
 /* compiler heap size */
-#define HEAPSIZE            5000
+#define HEAPSIZE            65536
+
+/* default size of the largest function to inline */
+#define INLINESIZE          24
 
 /* image buffer size */
 #define TEXTMAX             8192
@@ -10,44 +15,111 @@
 
 static uint8_t space[sizeof(ParseContext) + HEAPSIZE];
 static uint8_t imageSpace[sizeof(ImageHdr) + TEXTMAX + DATAMAX];
+static Profile profile;
 
 static int MyGetLine(void *cookie, char *buf, int len);
+static int ReadProfile(char *name);
+static int CompareSites(const void *a, const void *b);
 
 int main(int argc, char *argv[])
 {
+    char *sourceFile = NULL, *imageFile = NULL, *profileFile = NULL;
+    int optimize = 0, inlineSize = INLINESIZE, encoding = ENCODING_STACK, i;
+    Function *function;
     ParseContext *c;
     FILE *fp;
     
     /* check the argument list */
-    if (argc != 3) {
-        fprintf(stderr, "usage: compile <source> <image>\n");
+    for (i = 1; i < argc; ++i) {
+        if (argv[i][0] == '-') {
+            switch (argv[i][1]) {
+            case 'O':
+                optimize = argv[i][2] ? atoi(&argv[i][2]) : 1;
+                break;
+            case 'i':
+                inlineSize = atoi(&argv[i][2]);
+                break;
+            case 'r':
+                encoding = ENCODING_REGISTER;
+                break;
+            case 'p':
+                profileFile = &argv[i][2];
+                break;
+            default:
+                sourceFile = imageFile = NULL;
+                i = argc;
+                break;
+            }
+        }
+        else if (!sourceFile)
+            sourceFile = argv[i];
+        else if (!imageFile)
+            imageFile = argv[i];
+        else {
+            sourceFile = imageFile = NULL;
+            break;
+        }
+    }
+    if (!sourceFile || !imageFile) {
+        fprintf(stderr, "usage: compile [-O[level]] [-i<inline-size>] [-r] [-p<profile>] <source> <image>\n");
         return 1;
     }
     
+    /* read the profile */
+    if (profileFile && !ReadProfile(profileFile))
+        return 1;
+
     /* open the input file */
-    if (!(fp = fopen(argv[1], "r"))) {
-        fprintf(stderr, "error: can't open %s\n", argv[1]);
+    if (!(fp = fopen(sourceFile, "r"))) {
+        fprintf(stderr, "error: can't open %s\n", sourceFile);
         return 1;
     }
     
-    if (!(c = InitCompiler(space, sizeof(space)))) {
-        VM_printf("error: insufficient memory\n");
-        return 1;
-    }
-    c->getLine = MyGetLine;
-    c->getLineCookie = fp;
+    for (;;) {
+        if (!(c = InitCompiler(space, sizeof(space)))) {
+            VM_printf("error: insufficient memory\n");
+            return 1;
+        }
+        c->getLine = MyGetLine;
+        c->getLineCookie = fp;
+        c->optimize = optimize;
+        c->inlineSize = inlineSize;
+        c->encoding = encoding;
+        c->profile = (profileFile ? &profile : NULL);
 
-    if (Compile(c, imageSpace, sizeof(imageSpace), TEXTMAX, DATAMAX) != 0) {
-        VM_printf("error: compile failed\n");
-        return 1;
+        if (Compile(c, imageSpace, sizeof(imageSpace), TEXTMAX, DATAMAX) != 0) {
+            VM_printf("error: compile failed\n");
+            return 1;
+        }
+
+        /* compiling the program the way it was profiled finds the sites so it can be compiled again using their counts */
+        if (!profileFile || profile.mapped)
+            break;
+
+        /* the offsets only mean something if that produced the code that was profiled */
+        if (((ImageHdr *)imageSpace)->dataOffset != profile.textSize
+        ||  TextHash(imageSpace, profile.textSize) != profile.textHash) {
+            fprintf(stderr, "error: %s was made from a different program or different compile options\n", profileFile);
+            return 1;
+        }
+        profile.mapped = VMTRUE;
+        rewind(fp);
     }
     
     /* close the input file */
     fclose(fp);
     
+    /* report what the optimizer did */
+    if (c->optimize) {
+        for (function = c->functions; function != NULL; function = function->next)
+            if (function->inlined)
+                VM_printf("inlined %s at %d call site%s\n", function->symbol->name, function->inlined, function->inlined == 1 ? "" : "s");
+        VM_printf("optimizer saved %d bytes\n", c->bytesSaved);
+    }
+
     /* create the image file */
-    if (!(fp = fopen(argv[2], "wb"))) {
-        fprintf(stderr, "error: can't create %s\n", argv[2]);
+    if (!(fp = fopen(imageFile, "wb"))) {
+        fprintf(stderr, "error: can't create %s\n", imageFile);
         return 1;
     }
         
@@ -63,3 +135,55 @@ static int MyGetLine(void *cookie, char *buf, int len)
     FILE *fp = (FILE *)cookie;
     return fgets(buf, len, fp) ? 0 : -1;
 }
+
+/* ReadProfile - read the text offsets and counts of the branches and calls written by execute -p */
+static int ReadProfile(char *name)
+{
+    unsigned long offset, count, count2, hash;
+    ProfileSite *site;
+    int size = 0;
+    FILE *fp;
+
+    if (!(fp = fopen(name, "r"))) {
+        fprintf(stderr, "error: can't open %s\n", name);
+        return VMFALSE;
+    }
+
+    /* get the size and hash of the code that was profiled */
+    if (fscanf(fp, " text %lu %lx", &offset, &hash) != 2) {
+        fprintf(stderr, "error: %s is not a profile\n", name);
+        fclose(fp);
+        return VMFALSE;
+    }
+    profile.textSize = offset;
+    profile.textHash = hash;
+
+    while (fscanf(fp, "%lu %lu %lu", &offset, &count, &count2) == 3) {
+        if (profile.count >= size) {
+            size += 256;
+            if (!(profile.sites = (ProfileSite *)realloc(profile.sites, size * sizeof(ProfileSite)))) {
+                fprintf(stderr, "error: insufficient memory\n");
+                return VMFALSE;
+            }
+        }
+        site = &profile.sites[profile.count++];
+        site->offset = offset;
+        site->counts[0] = count;
+        site->counts[1] = count2;
+        site->function = 0;
+        site->site = 0;
+        site->call = VMFALSE;
+    }
+    fclose(fp);
+
+    /* the sites are looked up by offset */
+    qsort(profile.sites, profile.count, sizeof(ProfileSite), CompareSites);
+    return VMTRUE;
+}
+
+/* CompareSites - compare the text offsets of two profile sites */
+static int CompareSites(const void *a, const void *b)
+{
+    VMUVALUE offset = ((ProfileSite *)a)->offset, offset2 = ((ProfileSite *)b)->offset;
+    return offset < offset2 ? -1 : offset > offset2 ? 1 : 0;
+}
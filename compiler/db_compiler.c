@@ -16,21 +16,24 @@
 #define RGB_SIZE    60
 
 static uint8_t bi_delayms[] = {
-    OP_FRAME, 2,
     OP_LREF, 0,
-    OP_TRAP, 7,
-    OP_RETURN
+    OP_TRAP, TRAP_DelayMs,
+    OP_SLIT, 0,
+    OP_RETURN, 1
 };
 
 static uint8_t bi_updateleds[] = {
-    OP_FRAME, 1,
-    OP_TRAP, 8,
-    OP_RETURN
+    OP_TRAP, TRAP_UpdateLeds,
+    OP_SLIT, 0,
+    OP_RETURN, 0
 };
 
 /* forward declarations */
-static void EnterBuiltInFunction(ParseContext *c, char *name, uint8_t *code, size_t codeSize);
+static void EnterBuiltInFunction(ParseContext *c, char *name, int argc, uint8_t *code, size_t codeSize);
 static void EnterBuiltInVariable(ParseContext *c, char *name, size_t size);
+static void PlaceFunctions(ParseContext *c);
+static void MarkFunctions(ParseContext *c, const uint8_t *code, int size);
+static void ResolveCalls(ParseContext *c, uint8_t *code, int size);
 
 /* InitCompiler - initialize the compiler */
 ParseContext *InitCompiler(uint8_t *freeSpace, size_t freeSize)
@@ -40,6 +43,10 @@ ParseContext *InitCompiler(uint8_t *freeSpace, size_t freeSize)
         return NULL;
     c->heapBase = freeSpace + sizeof(ParseContext);
     c->heapTop = freeSpace + freeSize;
+    c->optimize = 0;
+    c->inlineSize = 0;
+    c->encoding = ENCODING_STACK;
+    c->profile = NULL;
     return c;
 }
 
@@ -48,6 +55,7 @@ int Compile(ParseContext *c, uint8_t *imageSpace, size_t imageSize, size_t textM
 {
     ImageHdr *image = (ImageHdr *)imageSpace;
     VMUVALUE textSize;
+    VMVALUE *pool;
 
     /* setup an error target */
     if (setjmp(c->errorTarget) != 0)
@@ -63,6 +71,14 @@ int Compile(ParseContext *c, uint8_t *imageSpace, size_t imageSize, size_t textM
     c->localFree = c->heapBase;
     c->globalFree = c->heapTop;
 
+    /* nothing optimized yet */
+    c->bytesSaved = 0;
+    c->marks = NULL;
+    c->markCount = 0;
+
+    /* start with an empty constant pool */
+    c->poolCount = 0;
+
     /* initialize the image */
     c->textBase = c->textFree = imageSpace + sizeof(ImageHdr);
     c->textTop = c->textBase + textMax;
@@ -80,9 +96,13 @@ int Compile(ParseContext *c, uint8_t *imageSpace, size_t imageSize, size_t textM
     /* initialize the global symbol table and string table */
     InitSymbolTable(&c->globals);
     
+    /* initialize the function list */
+    c->functions = NULL;
+    c->pNextFunction = &c->functions;
+    
     /* enter the built-in functions */
-    EnterBuiltInFunction(c, "delayMs", bi_delayms, sizeof(bi_delayms));
-    EnterBuiltInFunction(c, "updateLeds", bi_updateleds, sizeof(bi_updateleds));
+    EnterBuiltInFunction(c, "delayMs", 1, bi_delayms, sizeof(bi_delayms));
+    EnterBuiltInFunction(c, "updateLeds", 0, bi_updateleds, sizeof(bi_updateleds));
     
     /* enter the built-in variables */
     /*
@@ -105,13 +125,19 @@ int Compile(ParseContext *c, uint8_t *imageSpace, size_t imageSize, size_t textM
 
     /* initialize the label table */
     c->labels = NULL;
+    c->labelRefs = 0;
 
     /* start in the main code */
     c->codeType = CODE_TYPE_MAIN;
+    c->localOffset = 0;
+    c->localMax = 0;
 
     /* initialize scanner */
     c->inComment = VMFALSE;
     c->lineNumber = 0;
+#ifdef COMPILER_DEBUG
+    CheckKeywords(c);
+#endif
     
     /* compile each line */
     while (GetLine(c)) {
@@ -127,12 +153,23 @@ int Compile(ParseContext *c, uint8_t *imageSpace, size_t imageSize, size_t textM
     StartCode(c, CODE_TYPE_MAIN);
     image->entry = StoreCode(c);
     
+    /* write the constant pool after the code */
+    if (c->poolCount > 0) {
+        pool = (VMVALUE *)ImageTextAlloc(c, c->poolCount * sizeof(VMVALUE));
+        memcpy(pool, c->pool, c->poolCount * sizeof(VMVALUE));
+        image->poolOffset = (VMUVALUE)((uint8_t *)pool - (uint8_t *)image);
+    }
+
     /* determine the text size */
     textSize = c->textFree - c->textBase;
 
-    /* fill in the image header */
+    /* fill in the image header (the zeros at the end of the data are left to the loader along with the BSS) */
     image->dataOffset = sizeof(ImageHdr) + textSize;
     image->dataSize = c->dataFree - c->dataBase;
+    while (image->dataSize > 0 && c->dataBase[image->dataSize - 1] == 0)
+        --image->dataSize;
+    image->bssSize = c->dataFree - c->dataBase - image->dataSize;
+    image->encoding = c->encoding;
     image->imageSize = image->dataOffset + image->dataSize;
     
     /* make the data contiguous with the code */
@@ -144,6 +181,8 @@ int Compile(ParseContext *c, uint8_t *imageSpace, size_t imageSize, size_t textM
     VM_printf("textSize   "); PrintValue(textSize); VM_printf("\n");
     VM_printf("dataOffset ");  PrintValue(image->dataOffset); VM_printf("\n");
     VM_printf("dataSize   "); PrintValue(image->dataSize); VM_printf("\n");
+    VM_printf("bssSize    "); PrintValue(image->bssSize); VM_printf("\n");
+    VM_printf("poolOffset "); PrintValue(image->poolOffset); VM_printf("\n");
     DumpSymbols(&c->globals, "symbols");
 #endif
 
@@ -152,11 +191,11 @@ int Compile(ParseContext *c, uint8_t *imageSpace, size_t imageSize, size_t textM
 }
 
 /* EnterBuiltInFunction - enter a built-in function */
-static void EnterBuiltInFunction(ParseContext *c, char *name, uint8_t *code, size_t codeSize)
+static void EnterBuiltInFunction(ParseContext *c, char *name, int argc, uint8_t *code, size_t codeSize)
 {
-    uint8_t *p = ImageTextAlloc(c, codeSize);
-    memcpy(p, code, codeSize);
-    AddGlobal(c, name, SC_CONSTANT,  (VMVALUE)(p - (uint8_t *)c->image));
+    VMVALUE *value = (VMVALUE *)ImageTextAlloc(c, sizeof(VMVALUE));
+    Symbol *symbol = AddGlobal(c, name, SC_VARIABLE,  (VMVALUE)((uint8_t *)value - (uint8_t *)c->image));
+    AddFunction(c, symbol, argc, code, codeSize);
 }
 
 /* EnterBuiltInVariable - enter a built-in variable */
@@ -180,19 +219,21 @@ void StartCode(ParseContext *c, CodeType type)
     /* initialize the code object under construction */
     InitSymbolTable(&c->arguments);
     InitSymbolTable(&c->locals);
-    c->localOffset = 0;
     c->codeType = type;
     
-    /* write the code prolog */
+    /* start with no local variables (the frame is added when the code is stored) */
     if (type != CODE_TYPE_MAIN) {
-        putcbyte(c, OP_FRAME);
-        putcbyte(c, 0);
+        c->localOffset = 0;
+        c->localMax = 0;
     }
 }
 
 /* StoreCode - store the function or method under construction */
 VMVALUE StoreCode(ParseContext *c)
 {
+    const uint8_t *stackCode = NULL;
+    int stackSize = 0, need = -1;
+    Function *function;
     size_t codeSize;
     VMVALUE code;
     uint8_t *p;
@@ -202,43 +243,91 @@ VMVALUE StoreCode(ParseContext *c)
     case BLOCK_IF:
     case BLOCK_ELSE:
         ParseError(c, "expecting END IF");
+        /* fall through */
     case BLOCK_FOR:
         ParseError(c, "expecting NEXT");
+        /* fall through */
     case BLOCK_DO:
         ParseError(c, "expecting LOOP");
+        /* fall through */
+    case BLOCK_SELECT:
+        ParseError(c, "expecting END SELECT");
+        /* fall through */
     case BLOCK_NONE:
         break;
     }
 
-    /* fixup the RESERVE instruction at the start of the code */
+    /* return zero if the end of a function is reached */
     if (c->codeType != CODE_TYPE_MAIN) {
-        c->codeBuf[1] = 2 + c->localOffset;
+        putcbyte(c, OP_SLIT);
+        putcbyte(c, 0);
         putcbyte(c, OP_RETURN);
+        putcbyte(c, c->arguments.count);
+    }
+
+    /* only code with local variables needs a frame */
+    if (c->localMax > 0) {
+        codeSize = (int)(c->codeFree - c->codeBuf);
+        if (c->codeFree + 2 > c->codeTop)
+            Abort(c, "insufficient code buffer space");
+        memmove(c->codeBuf + 2, c->codeBuf, codeSize);
+        c->codeBuf[0] = OP_FRAME;
+        c->codeBuf[1] = c->localMax;
+        c->codeFree += 2;
     }
 
     /* make sure all referenced labels were defined */
     CheckLabels(c);
     
-    /* allocate code space */
+    /* optimize the code (choosing the branch forms is part of encoding optimized code) */
+    if (c->optimize || c->encoding == ENCODING_REGISTER)
+        c->bytesSaved += OptimizeCode(c, &stackCode, &stackSize, &need);
+    else
+        RelaxBranches(c);
+
+    /* get the code size */
     codeSize = (int)(c->codeFree - c->codeBuf);
-    p = (uint8_t *)ImageTextAlloc(c, codeSize);
-    memcpy(p, c->codeBuf, codeSize);
-    
-    /* get the address of the compiled code */
-    code = (VMVALUE)(p - (uint8_t *)c->image);
 
 #ifdef COMPILER_DEBUG
 {
     VM_printf("%s:\n", c->codeSymbol ? c->codeSymbol->name : "<main>");
-    DecodeFunction((uint8_t *)c->image, (uint8_t *)c->image + code, codeSize);
+    DecodeFunction(c->codeBuf, c->codeBuf, codeSize);
     DumpSymbols(&c->arguments, "arguments");
     DumpSymbols(&c->locals, "locals");
     VM_printf("\n");
 }
 #endif
 
+    /* keep function code until it is known whether the main code uses it */
+    if (c->codeType != CODE_TYPE_MAIN) {
+        p = (uint8_t *)GlobalAllocBasic(c, codeSize);
+        memcpy(p, c->codeBuf, codeSize);
+        function = AddFunction(c, c->codeSymbol, c->arguments.count, p, codeSize);
+        if (stackSize > 0) {
+            function->stackCode = stackCode;
+            function->stackSize = stackSize;
+        }
+        function->need = need;
+        function->marks = c->marks;
+        function->markCount = c->markCount;
+        code = 0;
+    }
+
+    /* place the functions followed by the main code */
+    else {
+        PlaceFunctions(c);
+        ResolveCalls(c, c->codeBuf, codeSize);
+        p = (uint8_t *)ImageTextAlloc(c, codeSize);
+        memcpy(p, c->codeBuf, codeSize);
+        code = (VMVALUE)(p - (uint8_t *)c->image);
+        if (c->profile && !c->profile->mapped)
+            MapSites(c, c->marks, c->markCount, 0, code);
+    }
+
     /* prepare the buffer for the next function */
     c->codeFree = c->codeBuf;
+    c->marks = NULL;
+    c->markCount = 0;
 
     /* empty the local heap */
     c->localFree = c->heapBase;
@@ -248,11 +337,192 @@ VMVALUE StoreCode(ParseContext *c)
 
     /* reset to compile the next code */
     c->codeType = CODE_TYPE_MAIN;
+    c->localOffset = 0;
+    c->localMax = 0;
     
     /* return the code vector */
     return code;
 }
 
+/* AddFunction - add a function to the list of functions to place in the image */
+Function *AddFunction(ParseContext *c, Symbol *symbol, int argc, const uint8_t *code, int size)
+{
+    Function *function;
+
+    /* fill in a function that was called before it was defined */
+    if ((function = FindFunction(c, symbol)) != NULL) {
+        function->argc = argc;
+        function->code = function->stackCode = code;
+        function->size = function->stackSize = size;
+        function->need = -1;
+        return function;
+    }
+
+    function = (Function *)GlobalAllocBasic(c, sizeof(Function));
+    function->next = NULL;
+    function->symbol = symbol;
+    function->argc = argc;
+    function->code = function->stackCode = code;
+    function->size = function->stackSize = size;
+    function->used = VMFALSE;
+    function->inlined = 0;
+    function->need = -1;
+    function->marks = NULL;
+    function->markCount = 0;
+    function->heat = 0;
+    *c->pNextFunction = function;
+    c->pNextFunction = &function->next;
+    return function;
+}
+
+/* AddForwardFunction - add a function that is called before it is defined */
+void AddForwardFunction(ParseContext *c, char *name)
+{
+    VMVALUE *value = (VMVALUE *)ImageTextAlloc(c, sizeof(VMVALUE));
+    Symbol *symbol = AddGlobal(c, name, SC_VARIABLE, (VMVALUE)((uint8_t *)value - (uint8_t *)c->image));
+    AddFunction(c, symbol, -1, NULL, 0);
+}
+
+/* FindFunction - find the function whose code vector is the value of a symbol */
+Function *FindFunction(ParseContext *c, Symbol *symbol)
+{
+    Function *function;
+    for (function = c->functions; function != NULL; function = function->next)
+        if (function->symbol == symbol)
+            return function;
+    return NULL;
+}
+
+/* PlaceFunctions - place the code of used functions in the image and fill in their code vectors */
+static void PlaceFunctions(ParseContext *c)
+{
+    Function *function;
+    uint8_t *p;
+
+    /* when optimizing, only place functions that the main code refers to directly or indirectly */
+    for (function = c->functions; function != NULL; function = function->next)
+        function->used = !c->optimize;
+    if (c->optimize)
+        MarkFunctions(c, c->codeBuf, codeaddr(c));
+
+    /* place the functions in the order they were defined or the hottest ones last when there is a profile */
+    if (c->profile && c->profile->mapped)
+        OrderFunctions(c);
+    for (function = c->functions; function != NULL; function = function->next) {
+        VMVALUE *pValue = (VMVALUE *)((uint8_t *)c->image + function->symbol->value);
+        if (!function->code)
+            Abort(c, "undefined function: %s", function->symbol->name);
+        if (function->used) {
+            p = (uint8_t *)ImageTextAlloc(c, function->size);
+            memcpy(p, function->code, function->size);
+            *pValue = (VMVALUE)(p - (uint8_t *)c->image);
+            if (c->profile && !c->profile->mapped)
+                MapSites(c, function->marks, function->markCount, function->symbol->value, *pValue);
+        }
+        else {
+            c->bytesSaved += function->size;
+            *pValue = 0;
+        }
+    }
+
+    /* now that every function has an address, point the direct calls at the code */
+    for (function = c->functions; function != NULL; function = function->next) {
+        if (function->used) {
+            VMVALUE *pValue = (VMVALUE *)((uint8_t *)c->image + function->symbol->value);
+            ResolveCalls(c, (uint8_t *)c->image + *pValue, function->size);
+        }
+    }
+}
+
+/* IsDirectCall - check for a call to a known function and make sure it passes the right number of arguments */
+int IsDirectCall(ParseContext *c, ParseTreeNode *expr)
+{
+    ParseTreeNode *fcn = expr->u.functionCall.fcn;
+    int argc = expr->u.functionCall.argc;
+    Function *function;
+    Symbol *symbol;
+
+    /* functions are global variables */
+    if (fcn->nodeType != NodeTypeSymbolRef || fcn->u.symbolRef.fcn != code_global)
+        return VMFALSE;
+    symbol = fcn->u.symbolRef.symbol;
+
+    /* check for a recursive call */
+    if (c->codeType != CODE_TYPE_MAIN && symbol == c->codeSymbol) {
+        if (argc != c->arguments.count)
+            ParseError(c, "wrong number of arguments");
+        return VMTRUE;
+    }
+
+    /* check for a function that has been defined or called before */
+    if (!(function = FindFunction(c, symbol)))
+        return VMFALSE;
+
+    /* the first call of a function that isn't defined yet determines its argument count */
+    if (function->argc < 0)
+        function->argc = argc;
+    else if (argc != function->argc)
+        ParseError(c, "wrong number of arguments");
+    return VMTRUE;
+}
+
+/* MarkFunctions - mark the functions a piece of code refers to as used */
+static void MarkFunctions(ParseContext *c, const uint8_t *code, int size)
+{
+    const uint8_t *p = code, *end = code + size;
+    Function *function;
+    VMVALUE value;
+    int len, cnt;
+
+    while (p < end) {
+
+        /* assume everything is used if the code can't be decoded */
+        if ((len = InstrLength(*p)) < 0 || p + len > end) {
+            for (function = c->functions; function != NULL; function = function->next)
+                function->used = VMTRUE;
+            return;
+        }
+
+        /* functions are referenced through the address of their code vector (the last operand or a pooled constant) */
+        if (*p == OP_LIT || *p == OP_SLIT || *p == OP_WLIT || *p == OP_CLIT || *p == OP_RLIT || *p == OP_DCALL || *p == OP_TCALL) {
+            if (*p == OP_SLIT)
+                value = (int8_t)p[1];
+            else if (*p == OP_CLIT)
+                value = c->pool[p[1]];
+            else {
+                for (value = 0, cnt = (*p == OP_LIT || *p == OP_WLIT ? 1 : *p == OP_RLIT ? 2 : len - sizeof(VMWORD)); cnt < len; ++cnt)
+                    value = (value << 8) | p[cnt];
+            }
+            for (function = c->functions; function != NULL; function = function->next) {
+                if (!function->used && function->symbol->value == value) {
+                    function->used = VMTRUE;
+                    MarkFunctions(c, function->code, function->size);
+                }
+            }
+        }
+
+        p += len;
+    }
+}
+
+/* ResolveCalls - replace the code vector addresses in direct calls with the addresses of the code */
+static void ResolveCalls(ParseContext *c, uint8_t *code, int size)
+{
+    uint8_t *p = code, *end = code + size;
+    VMUVALUE vector, value;
+    int len;
+
+    while (p < end && (len = InstrLength(*p)) > 0) {
+        if (*p == OP_DCALL || *p == OP_TCALL) {
+            vector = (p[len - 2] << 8) | p[len - 1];
+            value = *(VMVALUE *)((uint8_t *)c->image + vector);
+            p[len - 2] = (uint8_t)(value >> 8);
+            p[len - 1] = (uint8_t)value;
+        }
+        p += len;
+    }
+}
+
 /* AddString - add a string to the string table */
 String *AddString(ParseContext *c, char *value)
 {
@@ -337,4 +607,3 @@ void PrintValue(VMVALUE value)
     for (i = sizeof(VMVALUE); --i >= 0 ; )
         VM_printf("%02x", (value >> (8 * i)) & 0xff);
 }
-
@@ -0,0 +1,427 @@
+/* db_cse.c - common subexpression elimination
+ *
+ * Copyright (c) 2014 by David Michael Betz.  All rights reserved.
+ *
+ */
+
+#include <string.h>
+#include "db_optimize.h"
+
+/* limits on what one run of the pass handles */
+#define MAXSTACK        32      /* operand stack entries tracked within a basic block */
+#define MAXSAVES        16      /* values saved in frame slots (the slots come out of the function's MAXNEWSLOTS) */
+#define MAXSTORES       32      /* stores to global variables tracked within a basic block */
+
+/* what a value number stands for */
+typedef struct {
+    int opcode;         /* operation (OP_LIT for all constants) */
+    VMVALUE operand;    /* operand of the instruction */
+    int args[2];        /* value numbers of the operands */
+    int version;        /* version of the variable or memory that is read */
+    int epoch;          /* number of stores through computed addresses or calls before the read */
+    int vn;             /* value number */
+} ValueKey;
+
+/* computation of a value within a basic block */
+typedef struct {
+    int vn;             /* value number */
+    int start;          /* first instruction */
+    int end;            /* instruction that pushes the value */
+    int size;           /* number of instructions */
+    int pure;           /* consecutive instructions without side effects that can be replaced */
+} Occurrence;
+
+/* state of the pass */
+typedef struct {
+    ParseContext *c;
+    Instr *code;                /* instructions */
+    int count;                  /* number of instructions */
+    ValueKey *keys;             /* value numbers of the computations in the current block */
+    int keyCount;               /* number of keys */
+    int nextVN;                 /* next value number */
+    Occurrence *occs;           /* computations in the current block in code order */
+    int occCount;               /* number of computations */
+    uint8_t *gone;              /* instructions replaced or deleted by the pass */
+    int versions[256];          /* versions of the local variables (by frame offset) */
+    VMVALUE stores[MAXSTORES];  /* global variables stored in the current block (by data section index) */
+    int storeCount;             /* number of stores to global variables */
+    int epoch;                  /* number of stores through computed addresses or calls */
+    int memory;                 /* number of stores to memory of any kind */
+    int saves[MAXSAVES][2];     /* values to save (instruction and frame offset) */
+    int saveCount;              /* number of values to save */
+} CseState;
+
+/* local function prototypes */
+static void NumberBlock(CseState *s, BasicBlock *block);
+static int ValueNumber(CseState *s, int opcode, VMVALUE operand, int *args, int version, int epoch);
+static int GlobalVersion(CseState *s, VMVALUE index);
+static void StoreGlobal(CseState *s, VMVALUE index);
+static int ReuseValues(CseState *s);
+static int ReuseValue(CseState *s, int vn);
+static int Intact(CseState *s, Occurrence *occ);
+static void ReplaceOccurrence(CseState *s, Occurrence *occ, int opcode, int operand);
+static int IsCommutative(int opcode);
+
+/* EliminateCommonSubexpressions - compute each value without side effects only once within a basic block */
+int EliminateCommonSubexpressions(ParseContext *c, Instr **pCode, int *pCount)
+{
+    Instr *code = *pCode;
+    int count = *pCount, changed = VMFALSE, slots = c->localMax, i, j;
+    uint8_t *savedFree;
+    CseState s;
+    Flow flow;
+
+    /* make room for saving values and for a frame */
+    if (!ReserveInstrs(c, code, count, 2 * MAXSAVES + 1))
+        return VMFALSE;
+    savedFree = c->localFree;
+
+    /* setup the pass state */
+    s.c = c;
+    s.code = code;
+    s.count = count;
+    s.saveCount = 0;
+    if (!BuildFlow(c, code, count, &flow)
+    ||  !(s.keys = (ValueKey *)OptimizerAlloc(c, count * sizeof(ValueKey)))
+    ||  !(s.occs = (Occurrence *)OptimizerAlloc(c, count * sizeof(Occurrence)))
+    ||  !(s.gone = (uint8_t *)OptimizerAlloc(c, count))) {
+        c->localFree = savedFree;
+        return VMFALSE;
+    }
+    memset(s.gone, 0, count);
+
+    /* number the values computed in each block and reuse the ones computed more than once */
+    for (i = 0; i < flow.blockCount; ++i) {
+        NumberBlock(&s, &flow.blocks[i]);
+        if (ReuseValues(&s))
+            changed = VMTRUE;
+    }
+    c->localFree = savedFree;
+
+    /* save the values that are reused later with DUP, LSET slot (the last one first so the instruction indices stay valid) */
+    while (--s.saveCount >= 0) {
+        for (i = j = 0; i <= s.saveCount; ++i)
+            if (s.saves[i][0] > s.saves[j][0])
+                j = i;
+        InsertInstrs(code, &count, s.saves[j][0] + 1, 2, VMFALSE);
+        SetOpcode(&code[s.saves[j][0] + 1], OP_DUP);
+        SetOpcode(&code[s.saves[j][0] + 2], OP_LSET);
+        code[s.saves[j][0] + 2].operand = s.saves[j][1];
+        s.saves[j][0] = s.saves[s.saveCount][0];
+        s.saves[j][1] = s.saves[s.saveCount][1];
+    }
+
+    /* make room in the frame for the slots */
+    if (c->localMax != slots)
+        UpdateFrame(c, code, &count);
+
+    *pCount = count;
+    return changed;
+}
+
+/* NumberBlock - find the value number of each value computed in a basic block */
+static void NumberBlock(CseState *s, BasicBlock *block)
+{
+    Instr *code = s->code;
+    int count = s->count, depth = 0, pops, pushes, next, args[2], i, k;
+    Occurrence stack[MAXSTACK], value;
+
+    s->keyCount = 0;
+    s->nextVN = 0;
+    s->occCount = 0;
+    s->storeCount = 0;
+    s->epoch = 0;
+    s->memory = 0;
+    memset(s->versions, 0, sizeof(s->versions));
+
+    for (i = block->first; i <= block->last; i = NextInstr(code, count, i)) {
+        Instr *instr = &code[i];
+
+        /* calls and other instructions with unknown stack effects can change any global variable */
+        if (!StackEffect(instr->opcode, &pops, &pushes)) {
+            depth = 0;
+            ++s->epoch;
+            ++s->memory;
+            continue;
+        }
+
+        /* stores make new versions of what they change */
+        switch (instr->opcode) {
+        case OP_LSET:
+        case OP_INCL:
+            ++s->versions[(uint8_t)instr->operand];
+            break;
+        case OP_GSTORE:
+        case OP_GSTOREW:
+        case OP_INCG:
+            StoreGlobal(s, instr->operand);
+            ++s->memory;
+            break;
+        case OP_STORE:
+        case OP_STOREB:
+        case OP_DSTORE:
+            ++s->epoch;
+            ++s->memory;
+            break;
+        }
+
+        /* a copy made by DUP has the value number of the original */
+        if (instr->opcode == OP_DUP) {
+            value.vn = (depth > 0 ? stack[depth - 1].vn : s->nextVN++);
+            value.start = value.end = i;
+            value.size = 1;
+            value.pure = VMFALSE;
+            pops = 0;
+        }
+
+        /* SWAP leaves the values alone but they are no longer computed by consecutive instructions */
+        else if (instr->opcode == OP_SWAP) {
+            if (depth < 2)
+                depth = 0;
+            else {
+                value = stack[depth - 1];
+                stack[depth - 1] = stack[depth - 2];
+                stack[depth - 2] = value;
+                stack[depth - 1].pure = stack[depth - 2].pure = VMFALSE;
+            }
+            continue;
+        }
+
+        /* find the operands of any other instruction */
+        else {
+            value.start = value.end = i;
+            value.size = 1;
+            value.pure = IsPureOp(instr->opcode);
+            args[0] = args[1] = -1;
+            if (pops > depth) {
+                value.pure = VMFALSE;
+                depth = pops = 0;
+                args[0] = s->nextVN++;
+            }
+            if (pops > 0) {
+                value.start = next = stack[depth - pops].start;
+                for (k = 0; k < pops; ++k) {
+                    Occurrence *arg = &stack[depth - pops + k];
+                    if (!arg->pure || arg->start != next)
+                        value.pure = VMFALSE;
+                    next = NextInstr(code, count, arg->end);
+                    value.size += arg->size;
+                    if (k < 2)
+                        args[k] = arg->vn;
+                }
+                if (next != i)
+                    value.pure = VMFALSE;
+                depth -= pops;
+            }
+            if (pushes == 0)
+                continue;
+
+            /* values read from variables or memory depend on the version of what is read */
+            switch (instr->opcode) {
+            case OP_LIT:
+            case OP_SLIT:
+                value.vn = ValueNumber(s, OP_LIT, instr->operand, args, 0, 0);
+                break;
+            case OP_LREF:
+                value.vn = ValueNumber(s, OP_LREF, instr->operand, args, s->versions[(uint8_t)instr->operand], 0);
+                break;
+            case OP_GLOAD:
+            case OP_GLOADW:
+                value.vn = ValueNumber(s, OP_GLOAD, instr->operand, args, GlobalVersion(s, instr->operand), s->epoch);
+                break;
+            case OP_LOAD:
+            case OP_LOADB:
+            case OP_DLOAD:
+                value.vn = ValueNumber(s, instr->opcode, 0, args, s->memory, 0);
+                break;
+            default:
+                if (IsPureOp(instr->opcode))
+                    value.vn = ValueNumber(s, instr->opcode, instr->operand, args, 0, 0);
+                else
+                    value.vn = s->nextVN++;
+                break;
+            }
+
+            /* remember where the value was computed */
+            if (IsPureOp(instr->opcode))
+                s->occs[s->occCount++] = value;
+        }
+
+        /* push the value (forgetting the bottom entry if there is no room) */
+        if (depth >= MAXSTACK) {
+            memmove(&stack[0], &stack[1], (MAXSTACK - 1) * sizeof(Occurrence));
+            --depth;
+        }
+        stack[depth++] = value;
+    }
+}
+
+/* ValueNumber - find or assign the value number of an operation */
+static int ValueNumber(CseState *s, int opcode, VMVALUE operand, int *args, int version, int epoch)
+{
+    ValueKey *key;
+    int a0 = args[0], a1 = args[1], i;
+
+    /* the order of the operands of a commutative operator doesn't matter */
+    if (IsCommutative(opcode) && a0 > a1) {
+        a0 = args[1];
+        a1 = args[0];
+    }
+
+    for (i = 0; i < s->keyCount; ++i) {
+        key = &s->keys[i];
+        if (key->opcode == opcode && key->operand == operand && key->args[0] == a0 && key->args[1] == a1
+        &&  key->version == version && key->epoch == epoch)
+            return key->vn;
+    }
+
+    key = &s->keys[s->keyCount++];
+    key->opcode = opcode;
+    key->operand = operand;
+    key->args[0] = a0;
+    key->args[1] = a1;
+    key->version = version;
+    key->epoch = epoch;
+    key->vn = s->nextVN++;
+    return key->vn;
+}
+
+/* GlobalVersion - get the version of a global variable (the number of stores to it in the current block) */
+static int GlobalVersion(CseState *s, VMVALUE index)
+{
+    int version = 0, i;
+    for (i = 0; i < s->storeCount; ++i)
+        if (s->stores[i] == index)
+            ++version;
+    return version;
+}
+
+/* StoreGlobal - make a new version of a global variable (all of them if there are too many stores to track) */
+static void StoreGlobal(CseState *s, VMVALUE index)
+{
+    if (s->storeCount >= MAXSTORES) {
+        s->storeCount = 0;
+        ++s->epoch;
+    }
+    s->stores[s->storeCount++] = index;
+}
+
+/* ReuseValues - reuse the values of the current block that are computed more than once (the largest computations first) */
+static int ReuseValues(CseState *s)
+{
+    int changed = VMFALSE, best, i, j;
+    uint8_t *done;
+
+    if (s->occCount < 2 || !(done = (uint8_t *)OptimizerAlloc(s->c, s->nextVN)))
+        return VMFALSE;
+    memset(done, 0, s->nextVN);
+
+    for (;;) {
+        for (i = 0, best = -1; i < s->occCount; ++i) {
+            Occurrence *occ = &s->occs[i];
+            if (!done[occ->vn] && occ->size >= 2 && (best < 0 || occ->size > s->occs[best].size)) {
+                for (j = i + 1; j < s->occCount && s->occs[j].vn != occ->vn; ++j)
+                    ;
+                if (j < s->occCount)
+                    best = i;
+                else
+                    done[occ->vn] = VMTRUE;
+            }
+        }
+        if (best < 0)
+            break;
+        done[s->occs[best].vn] = VMTRUE;
+        if (ReuseValue(s, s->occs[best].vn))
+            changed = VMTRUE;
+    }
+
+    return changed;
+}
+
+/* ReuseValue - replace the later computations of a value with a copy of the first one if that saves instructions */
+static int ReuseValue(CseState *s, int vn)
+{
+    Occurrence *src = NULL;
+    int gain = 0, slot = 0, adjacent, i;
+
+    /* find the first computation that is still there and add up what replacing the others would save */
+    for (i = 0; i < s->occCount; ++i) {
+        Occurrence *occ = &s->occs[i];
+        if (occ->vn != vn || !Intact(s, occ))
+            continue;
+        if (!src)
+            src = occ;
+        else if (occ->pure && occ->size >= 2) {
+            gain += occ->size - 1;
+            if (occ->start != NextInstr(s->code, s->count, src->end))
+                slot = -1;
+        }
+    }
+
+    /* a copy that isn't right after the first computation costs a DUP and an LSET to save the value in a frame slot */
+    if (!src || gain <= (slot ? 2 : 0))
+        return VMFALSE;
+    if (slot && (s->saveCount >= MAXSAVES || !(slot = NewSlot(s->c))))
+        return VMFALSE;
+
+    /* replace the later computations */
+    for (i = 0; i < s->occCount; ++i) {
+        Occurrence *occ = &s->occs[i];
+        if (occ == src || occ->vn != vn || !occ->pure || occ->size < 2 || !Intact(s, occ))
+            continue;
+        adjacent = (occ->start == NextInstr(s->code, s->count, src->end));
+        ReplaceOccurrence(s, occ, adjacent ? OP_DUP : OP_LREF, adjacent ? 0 : slot);
+    }
+
+    /* save the value after the first computation */
+    if (slot) {
+        s->saves[s->saveCount][0] = src->end;
+        s->saves[s->saveCount][1] = slot;
+        ++s->saveCount;
+    }
+
+    return VMTRUE;
+}
+
+/* Intact - check to see if the instructions of a computation are all still there */
+static int Intact(CseState *s, Occurrence *occ)
+{
+    int i;
+    for (i = occ->start; i <= occ->end; ++i)
+        if (s->gone[i])
+            return VMFALSE;
+    return VMTRUE;
+}
+
+/* ReplaceOccurrence - replace the instructions of a computation with a single instruction */
+static void ReplaceOccurrence(CseState *s, Occurrence *occ, int opcode, int operand)
+{
+    Instr *instr = &s->code[occ->start];
+    int i;
+
+    for (i = NextInstr(s->code, s->count, occ->start); i <= occ->end; i = NextInstr(s->code, s->count, i)) {
+        DeleteInstr(s->code, s->count, i);
+        s->gone[i] = VMTRUE;
+    }
+
+    SetOpcode(instr, opcode);
+    instr->operand = operand;
+    instr->operand2 = 0;
+    s->gone[occ->start] = VMTRUE;
+}
+
+/* IsCommutative - check to see if the order of the operands of an operator doesn't matter */
+static int IsCommutative(int opcode)
+{
+    switch (opcode) {
+    case OP_ADD:
+    case OP_MUL:
+    case OP_BAND:
+    case OP_BOR:
+    case OP_BXOR:
+    case OP_EQ:
+    case OP_NE:
+        return VMTRUE;
+    }
+    return VMFALSE;
+}
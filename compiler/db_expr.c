@@ -9,6 +9,7 @@
 #include "db_compiler.h"
 
 /* local function prototypes */
+static ParseTreeNode *ParseExpr1(ParseContext *c);
 static ParseTreeNode *ParseExpr2(ParseContext *c);
 static ParseTreeNode *ParseExpr3(ParseContext *c);
 static ParseTreeNode *ParseExpr4(ParseContext *c);
@@ -25,6 +26,13 @@ static ParseTreeNode *ParseCall(ParseContext *c, ParseTreeNode *functionNode);
 static ParseTreeNode *MakeUnaryOpNode(ParseContext *c, int op, ParseTreeNode *expr);
 static ParseTreeNode *MakeBinaryOpNode(ParseContext *c, int op, ParseTreeNode *left, ParseTreeNode *right);
 static ParseTreeNode *NewParseTreeNode(ParseContext *c, int type);
+static int IsSymbolDefined(ParseContext *c, char *name);
+static ParseTreeNode *SimplifyUnaryOp(ParseContext *c, ParseTreeNode *expr);
+static ParseTreeNode *SimplifyBinaryOp(ParseContext *c, ParseTreeNode *expr);
+static ParseTreeNode *SimplifyExprList(ParseContext *c, ParseTreeNode *expr);
+static ParseTreeNode *DerivedLit(ParseTreeNode *node);
+static VMVALUE FoldBinaryOp(ParseContext *c, int op, VMVALUE left, VMVALUE right, int derived);
+static int InvertComparison(int op);
 
 /* ParseRValue - parse and generate code for an r-value */
 void ParseRValue(ParseContext *c)
@@ -34,8 +42,14 @@ void ParseRValue(ParseContext *c)
     code_rvalue(c, expr);
 }
 
-/* ParseExpr - handle the OR operator */
+/* ParseExpr - parse an expression and simplify its parse tree */
 ParseTreeNode *ParseExpr(ParseContext *c)
+{
+    return SimplifyExpr(c, ParseExpr1(c));
+}
+
+/* ParseExpr1 - handle the OR operator */
+static ParseTreeNode *ParseExpr1(ParseContext *c)
 {
     ParseTreeNode *node;
     int tkn;
@@ -400,7 +414,7 @@ static ParseTreeNode *ParseArrayReference(ParseContext *c, ParseTreeNode *arrayN
     node->u.arrayRef.array = arrayNode;
 
     /* get the index expression */
-    node->u.arrayRef.index = ParseExpr(c);
+    node->u.arrayRef.index = ParseExpr1(c);
 
     /* check for the close bracket */
     FRequire(c, ']');
@@ -424,7 +438,7 @@ static ParseTreeNode *ParseCall(ParseContext *c, ParseTreeNode *functionNode)
         do {
             ExprListEntry *actual;
             actual = (ExprListEntry *)LocalAllocBasic(c, sizeof(ExprListEntry));
-            actual->expr = ParseExpr(c);
+            actual->expr = ParseExpr1(c);
             actual->next = NULL;
             *pLast = actual;
             pLast = &actual->next;
@@ -441,9 +455,10 @@ static ParseTreeNode *ParseCall(ParseContext *c, ParseTreeNode *functionNode)
 static ParseTreeNode *ParseSimplePrimary(ParseContext *c)
 {
     ParseTreeNode *node;
+    int ch;
     switch (GetToken(c)) {
     case '(':
-        node = ParseExpr(c);
+        node = ParseExpr1(c);
         FRequire(c,')');
         break;
     case T_NUMBER:
@@ -455,6 +470,11 @@ static ParseTreeNode *ParseSimplePrimary(ParseContext *c)
         node->u.stringLit.string = AddString(c, c->token);
         break;
     case T_IDENTIFIER:
+        /* calling an undefined name refers to a function defined later */
+        ch = SkipSpaces(c);
+        UngetC(c);
+        if (ch == '(' && !IsSymbolDefined(c, c->token))
+            AddForwardFunction(c, c->token);
         node = GetSymbolRef(c, c->token);
         break;
     default:
@@ -480,7 +500,7 @@ ParseTreeNode *GetSymbolRef(ParseContext *c, char *name)
         else {
             node->u.symbolRef.symbol = symbol;
             node->u.symbolRef.fcn = code_local;
-            node->u.symbolRef.offset = -symbol->value - 1;
+            node->u.symbolRef.offset = LOCALOFFSET(symbol->value);
         }
     }
 
@@ -515,6 +535,15 @@ ParseTreeNode *GetSymbolRef(ParseContext *c, char *name)
     return node;
 }
 
+/* IsSymbolDefined - check to see if a name refers to a local, argument or global symbol */
+static int IsSymbolDefined(ParseContext *c, char *name)
+{
+    if (c->codeType != CODE_TYPE_MAIN
+    &&  (FindSymbol(&c->locals, name) != NULL || FindSymbol(&c->arguments, name) != NULL))
+        return VMTRUE;
+    return FindSymbol(&c->globals, name) != NULL;
+}
+
 /* MakeUnaryOpNode - allocate a unary operation parse tree node */
 static ParseTreeNode *MakeUnaryOpNode(ParseContext *c, int op, ParseTreeNode *expr)
 {
@@ -534,6 +563,14 @@ static ParseTreeNode *MakeBinaryOpNode(ParseContext *c, int op, ParseTreeNode *l
     return node;
 }
 
+/* MakeIntegerLitNode - allocate an integer literal parse tree node */
+ParseTreeNode *MakeIntegerLitNode(ParseContext *c, VMVALUE value)
+{
+    ParseTreeNode *node = NewParseTreeNode(c, NodeTypeIntegerLit);
+    node->u.integerLit.value = value;
+    return node;
+}
+
 /* NewParseTreeNode - allocate a new parse tree node */
 static ParseTreeNode *NewParseTreeNode(ParseContext *c, int type)
 {
@@ -548,3 +585,373 @@ int IsIntegerLit(ParseTreeNode *node)
 {
     return node->nodeType == NodeTypeIntegerLit;
 }
+
+/* SimplifyExpr - fold constants and apply algebraic identities to a parse tree */
+ParseTreeNode *SimplifyExpr(ParseContext *c, ParseTreeNode *expr)
+{
+    ExprListEntry *entry;
+    switch (expr->nodeType) {
+    case NodeTypeUnaryOp:
+        expr->u.unaryOp.expr = SimplifyExpr(c, expr->u.unaryOp.expr);
+        return SimplifyUnaryOp(c, expr);
+    case NodeTypeBinaryOp:
+        expr->u.binaryOp.left = SimplifyExpr(c, expr->u.binaryOp.left);
+        expr->u.binaryOp.right = SimplifyExpr(c, expr->u.binaryOp.right);
+        return SimplifyBinaryOp(c, expr);
+    case NodeTypeArrayRef:
+        expr->u.arrayRef.index = SimplifyExpr(c, expr->u.arrayRef.index);
+        break;
+    case NodeTypeFunctionCall:
+        for (entry = expr->u.functionCall.args; entry != NULL; entry = entry->next)
+            entry->expr = SimplifyExpr(c, entry->expr);
+        break;
+    case NodeTypeDisjunction:
+    case NodeTypeConjunction:
+        return SimplifyExprList(c, expr);
+    }
+    return expr;
+}
+
+/* SimplifyUnaryOp - simplify a unary operation whose operand has already been simplified */
+static ParseTreeNode *SimplifyUnaryOp(ParseContext *c, ParseTreeNode *expr)
+{
+    ParseTreeNode *operand = expr->u.unaryOp.expr;
+    int op = expr->u.unaryOp.op;
+
+    /* fold constant operands */
+    if (IsIntegerLit(operand)) {
+        VMVALUE value = operand->u.integerLit.value;
+        switch (op) {
+        case OP_NEG:
+            value = (VMVALUE)-(VMUVALUE)value;
+            break;
+        case OP_NOT:
+            value = (value ? VMFALSE : VMTRUE);
+            break;
+        case OP_BNOT:
+            value = ~value;
+            break;
+        }
+        operand->u.integerLit.value = value;
+        return operand;
+    }
+
+    /* the rest are only done when optimizing */
+    if (!c->optimize)
+        return expr;
+
+    switch (op) {
+    case OP_NEG:
+    case OP_BNOT:
+        /* -(-x) and ~(~x) are just x */
+        if (operand->nodeType == NodeTypeUnaryOp && operand->u.unaryOp.op == op)
+            return operand->u.unaryOp.expr;
+        break;
+    case OP_NOT:
+        /* NOT of a comparison is the opposite comparison */
+        if (operand->nodeType == NodeTypeBinaryOp && InvertComparison(operand->u.binaryOp.op)) {
+            operand->u.binaryOp.op = InvertComparison(operand->u.binaryOp.op);
+            return operand;
+        }
+        break;
+    }
+
+    return expr;
+}
+
+/* SimplifyBinaryOp - simplify a binary operation whose operands have already been simplified */
+static ParseTreeNode *SimplifyBinaryOp(ParseContext *c, ParseTreeNode *expr)
+{
+    ParseTreeNode *left = expr->u.binaryOp.left;
+    ParseTreeNode *right = expr->u.binaryOp.right;
+    int op = expr->u.binaryOp.op;
+    VMVALUE value;
+
+    /* fold constant operands */
+    if (IsIntegerLit(left) && IsIntegerLit(right)) {
+        left->u.integerLit.derived |= right->u.integerLit.derived;
+        left->u.integerLit.value = FoldBinaryOp(c, op, left->u.integerLit.value, right->u.integerLit.value, left->u.integerLit.derived);
+        return left;
+    }
+
+    /* the rest are only done when optimizing */
+    if (!c->optimize)
+        return expr;
+
+    /* identities with a constant right operand */
+    if (IsIntegerLit(right)) {
+        value = right->u.integerLit.value;
+        switch (op) {
+        case OP_ADD:
+        case OP_SUB:
+        case OP_BOR:
+        case OP_BXOR:
+        case OP_SHL:
+        case OP_SHR:
+            if (value == 0)
+                return left;
+            break;
+        case OP_MUL:
+            if (value == 1)
+                return left;
+            else if (value == 0 && IsPure(left))
+                return DerivedLit(right);
+            else if (value == -1)
+                return MakeUnaryOpNode(c, OP_NEG, left);
+            break;
+        case OP_DIV:
+            if (value == 1)
+                return left;
+            break;
+        case OP_REM:
+            if ((value == 1 || value == -1) && IsPure(left))
+                return DerivedLit(MakeIntegerLitNode(c, 0));
+            break;
+        case OP_BAND:
+            if (value == 0 && IsPure(left))
+                return DerivedLit(right);
+            else if (value == -1)
+                return left;
+            break;
+        }
+    }
+
+    /* identities with a constant left operand */
+    else if (IsIntegerLit(left)) {
+        value = left->u.integerLit.value;
+        switch (op) {
+        case OP_ADD:
+        case OP_BOR:
+        case OP_BXOR:
+            if (value == 0)
+                return right;
+            break;
+        case OP_SUB:
+            if (value == 0)
+                return MakeUnaryOpNode(c, OP_NEG, right);
+            break;
+        case OP_MUL:
+            if (value == 1)
+                return right;
+            else if (value == 0 && IsPure(right))
+                return DerivedLit(left);
+            else if (value == -1)
+                return MakeUnaryOpNode(c, OP_NEG, right);
+            break;
+        case OP_BAND:
+            if (value == 0 && IsPure(right))
+                return DerivedLit(left);
+            else if (value == -1)
+                return right;
+            break;
+        case OP_SHL:
+        case OP_SHR:
+            if (value == 0 && IsPure(right))
+                return DerivedLit(left);
+            break;
+        }
+    }
+
+    /* identities with identical operands */
+    else if (IsPure(left) && SameExpr(left, right)) {
+        switch (op) {
+        case OP_SUB:
+        case OP_BXOR:
+        case OP_NE:
+        case OP_LT:
+        case OP_GT:
+            return DerivedLit(MakeIntegerLitNode(c, VMFALSE));
+        case OP_EQ:
+        case OP_LE:
+        case OP_GE:
+            return DerivedLit(MakeIntegerLitNode(c, VMTRUE));
+        case OP_BAND:
+        case OP_BOR:
+            return left;
+        }
+    }
+
+    return expr;
+}
+
+/* SimplifyExprList - simplify a disjunction or conjunction */
+static ParseTreeNode *SimplifyExprList(ParseContext *c, ParseTreeNode *expr)
+{
+    int isDisjunction = (expr->nodeType == NodeTypeDisjunction);
+    ExprListEntry *entry, **pNext;
+    int pure = VMTRUE, derived = VMFALSE;
+
+    /* a constant that decides the result ends the list and one that doesn't is skipped */
+    pNext = &expr->u.exprList.exprs;
+    while ((entry = *pNext) != NULL) {
+        entry->expr = SimplifyExpr(c, entry->expr);
+        if (IsIntegerLit(entry->expr)) {
+            int isTrue = (entry->expr->u.integerLit.value != 0);
+            if (isTrue == isDisjunction) {
+                entry->next = NULL;
+                break;
+            }
+
+            /* a false term in a disjunction has the same value as any false term before it
+               and a true term in a conjunction only matters if it is the last term */
+            else if (isDisjunction || entry->next) {
+                derived |= entry->expr->u.integerLit.derived;
+                *pNext = entry->next;
+                continue;
+            }
+        }
+        if (!IsPure(entry->expr))
+            pure = VMFALSE;
+        pNext = &entry->next;
+    }
+
+    /* all of the terms of a disjunction were false */
+    if (!(entry = expr->u.exprList.exprs)) {
+        expr = MakeIntegerLitNode(c, VMFALSE);
+        expr->u.integerLit.derived = derived;
+        return expr;
+    }
+
+    /* a single term is its own value */
+    if (!entry->next)
+        return entry->expr;
+
+    /* a conjunction ending with a false constant is false if the other terms have no side effects */
+    if (c->optimize && !isDisjunction && pure) {
+        while (entry->next)
+            entry = entry->next;
+        if (IsIntegerLit(entry->expr) && entry->expr->u.integerLit.value == 0)
+            return DerivedLit(entry->expr);
+    }
+
+    return expr;
+}
+
+/* DerivedLit - mark a literal that replaces an expression only because of an optimizing identity */
+static ParseTreeNode *DerivedLit(ParseTreeNode *node)
+{
+    node->u.integerLit.derived = VMTRUE;
+    return node;
+}
+
+/* FoldBinaryOp - compute the value of a binary operation on constants the way the VM does */
+static VMVALUE FoldBinaryOp(ParseContext *c, int op, VMVALUE left, VMVALUE right, int derived)
+{
+    switch (op) {
+    case OP_ADD:
+        return (VMVALUE)((VMUVALUE)left + (VMUVALUE)right);
+    case OP_SUB:
+        return (VMVALUE)((VMUVALUE)left - (VMUVALUE)right);
+    case OP_MUL:
+        return (VMVALUE)((VMUVALUE)left * (VMUVALUE)right);
+    case OP_DIV:
+        if (right == 0) {
+            /* only a zero divisor written in the source is an error (the VM divides by zero as zero) */
+            if (!derived)
+                ParseError(c, "division by zero in constant expression");
+            return 0;
+        }
+        return right == -1 ? (VMVALUE)-(VMUVALUE)left : left / right;
+    case OP_REM:
+        if (right == 0) {
+            if (!derived)
+                ParseError(c, "division by zero in constant expression");
+            return 0;
+        }
+        return right == -1 ? 0 : left % right;
+    case OP_BAND:
+        return left & right;
+    case OP_BOR:
+        return left | right;
+    case OP_BXOR:
+        return left ^ right;
+    case OP_SHL:
+        return left << right;
+    case OP_SHR:
+        return left >> right;
+    case OP_LT:
+        return left < right ? VMTRUE : VMFALSE;
+    case OP_LE:
+        return left <= right ? VMTRUE : VMFALSE;
+    case OP_EQ:
+        return left == right ? VMTRUE : VMFALSE;
+    case OP_NE:
+        return left != right ? VMTRUE : VMFALSE;
+    case OP_GE:
+        return left >= right ? VMTRUE : VMFALSE;
+    case OP_GT:
+        return left > right ? VMTRUE : VMFALSE;
+    }
+    return 0; /* not reached */
+}
+
+/* InvertComparison - get the opposite of a comparison operator (zero if it isn't one) */
+static int InvertComparison(int op)
+{
+    switch (op) {
+    case OP_LT:
+        return OP_GE;
+    case OP_LE:
+        return OP_GT;
+    case OP_EQ:
+        return OP_NE;
+    case OP_NE:
+        return OP_EQ;
+    case OP_GE:
+        return OP_LT;
+    case OP_GT:
+        return OP_LE;
+    }
+    return 0;
+}
+
+/* IsPure - check to see if evaluating an expression has no side effects */
+int IsPure(ParseTreeNode *expr)
+{
+    ExprListEntry *entry;
+    switch (expr->nodeType) {
+    case NodeTypeUnaryOp:
+        return IsPure(expr->u.unaryOp.expr);
+    case NodeTypeBinaryOp:
+        return IsPure(expr->u.binaryOp.left) && IsPure(expr->u.binaryOp.right);
+    case NodeTypeArrayRef:
+        return IsPure(expr->u.arrayRef.array) && IsPure(expr->u.arrayRef.index);
+    case NodeTypeFunctionCall:
+        return VMFALSE;
+    case NodeTypeDisjunction:
+    case NodeTypeConjunction:
+        for (entry = expr->u.exprList.exprs; entry != NULL; entry = entry->next)
+            if (!IsPure(entry->expr))
+                return VMFALSE;
+        break;
+    }
+    return VMTRUE;
+}
+
+/* SameExpr - check to see if two expressions always compute the same value */
+int SameExpr(ParseTreeNode *expr, ParseTreeNode *expr2)
+{
+    if (expr->nodeType != expr2->nodeType)
+        return VMFALSE;
+    switch (expr->nodeType) {
+    case NodeTypeSymbolRef:
+        return expr->u.symbolRef.symbol == expr2->u.symbolRef.symbol
+            && expr->u.symbolRef.fcn == expr2->u.symbolRef.fcn
+            && expr->u.symbolRef.offset == expr2->u.symbolRef.offset;
+    case NodeTypeStringLit:
+        return expr->u.stringLit.string == expr2->u.stringLit.string;
+    case NodeTypeIntegerLit:
+        return expr->u.integerLit.value == expr2->u.integerLit.value;
+    case NodeTypeUnaryOp:
+        return expr->u.unaryOp.op == expr2->u.unaryOp.op
+            && SameExpr(expr->u.unaryOp.expr, expr2->u.unaryOp.expr);
+    case NodeTypeBinaryOp:
+        return expr->u.binaryOp.op == expr2->u.binaryOp.op
+            && SameExpr(expr->u.binaryOp.left, expr2->u.binaryOp.left)
+            && SameExpr(expr->u.binaryOp.right, expr2->u.binaryOp.right);
+    case NodeTypeArrayRef:
+        return SameExpr(expr->u.arrayRef.array, expr2->u.arrayRef.array)
+            && SameExpr(expr->u.arrayRef.index, expr2->u.arrayRef.index);
+    }
+    return VMFALSE;
+}
@@ -0,0 +1,536 @@
+/* db_flow.c - control flow graph and the optimizer passes that use it
+ *
+ * Copyright (c) 2014 by David Michael Betz.  All rights reserved.
+ *
+ */
+
+#include <string.h>
+#include "db_optimize.h"
+
+/* limits on what is tracked within a basic block */
+#define MAXSTACK        32      /* operand stack entries */
+#define MAXFACTS        32      /* variables with known values */
+
+/* kinds of known values */
+#define REF_NONE        0       /* nothing is known */
+#define REF_CONST       1       /* a constant */
+#define REF_LOCAL       2       /* the value of a local variable (by frame offset) */
+#define REF_GLOBAL      3       /* the value of a global variable (by data section index) */
+
+/* known value */
+typedef struct {
+    int kind;           /* kind of value */
+    VMVALUE value;      /* constant, frame offset or data section index */
+} Ref;
+
+/* variable with a known value */
+typedef struct {
+    Ref var;            /* variable */
+    Ref value;          /* its value */
+} Fact;
+
+/* copy propagation state within a basic block */
+typedef struct {
+    Ref stack[MAXSTACK];    /* what is known about each operand stack entry */
+    int depth;              /* number of operand stack entries */
+    Fact facts[MAXFACTS];   /* variables with known values */
+    int factCount;          /* number of facts */
+} CopyState;
+
+/* value computed within a basic block */
+typedef struct {
+    int start;          /* first instruction computing the value */
+    int end;            /* instruction that pushes the value */
+    int pure;           /* computed by consecutive instructions without side effects */
+    int dup;            /* last DUP that copied the value or -1 if none did */
+} Value;
+
+/* local function prototypes */
+static int EndsBlock(Instr *instr);
+static int CopyInstr(CopyState *s, Instr *instr);
+static int VarRef(Instr *instr, Ref *ref);
+static Ref *FindFact(CopyState *s, Ref *var);
+static void AddFact(CopyState *s, Ref *var, Ref *value);
+static void KillRef(CopyState *s, Ref *var);
+static void KillGlobals(CopyState *s);
+static void PushRef(CopyState *s, int kind, VMVALUE value);
+static Ref PopRef(CopyState *s);
+static int SameRef(Ref *ref, Ref *ref2);
+static void PushValue(Value *stack, int *pDepth, Value *value);
+
+/* BuildFlow - divide the code into basic blocks and link them into a control flow graph or return VMFALSE if there isn't enough memory
+   (the branch target flags must be current) */
+int BuildFlow(ParseContext *c, Instr *code, int count, Flow *flow)
+{
+    int leader, next, target, prev, b, i, n;
+    BasicBlock *block;
+
+    /* number the blocks and find the block of each instruction */
+    if (!(flow->blockOf = (int *)OptimizerAlloc(c, count * sizeof(int))))
+        return VMFALSE;
+    leader = VMTRUE;
+    for (i = n = 0; i < count; ++i) {
+        if (code[i].flags & INSTR_DELETED) {
+            flow->blockOf[i] = -1;
+            continue;
+        }
+        if (leader || (code[i].flags & INSTR_TARGET))
+            ++n;
+        flow->blockOf[i] = n - 1;
+        leader = EndsBlock(&code[i]);
+    }
+
+    /* find the first and last instruction of each block */
+    if (!(flow->blocks = (BasicBlock *)OptimizerAlloc(c, (n > 0 ? n : 1) * sizeof(BasicBlock))))
+        return VMFALSE;
+    for (i = 0, prev = -1; i < count; ++i) {
+        if ((b = flow->blockOf[i]) < 0)
+            continue;
+        if (b != prev)
+            flow->blocks[b].first = i;
+        flow->blocks[b].last = i;
+        prev = b;
+    }
+
+    /* link each block to the blocks that can follow it (the entries of a jump table fall through to the next entry) */
+    for (i = 0; i < n; ++i) {
+        Instr *last;
+        int k = 0;
+        block = &flow->blocks[i];
+        last = &code[block->last];
+        block->succ[0] = block->succ[1] = -1;
+        if ((FallsThrough(last->opcode) || (last->flags & INSTR_TABLE))
+        &&  (next = NextInstr(code, count, block->last)) < count)
+            block->succ[k++] = flow->blockOf[next];
+        if (IsBranch(last->fmt)
+        &&  (target = ResolveTarget(code, count, last->target)) < count
+        &&  (k == 0 || flow->blockOf[target] != block->succ[0]))
+            block->succ[k++] = flow->blockOf[target];
+    }
+
+    flow->code = code;
+    flow->count = count;
+    flow->blockCount = n;
+    return VMTRUE;
+}
+
+/* EndsBlock - check to see if an instruction is the last one in its basic block */
+static int EndsBlock(Instr *instr)
+{
+    return IsBranch(instr->fmt) || !FallsThrough(instr->opcode) || instr->opcode == OP_JUMPTABLE;
+}
+
+/* StackEffect - get the number of operand stack entries an instruction pops and pushes or return VMFALSE if it isn't fixed */
+int StackEffect(int opcode, int *pPops, int *pPushes)
+{
+    switch (opcode) {
+    case OP_LIT:
+    case OP_SLIT:
+    case OP_LREF:
+    case OP_GLOAD:
+    case OP_GLOADW:
+        *pPops = 0;
+        *pPushes = 1;
+        break;
+    case OP_NOT:
+    case OP_NEG:
+    case OP_BNOT:
+    case OP_LOAD:
+    case OP_LOADB:
+    case OP_DLOAD:
+    case OP_TLOAD:
+    case OP_DIVP2:
+    case OP_REMP2:
+    case OP_FORNEXT:
+        *pPops = 1;
+        *pPushes = 1;
+        break;
+    case OP_ADD:
+    case OP_SUB:
+    case OP_MUL:
+    case OP_DIV:
+    case OP_REM:
+    case OP_BAND:
+    case OP_BOR:
+    case OP_BXOR:
+    case OP_SHL:
+    case OP_SHR:
+    case OP_LT:
+    case OP_LE:
+    case OP_EQ:
+    case OP_NE:
+    case OP_GE:
+    case OP_GT:
+    case OP_INDEX:
+        *pPops = 2;
+        *pPushes = 1;
+        break;
+    case OP_DUP:
+        *pPops = 1;
+        *pPushes = 2;
+        break;
+    case OP_SWAP:
+        *pPops = 2;
+        *pPushes = 2;
+        break;
+    case OP_DROP:
+    case OP_LSET:
+    case OP_GSTORE:
+    case OP_GSTOREW:
+    case OP_BRT:
+    case OP_BRF:
+    case OP_JUMPTABLE:
+        *pPops = 1;
+        *pPushes = 0;
+        break;
+    case OP_STORE:
+    case OP_STOREB:
+    case OP_DSTORE:
+        *pPops = 2;
+        *pPushes = 0;
+        break;
+    case OP_BR:
+    case OP_INCL:
+    case OP_INCG:
+        *pPops = 0;
+        *pPushes = 0;
+        break;
+    default:
+        return VMFALSE;
+    }
+    return VMTRUE;
+}
+
+/* IsPureOp - check to see if an instruction computes a value without side effects */
+int IsPureOp(int opcode)
+{
+    int pops, pushes;
+    switch (opcode) {
+    case OP_FORNEXT:
+    case OP_SWAP:
+        return VMFALSE;
+    }
+    return StackEffect(opcode, &pops, &pushes) && pushes > 0;
+}
+
+/* PropagateCopies - replace loads of variables known to hold a constant or a copy of another variable within each basic block */
+int PropagateCopies(ParseContext *c, Instr **pCode, int *pCount)
+{
+    Instr *code = *pCode;
+    int count = *pCount, changed = VMFALSE, i, j;
+    uint8_t *savedFree = c->localFree;
+    CopyState s;
+    Flow flow;
+
+    if (!BuildFlow(c, code, count, &flow))
+        return VMFALSE;
+
+    for (i = 0; i < flow.blockCount; ++i) {
+        s.depth = s.factCount = 0;
+        for (j = flow.blocks[i].first; j <= flow.blocks[i].last; j = NextInstr(code, count, j))
+            if (CopyInstr(&s, &code[j]))
+                changed = VMTRUE;
+    }
+
+    c->localFree = savedFree;
+    return changed;
+}
+
+/* CopyInstr - track the values known after an instruction and return VMTRUE if the instruction was replaced */
+static int CopyInstr(CopyState *s, Instr *instr)
+{
+    int changed = VMFALSE, pops, pushes;
+    Ref var, value, *known;
+
+    switch (instr->opcode) {
+    case OP_LIT:
+    case OP_SLIT:
+        PushRef(s, REF_CONST, instr->operand);
+        break;
+
+    /* load a short constant or another variable with the same value instead of the variable */
+    case OP_LREF:
+    case OP_GLOAD:
+    case OP_GLOADW:
+        VarRef(instr, &var);
+        value = ((known = FindFact(s, &var)) != NULL ? *known : var);
+        if (value.kind == REF_CONST && value.value >= -128 && value.value <= 127) {
+            SetOpcode(instr, OP_SLIT);
+            instr->operand = value.value;
+            changed = VMTRUE;
+        }
+        else if (value.kind == REF_LOCAL && var.kind == REF_LOCAL && value.value != var.value) {
+            instr->operand = value.value;
+            changed = VMTRUE;
+        }
+        else if (value.kind == REF_GLOBAL && var.kind == REF_GLOBAL && value.value != var.value
+             &&  (value.value <= 0xff || instr->opcode == OP_GLOADW)) {
+            SetOpcode(instr, value.value <= 0xff ? OP_GLOAD : OP_GLOADW);
+            instr->operand = value.value;
+            changed = VMTRUE;
+        }
+        PushRef(s, value.kind, value.value);
+        break;
+
+    /* a store makes the variable a copy of the value */
+    case OP_LSET:
+    case OP_GSTORE:
+    case OP_GSTOREW:
+        VarRef(instr, &var);
+        value = PopRef(s);
+        KillRef(s, &var);
+        if (value.kind != REF_NONE && !SameRef(&value, &var))
+            AddFact(s, &var, &value);
+        break;
+
+    /* incrementing a variable with a known constant value gives another constant */
+    case OP_INCL:
+    case OP_INCG:
+        VarRef(instr, &var);
+        value.kind = REF_NONE;
+        if ((known = FindFact(s, &var)) != NULL && known->kind == REF_CONST) {
+            value.kind = REF_CONST;
+            value.value = known->value + instr->operand2;
+        }
+        KillRef(s, &var);
+        if (value.kind != REF_NONE)
+            AddFact(s, &var, &value);
+        break;
+
+    case OP_DUP:
+        value = PopRef(s);
+        PushRef(s, value.kind, value.value);
+        PushRef(s, value.kind, value.value);
+        break;
+
+    case OP_SWAP:
+        value = PopRef(s);
+        var = PopRef(s);
+        PushRef(s, value.kind, value.value);
+        PushRef(s, var.kind, var.value);
+        break;
+
+    /* a store through an address can change any global variable */
+    case OP_STORE:
+    case OP_STOREB:
+    case OP_DSTORE:
+        PopRef(s);
+        PopRef(s);
+        KillGlobals(s);
+        break;
+
+    default:
+
+        /* calls and other instructions with unknown stack effects end what is known about the stack and the globals */
+        if (!StackEffect(instr->opcode, &pops, &pushes)) {
+            s->depth = 0;
+            KillGlobals(s);
+        }
+        else {
+            while (--pops >= 0)
+                PopRef(s);
+            while (--pushes >= 0)
+                PushRef(s, REF_NONE, 0);
+        }
+        break;
+    }
+
+    return changed;
+}
+
+/* VarRef - get the variable an instruction refers to */
+static int VarRef(Instr *instr, Ref *ref)
+{
+    switch (instr->opcode) {
+    case OP_LREF:
+    case OP_LSET:
+    case OP_INCL:
+        ref->kind = REF_LOCAL;
+        break;
+    case OP_GLOAD:
+    case OP_GSTORE:
+    case OP_GLOADW:
+    case OP_GSTOREW:
+    case OP_INCG:
+        ref->kind = REF_GLOBAL;
+        break;
+    default:
+        ref->kind = REF_NONE;
+        return VMFALSE;
+    }
+    ref->value = instr->operand;
+    return VMTRUE;
+}
+
+/* FindFact - find the known value of a variable */
+static Ref *FindFact(CopyState *s, Ref *var)
+{
+    int i;
+    for (i = 0; i < s->factCount; ++i)
+        if (SameRef(&s->facts[i].var, var))
+            return &s->facts[i].value;
+    return NULL;
+}
+
+/* AddFact - remember the value of a variable (forgetting the oldest fact if there is no room) */
+static void AddFact(CopyState *s, Ref *var, Ref *value)
+{
+    if (s->factCount >= MAXFACTS) {
+        memmove(&s->facts[0], &s->facts[1], (MAXFACTS - 1) * sizeof(Fact));
+        --s->factCount;
+    }
+    s->facts[s->factCount].var = *var;
+    s->facts[s->factCount].value = *value;
+    ++s->factCount;
+}
+
+/* KillRef - forget everything that depends on the value of a variable */
+static void KillRef(CopyState *s, Ref *var)
+{
+    int i, j;
+    for (i = j = 0; i < s->factCount; ++i)
+        if (!SameRef(&s->facts[i].var, var) && !SameRef(&s->facts[i].value, var))
+            s->facts[j++] = s->facts[i];
+    s->factCount = j;
+    for (i = 0; i < s->depth; ++i)
+        if (SameRef(&s->stack[i], var))
+            s->stack[i].kind = REF_NONE;
+}
+
+/* KillGlobals - forget everything that depends on the value of a global variable */
+static void KillGlobals(CopyState *s)
+{
+    int i, j;
+    for (i = j = 0; i < s->factCount; ++i)
+        if (s->facts[i].var.kind != REF_GLOBAL && s->facts[i].value.kind != REF_GLOBAL)
+            s->facts[j++] = s->facts[i];
+    s->factCount = j;
+    for (i = 0; i < s->depth; ++i)
+        if (s->stack[i].kind == REF_GLOBAL)
+            s->stack[i].kind = REF_NONE;
+}
+
+/* PushRef - push what is known about a value onto the operand stack (forgetting the bottom entry if there is no room) */
+static void PushRef(CopyState *s, int kind, VMVALUE value)
+{
+    if (s->depth >= MAXSTACK) {
+        memmove(&s->stack[0], &s->stack[1], (MAXSTACK - 1) * sizeof(Ref));
+        --s->depth;
+    }
+    s->stack[s->depth].kind = kind;
+    s->stack[s->depth].value = value;
+    ++s->depth;
+}
+
+/* PopRef - pop what is known about a value from the operand stack (nothing is known about entries from before the block) */
+static Ref PopRef(CopyState *s)
+{
+    Ref ref;
+    if (s->depth > 0)
+        return s->stack[--s->depth];
+    ref.kind = REF_NONE;
+    ref.value = 0;
+    return ref;
+}
+
+/* SameRef - check to see if two references are to the same value */
+static int SameRef(Ref *ref, Ref *ref2)
+{
+    return ref->kind != REF_NONE && ref->kind == ref2->kind && ref->value == ref2->value;
+}
+
+/* RemoveDeadValues - remove the code computing values that are only dropped */
+int RemoveDeadValues(ParseContext *c, Instr **pCode, int *pCount)
+{
+    Instr *code = *pCode;
+    int count = *pCount, changed = VMFALSE, depth, pops, pushes, next, i, j, k;
+    uint8_t *savedFree = c->localFree;
+    Value stack[MAXSTACK], value;
+    Flow flow;
+
+    if (!BuildFlow(c, code, count, &flow))
+        return VMFALSE;
+
+    for (i = 0; i < flow.blockCount; ++i) {
+        depth = 0;
+        for (j = flow.blocks[i].first; j <= flow.blocks[i].last; j = NextInstr(code, count, j)) {
+            Instr *instr = &code[j];
+
+            /* the copy made by a DUP was used in place of a value that is dropped */
+            if (instr->opcode == OP_DROP && depth > 0 && stack[depth - 1].dup >= 0) {
+                DeleteInstr(code, count, stack[--depth].dup);
+                DeleteInstr(code, count, j);
+                changed = VMTRUE;
+                continue;
+            }
+
+            /* delete a value without side effects along with the DROP */
+            if (instr->opcode == OP_DROP && depth > 0 && stack[depth - 1].pure) {
+                value = stack[--depth];
+                for (k = value.start; k <= value.end; k = NextInstr(code, count, k))
+                    DeleteInstr(code, count, k);
+                if (depth > 0 && stack[depth - 1].dup == value.end)
+                    stack[depth - 1].dup = -1;
+                DeleteInstr(code, count, j);
+                changed = VMTRUE;
+                continue;
+            }
+
+            /* start over after an instruction with an unknown stack effect */
+            if (!StackEffect(instr->opcode, &pops, &pushes)) {
+                depth = 0;
+                continue;
+            }
+
+            /* a value is pure if it is computed by a pure instruction directly following the code for its operands */
+            value.start = value.end = j;
+            value.pure = IsPureOp(instr->opcode);
+            value.dup = -1;
+            if (instr->opcode == OP_DUP) {
+                if (depth > 0)
+                    stack[depth - 1].dup = j;
+                pops = 0;
+            }
+            else if (pops > depth) {
+                value.pure = VMFALSE;
+                depth = 0;
+                pops = 0;
+            }
+            if (pops > 0) {
+                value.start = next = stack[depth - pops].start;
+                for (k = depth - pops; k < depth; ++k) {
+                    if (!stack[k].pure || stack[k].start != next)
+                        value.pure = VMFALSE;
+                    next = NextInstr(code, count, stack[k].end);
+                }
+                if (next != j)
+                    value.pure = VMFALSE;
+                depth -= pops;
+            }
+
+            /* only DUP and SWAP push more than one value */
+            if (instr->opcode == OP_DUP)
+                pushes = 1;
+            else if (instr->opcode == OP_SWAP) {
+                Value other = { j, j, VMFALSE, -1 };
+                PushValue(stack, &depth, &other);
+                pushes = 1;
+            }
+            if (pushes > 0)
+                PushValue(stack, &depth, &value);
+        }
+    }
+
+    c->localFree = savedFree;
+    return changed;
+}
+
+/* PushValue - push a value onto the simulated operand stack (forgetting the bottom entry if there is no room) */
+static void PushValue(Value *stack, int *pDepth, Value *value)
+{
+    if (*pDepth >= MAXSTACK) {
+        memmove(&stack[0], &stack[1], (MAXSTACK - 1) * sizeof(Value));
+        --*pDepth;
+    }
+    stack[(*pDepth)++] = *value;
+}
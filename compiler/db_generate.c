@@ -8,13 +8,17 @@
 
 /* local function prototypes */
 static void code_expr(ParseContext *c, ParseTreeNode *expr, PVAL *pv);
+static void code_binaryop(ParseContext *c, ParseTreeNode *expr);
+static void code_operator(ParseContext *c, int op, ParseTreeNode *right);
+static int code_increment(ParseContext *c, PVAL *pv, VMVALUE delta);
+static int log2lit(ParseTreeNode *expr);
 static void code_shortcircuit(ParseContext *c, int op, ParseTreeNode *expr, PVAL *pv);
 static void code_arrayref(ParseContext *c, ParseTreeNode *expr, PVAL *pv);
 static void code_call(ParseContext *c, ParseTreeNode *expr, PVAL *pv);
 static void code_index(ParseContext *c, PValOp fcn, PVAL *pv);
+static void code_dataindex(ParseContext *c, PValOp fcn, PVAL *pv);
 static VMWORD rd_cword(ParseContext *c, VMUVALUE off);
 static void wr_cword(ParseContext *c, VMUVALUE off, VMWORD v);
-static int putclong(ParseContext *c, VMVALUE v);
 static void wr_clong(ParseContext *c, VMUVALUE off, VMVALUE v);
 
 /* code_lvalue - generate code for an l-value expression */
@@ -32,10 +36,118 @@ void code_rvalue(ParseContext *c, ParseTreeNode *expr)
     rvalue(c, &pv);
 }
 
+/* code_assign - generate code to assign the value of an expression to an l-value */
+void code_assign(ParseContext *c, ParseTreeNode *lvalue, ParseTreeNode *expr)
+{
+    PVAL pv;
+
+    /* x = x op y is the same as x op= y as long as computing the address of x only once changes nothing */
+    if (expr->nodeType == NodeTypeBinaryOp
+    &&  SameExpr(lvalue, expr->u.binaryOp.left)
+    &&  (lvalue->nodeType == NodeTypeSymbolRef || (IsPure(lvalue) && IsPure(expr->u.binaryOp.right)))) {
+        code_update(c, lvalue, expr->u.binaryOp.op, expr->u.binaryOp.right);
+        return;
+    }
+
+    code_rvalue(c, expr);
+    code_lvalue(c, lvalue, &pv);
+    (*pv.fcn)(c, PV_STORE, &pv);
+}
+
+/* code_update - generate code to combine an l-value with the value of an expression in place */
+void code_update(ParseContext *c, ParseTreeNode *lvalue, int op, ParseTreeNode *expr)
+{
+    PVAL pv;
+
+    code_lvalue(c, lvalue, &pv);
+
+    /* add a small constant to a scalar variable without loading it */
+    if ((op == OP_ADD || op == OP_SUB) && IsIntegerLit(expr)) {
+        VMVALUE delta = (op == OP_ADD ? expr->u.integerLit.value : -expr->u.integerLit.value);
+        if (delta >= -128 && delta <= 127 && code_increment(c, &pv, delta))
+            return;
+    }
+
+    /* the address of an array element is computed once and used for both the load and the store */
+    if (pv.fcn != code_local && pv.fcn != code_global) {
+        putcbyte(c, OP_DUP);
+        (*pv.fcn)(c, PV_LOAD, &pv);
+        code_operator(c, op, expr);
+        putcbyte(c, OP_SWAP);
+    }
+    else {
+        (*pv.fcn)(c, PV_LOAD, &pv);
+        code_operator(c, op, expr);
+    }
+    (*pv.fcn)(c, PV_STORE, &pv);
+}
+
+/* code_increment - add a constant to a local or data section global variable or return VMFALSE if it can't be done in place */
+static int code_increment(ParseContext *c, PVAL *pv, VMVALUE delta)
+{
+    VMUVALUE addr;
+
+    if (pv->fcn == code_local) {
+        if (delta != 0) {
+            putcbyte(c, OP_INCL);
+            putcbyte(c, pv->u.val);
+            putcbyte(c, delta);
+        }
+        return VMTRUE;
+    }
+
+    if (pv->fcn == code_global && (addr = (VMUVALUE)pv->u.sym->value) >= DATA_OFFSET) {
+        VMUVALUE index = (addr - DATA_OFFSET) / sizeof(VMVALUE);
+        if (index <= 0xff) {
+            if (delta != 0) {
+                putcbyte(c, OP_INCG);
+                putcbyte(c, index);
+                putcbyte(c, delta);
+            }
+            return VMTRUE;
+        }
+    }
+
+    return VMFALSE;
+}
+
+/* code_tailcall - generate a call that replaces the current frame or return VMFALSE if it isn't a direct call */
+int code_tailcall(ParseContext *c, ParseTreeNode *expr)
+{
+    ExprListEntry *arg;
+
+    /* only a direct call knows the address to jump to */
+    if (expr->nodeType != NodeTypeFunctionCall || !IsDirectCall(c, expr))
+        return VMFALSE;
+
+    /* code each argument expression */
+    for (arg = expr->u.functionCall.args; arg != NULL; arg = arg->next)
+        code_rvalue(c, arg->expr);
+
+    /* the arguments replace those of the current function */
+    putcbyte(c, OP_TCALL);
+    putcbyte(c, expr->u.functionCall.argc);
+    putcbyte(c, c->arguments.count);
+    putcword(c, expr->u.functionCall.fcn->u.symbolRef.symbol->value);
+    return VMTRUE;
+}
+
+/* code_lit - generate code to push an integer literal */
+void code_lit(ParseContext *c, VMVALUE value)
+{
+    if (value >= -128 && value <= 127) {
+        putcbyte(c, OP_SLIT);
+        putcbyte(c, value);
+    }
+    else {
+        putcbyte(c, OP_LIT);
+        putclong(c, value);
+    }
+}
+
 /* code_expr - generate code for an expression parse tree */
 static void code_expr(ParseContext *c, ParseTreeNode *expr, PVAL *pv)
 {
-    VMVALUE ival;
     switch (expr->nodeType) {
     case NodeTypeSymbolRef:
         pv->fcn = expr->u.symbolRef.fcn;
@@ -50,15 +162,7 @@ static void code_expr(ParseContext *c, ParseTreeNode *expr, PVAL *pv)
         pv->fcn = NULL;
         break;
     case NodeTypeIntegerLit:
-        ival = expr->u.integerLit.value;
-        if (ival >= -128 && ival <= 127) {
-            putcbyte(c, OP_SLIT);
-            putcbyte(c, ival);
-        }
-        else {
-            putcbyte(c, OP_LIT);
-            putclong(c, ival);
-        }
+        code_lit(c, expr->u.integerLit.value);
         pv->fcn = NULL;
         break;
     case NodeTypeUnaryOp:
@@ -67,9 +171,7 @@ static void code_expr(ParseContext *c, ParseTreeNode *expr, PVAL *pv)
         pv->fcn = NULL;
         break;
     case NodeTypeBinaryOp:
-        code_rvalue(c, expr->u.binaryOp.left);
-        code_rvalue(c, expr->u.binaryOp.right);
-        putcbyte(c, expr->u.binaryOp.op);
+        code_binaryop(c, expr);
         pv->fcn = NULL;
         break;
     case NodeTypeArrayRef:
@@ -87,6 +189,62 @@ static void code_expr(ParseContext *c, ParseTreeNode *expr, PVAL *pv)
     }
 }
 
+/* code_binaryop - generate code for a binary operator using shifts for powers of two */
+static void code_binaryop(ParseContext *c, ParseTreeNode *expr)
+{
+    ParseTreeNode *left = expr->u.binaryOp.left;
+    ParseTreeNode *right = expr->u.binaryOp.right;
+    int op = expr->u.binaryOp.op;
+
+    /* put a constant multiplier on the right */
+    if (op == OP_MUL && log2lit(left) > 0) {
+        right = left;
+        left = expr->u.binaryOp.right;
+    }
+
+    code_rvalue(c, left);
+    code_operator(c, op, right);
+}
+
+/* code_operator - generate code to combine the value on the stack with the right operand of a binary operator */
+static void code_operator(ParseContext *c, int op, ParseTreeNode *right)
+{
+    int shift;
+
+    /* multiply, divide or take the remainder by a power of two */
+    if ((shift = log2lit(right)) > 0) {
+        switch (op) {
+        case OP_MUL:
+            code_lit(c, shift);
+            putcbyte(c, OP_SHL);
+            return;
+        case OP_DIV:
+            putcbyte(c, OP_DIVP2);
+            putcbyte(c, shift);
+            return;
+        case OP_REM:
+            putcbyte(c, OP_REMP2);
+            putcbyte(c, shift);
+            return;
+        }
+    }
+
+    code_rvalue(c, right);
+    putcbyte(c, op);
+}
+
+/* log2lit - get the power of two an integer literal greater than one is or zero if it isn't one */
+static int log2lit(ParseTreeNode *expr)
+{
+    VMVALUE value;
+    int shift;
+    if (!IsIntegerLit(expr) || (value = expr->u.integerLit.value) <= 1 || (value & (value - 1)) != 0)
+        return 0;
+    for (shift = 0; value > 1; value >>= 1)
+        ++shift;
+    return shift;
+}
+
 /* code_shortcircuit - generate code for a conjunction or disjunction of boolean expressions */
 static void code_shortcircuit(ParseContext *c, int op, ParseTreeNode *expr, PVAL *pv)
 {
@@ -122,23 +280,34 @@ static void code_arrayref(ParseContext *c, ParseTreeNode *expr, PVAL *pv)
     /* code the index operation */
     putcbyte(c, OP_INDEX);
 
-    /* setup the element type */
-    pv->fcn = code_index;
+    /* setup the element type (the elements of a global array are known to be in the data section) */
+    if (pv2.fcn == code_global && (VMUVALUE)pv2.u.sym->value >= DATA_OFFSET)
+        pv->fcn = code_dataindex;
+    else
+        pv->fcn = code_index;
 }
 
 /* code_call - code a function call */
 static void code_call(ParseContext *c, ParseTreeNode *expr, PVAL *pv)
 {
+    ParseTreeNode *fcn = expr->u.functionCall.fcn;
     ExprListEntry *arg;
 
     /* code each argument expression */
     for (arg = expr->u.functionCall.args; arg != NULL; arg = arg->next)
         code_rvalue(c, arg->expr);
 
-    /* call the function */
-    code_rvalue(c, expr->u.functionCall.fcn);
-    putcbyte(c, OP_CALL);
-    putcbyte(c, expr->u.functionCall.argc);
+    /* call a function directly through its code vector (resolved when the code is placed) */
+    if (IsDirectCall(c, expr)) {
+        putcbyte(c, OP_DCALL);
+        putcword(c, fcn->u.symbolRef.symbol->value);
+    }
+
+    /* otherwise call the function whose address is the value of the expression */
+    else {
+        code_rvalue(c, fcn);
+        putcbyte(c, OP_CALL);
+    }
 
     /* we've got an rvalue now */
     pv->fcn = NULL;
@@ -163,14 +332,31 @@ void chklvalue(ParseContext *c, PVAL *pv)
 /* code_global - compile a global variable reference */
 void code_global(ParseContext *c, PValOp fcn, PVAL *pv)
 {
+    VMUVALUE addr = (VMUVALUE)pv->u.sym->value;
+
+    /* variables in the data section are loaded and stored by index */
+    if (fcn != PV_ADDR && addr >= DATA_OFFSET) {
+        VMUVALUE index = (addr - DATA_OFFSET) / sizeof(VMVALUE);
+        if (index <= 0xff) {
+            putcbyte(c, fcn == PV_LOAD ? OP_GLOAD : OP_GSTORE);
+            putcbyte(c, index);
+        }
+        else {
+            putcbyte(c, fcn == PV_LOAD ? OP_GLOADW : OP_GSTOREW);
+            putcword(c, index);
+        }
+        return;
+    }
+
+    /* otherwise it's an address or a function vector in the text section (stores to text are ignored) */
     putcbyte(c, OP_LIT);
-    putclong(c, pv->u.sym->value);
+    putclong(c, addr);
     switch (fcn) {
     case PV_ADDR:
         // just need the address
         break;
     case PV_LOAD:
-        putcbyte(c, OP_LOAD);
+        putcbyte(c, OP_TLOAD);
         break;
     case PV_STORE:
         putcbyte(c, OP_STORE);
@@ -212,6 +398,22 @@ static void code_index(ParseContext *c, PValOp fcn, PVAL *pv)
     }
 }
 
+/* code_dataindex - compile a reference to an element of a vector in the data section */
+static void code_dataindex(ParseContext *c, PValOp fcn, PVAL *pv)
+{
+    switch (fcn) {
+    case PV_ADDR:
+        // what to do here?
+        break;
+    case PV_LOAD:
+        putcbyte(c, OP_DLOAD);
+        break;
+    case PV_STORE:
+        putcbyte(c, OP_DSTORE);
+        break;
+    }
+}
+
 /* codeaddr - get the current code address (actually, offset) */
 int codeaddr(ParseContext *c)
 {
@@ -272,7 +474,7 @@ void fixupbranch(ParseContext *c, VMUVALUE chn, VMUVALUE val)
 }
 
 /* putclong - put a code word into the code buffer */
-static int putclong(ParseContext *c, VMVALUE v)
+int putclong(ParseContext *c, VMVALUE v)
 {
     int addr = codeaddr(c);
     if (c->codeFree + sizeof(VMVALUE) > c->codeTop)
@@ -0,0 +1,265 @@
+/* db_live.c - frame slot sharing and dead store elimination
+ *
+ * Copyright (c) 2014 by David Michael Betz.  All rights reserved.
+ *
+ */
+
+#include <string.h>
+#include "db_optimize.h"
+
+/* set of frame slots (by slot number) */
+#define SETWORDS        ((MAXLOCALS + 31) / 32)
+typedef uint32_t SlotSet[SETWORDS];
+
+#define SetAdd(s, n)        ((s)[(n) >> 5] |= (uint32_t)1 << ((n) & 31))
+#define SetRemove(s, n)     ((s)[(n) >> 5] &= ~((uint32_t)1 << ((n) & 31)))
+#define SetHas(s, n)        (((s)[(n) >> 5] >> ((n) & 31)) & 1)
+
+/* liveness of the slots at the boundaries of a basic block */
+typedef struct {
+    SlotSet use;        /* slots read before they are written in the block */
+    SlotSet def;        /* slots written in the block */
+    SlotSet in;         /* slots live on entry to the block */
+    SlotSet out;        /* slots live on exit from the block */
+} BlockLiveness;
+
+/* group of consecutive slots that must stay together (the limit and step of a FOR loop) */
+typedef struct {
+    int first;          /* first slot of the group */
+    int size;           /* number of slots */
+    int used;           /* group is referenced by the code */
+    int shared;         /* group can share its slots (it's never read before it is written) */
+    int base;           /* first slot of the group in the new frame (-1 if not placed yet) */
+} SlotGroup;
+
+/* local function prototypes */
+static int SlotOf(ParseContext *c, Instr *instr);
+static void InstrUses(ParseContext *c, Instr *instr, SlotSet uses, int *pDef);
+static void Merge(SlotSet dst, SlotSet src, int *pChanged);
+static void Interfere(uint32_t *graph, int groupCount, int *groupOf, SlotSet live, int group);
+
+/* ShareFrameSlots - delete stores to slots that are never read again and let slots whose values are never live at the same time share space in the frame */
+int ShareFrameSlots(ParseContext *c, Instr **pCode, int *pCount)
+{
+    Instr *code = *pCode;
+    int count = *pCount, slotCount = c->localMax, changed = VMFALSE, groupCount, frame, newMax, i, j, k, n;
+    int groupOf[MAXLOCALS], link[MAXLOCALS], rowWords, blockChanged, def;
+    SlotGroup groups[MAXLOCALS];
+    BlockLiveness *live;
+    SlotSet uses, current;
+    uint8_t *savedFree;
+    uint32_t *graph;
+    Flow flow;
+
+    /* only code with local variables has a frame */
+    if (slotCount <= 0 || (frame = NextInstr(code, count, -1)) >= count || code[frame].opcode != OP_FRAME)
+        return VMFALSE;
+    savedFree = c->localFree;
+
+    /* group the slots read together by FORNEXT */
+    memset(link, 0, sizeof(link));
+    for (i = 0; i < count; ++i)
+        if (!(code[i].flags & INSTR_DELETED) && code[i].opcode == OP_FORNEXT && (n = SlotOf(c, &code[i])) >= 0 && n + 1 < slotCount)
+            link[n] = VMTRUE;
+    for (n = 0, groupCount = 0; n < slotCount; ++n) {
+        if (n == 0 || !link[n - 1]) {
+            groups[groupCount].first = n;
+            groups[groupCount].size = 0;
+            groups[groupCount].used = VMFALSE;
+            groups[groupCount].shared = VMTRUE;
+            groups[groupCount].base = -1;
+            ++groupCount;
+        }
+        groupOf[n] = groupCount - 1;
+        ++groups[groupCount - 1].size;
+    }
+
+    /* build the flow graph and the interference graph */
+    rowWords = (groupCount + 31) / 32;
+    if (!BuildFlow(c, code, count, &flow)
+    ||  !(live = (BlockLiveness *)OptimizerAlloc(c, flow.blockCount * sizeof(BlockLiveness)))
+    ||  !(graph = (uint32_t *)OptimizerAlloc(c, groupCount * rowWords * sizeof(uint32_t)))) {
+        c->localFree = savedFree;
+        return VMFALSE;
+    }
+    memset(live, 0, flow.blockCount * sizeof(BlockLiveness));
+    memset(graph, 0, groupCount * rowWords * sizeof(uint32_t));
+
+    /* find the slots each block reads before writing them and the ones it writes */
+    for (i = 0; i < flow.blockCount; ++i) {
+        BasicBlock *block = &flow.blocks[i];
+        for (j = block->first; j <= block->last; j = NextInstr(code, count, j)) {
+            InstrUses(c, &code[j], uses, &def);
+            for (k = 0; k < SETWORDS; ++k)
+                live[i].use[k] |= uses[k] & ~live[i].def[k];
+            if (def >= 0)
+                SetAdd(live[i].def, def);
+        }
+    }
+
+    /* find the slots live on entry to each block (working backwards until nothing changes) */
+    do {
+        blockChanged = VMFALSE;
+        for (i = flow.blockCount; --i >= 0; ) {
+            for (j = 0; j < 2; ++j)
+                if (flow.blocks[i].succ[j] >= 0)
+                    Merge(live[i].out, live[flow.blocks[i].succ[j]].in, &blockChanged);
+            for (k = 0; k < SETWORDS; ++k)
+                current[k] = live[i].use[k] | (live[i].out[k] & ~live[i].def[k]);
+            Merge(live[i].in, current, &blockChanged);
+        }
+    } while (blockChanged);
+
+    /* slots that may be read before they are written keep their values to themselves */
+    if (flow.blockCount > 0)
+        for (n = 0; n < slotCount; ++n)
+            if (SetHas(live[0].in, n))
+                groups[groupOf[n]].shared = VMFALSE;
+
+    /* delete dead stores and find the slots live when each of the others is written */
+    for (i = 0; i < flow.blockCount; ++i) {
+        BasicBlock *block = &flow.blocks[i];
+        memcpy(current, live[i].out, sizeof(SlotSet));
+        for (j = block->last; j >= block->first; --j) {
+            Instr *instr = &code[j];
+            if (instr->flags & INSTR_DELETED)
+                continue;
+            InstrUses(c, instr, uses, &def);
+            if (def >= 0 && !SetHas(current, def)) {
+                if (instr->opcode == OP_INCL) {
+                    DeleteInstr(code, count, j);
+                    changed = VMTRUE;
+                    continue;
+                }
+                SetOpcode(instr, OP_DROP);
+                instr->operand = 0;
+                changed = VMTRUE;
+                def = -1;
+            }
+            if (def >= 0) {
+                groups[groupOf[def]].used = VMTRUE;
+                Interfere(graph, groupCount, groupOf, current, groupOf[def]);
+                SetRemove(current, def);
+            }
+            for (k = 0; k < SETWORDS; ++k)
+                current[k] |= uses[k];
+            for (n = 0; n < slotCount; ++n)
+                if (SetHas(uses, n))
+                    groups[groupOf[n]].used = VMTRUE;
+        }
+    }
+
+    /* place the groups in the new frame in order (the first place that doesn't overlap an interfering group) */
+    newMax = 0;
+    for (i = 0; i < groupCount; ++i) {
+        SlotGroup *group = &groups[i];
+        int base = 0, overlap;
+        if (!group->used)
+            continue;
+        do {
+            overlap = VMFALSE;
+            for (j = 0; j < i; ++j) {
+                SlotGroup *other = &groups[j];
+                if (other->base >= 0
+                &&  (!group->shared || !other->shared || ((graph[i * rowWords + (j >> 5)] >> (j & 31)) & 1))
+                &&  base < other->base + other->size && other->base < base + group->size) {
+                    base = other->base + other->size;
+                    overlap = VMTRUE;
+                }
+            }
+        } while (overlap);
+        group->base = base;
+        if (base + group->size > newMax)
+            newMax = base + group->size;
+        if (base != group->first)
+            changed = VMTRUE;
+    }
+
+    /* release the flow graph */
+    c->localFree = savedFree;
+
+    /* move the slots */
+    for (i = 0; i < count; ++i) {
+        Instr *instr = &code[i];
+        if (!(instr->flags & INSTR_DELETED) && instr->opcode != OP_FRAME && (n = SlotOf(c, instr)) >= 0) {
+            SlotGroup *group = &groups[groupOf[n]];
+            instr->operand = LOCALOFFSET(group->base + n - group->first);
+        }
+    }
+
+    /* shrink the frame (code without local variables needs none) */
+    if (newMax != slotCount) {
+        c->localMax = newMax;
+        if (newMax > 0)
+            code[frame].operand = newMax;
+        else
+            DeleteInstr(code, count, frame);
+        changed = VMTRUE;
+    }
+
+    return changed;
+}
+
+/* SlotOf - get the frame slot an instruction refers to or -1 if it doesn't refer to one */
+static int SlotOf(ParseContext *c, Instr *instr)
+{
+    int n;
+    switch (instr->opcode) {
+    case OP_LREF:
+    case OP_LSET:
+    case OP_INCL:
+    case OP_FORNEXT:
+        n = -F_SIZE - 1 - (int)instr->operand;
+        return n >= 0 && n < c->localMax ? n : -1;
+    }
+    return -1;
+}
+
+/* InstrUses - find the slots an instruction reads and the one it writes (-1 if none) */
+static void InstrUses(ParseContext *c, Instr *instr, SlotSet uses, int *pDef)
+{
+    int n = SlotOf(c, instr);
+    memset(uses, 0, sizeof(SlotSet));
+    *pDef = -1;
+    if (n < 0)
+        return;
+    switch (instr->opcode) {
+    case OP_LREF:
+        SetAdd(uses, n);
+        break;
+    case OP_LSET:
+        *pDef = n;
+        break;
+    case OP_INCL:
+        SetAdd(uses, n);
+        *pDef = n;
+        break;
+    case OP_FORNEXT:
+        SetAdd(uses, n);
+        if (n + 1 < c->localMax)
+            SetAdd(uses, n + 1);
+        break;
+    }
+}
+
+/* Merge - add the slots of one set to another noting whether that changed it */
+static void Merge(SlotSet dst, SlotSet src, int *pChanged)
+{
+    int k;
+    for (k = 0; k < SETWORDS; ++k)
+        if (src[k] & ~dst[k]) {
+            dst[k] |= src[k];
+            *pChanged = VMTRUE;
+        }
+}
+
+/* Interfere - note that the slots of a group are written while the slots of the live groups hold values */
+static void Interfere(uint32_t *graph, int groupCount, int *groupOf, SlotSet live, int group)
+{
+    int rowWords = (groupCount + 31) / 32, other, n;
+    for (n = 0; n < MAXLOCALS; ++n)
+        if (SetHas(live, n) && (other = groupOf[n]) != group) {
+            graph[group * rowWords + (other >> 5)] |= (uint32_t)1 << (other & 31);
+            graph[other * rowWords + (group >> 5)] |= (uint32_t)1 << (group & 31);
+        }
+}
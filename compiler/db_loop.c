@@ -0,0 +1,527 @@
+/* db_loop.c - loop invariant code motion
+ *
+ * Copyright (c) 2014 by David Michael Betz.  All rights reserved.
+ *
+ */
+
+#include <string.h>
+#include "db_optimize.h"
+
+/* limits on what one run of the pass handles */
+#define MAXLOOPS        16      /* loops */
+#define MAXSTACK        32      /* operand stack entries tracked within a basic block */
+#define MAXHOISTED      64      /* instructions moved into preheaders (including the LSETs) */
+#define MAXWRITES       32      /* global variables written within a loop */
+#define MAXCALLDEPTH    4       /* depth of calls followed to find the global variables they write */
+
+/* kinds of addresses tracked to find stores to array elements */
+#define ADDR_OTHER      0       /* unknown value */
+#define ADDR_CONST      1       /* constant (the address of a global array) */
+#define ADDR_ELEMENT    2       /* address of an array element */
+
+/* loop found from a branch back to an earlier instruction */
+typedef struct {
+    int head;           /* first instruction of the loop (the target of the back branch) */
+    int tail;           /* last instruction of the loop (the back branch) */
+    int entry;          /* instruction the preheader goes in front of */
+    int start;          /* first instruction of the preheader in the hoisted instruction buffer */
+    int count;          /* number of instructions in the preheader */
+} Loop;
+
+/* computation of a value within a loop */
+typedef struct {
+    int start;          /* first instruction */
+    int end;            /* instruction that pushes the value */
+    int size;           /* number of instructions */
+    int pure;           /* consecutive instructions without side effects that can be replaced */
+    int invariant;      /* value is the same on every trip through the loop */
+} Value;
+
+/* state of the pass */
+typedef struct {
+    ParseContext *c;
+    Instr *code;                    /* instructions */
+    int count;                      /* number of instructions */
+    uint8_t *gone;                  /* instructions replaced or deleted by the pass */
+    Value *values;                  /* hoisting candidates in the current loop */
+    int valueCount;                 /* number of hoisting candidates */
+    uint8_t locals[256];            /* local variables written in the loop (by frame offset) */
+    VMVALUE writes[MAXWRITES];      /* global variables written in the loop (by data section index) */
+    int writeCount;                 /* number of global variables written */
+    int allGlobals;                 /* any global variable may be written in the loop */
+    Instr hoisted[MAXHOISTED];      /* instructions moved into preheaders */
+    int hoistedCount;               /* number of instructions moved */
+} LoopState;
+
+/* local function prototypes */
+static int FindLoops(Instr *code, int count, Loop *loops);
+static int FindEntry(Instr *code, int count, Loop *loop);
+static int HoistInvariants(LoopState *s, Flow *flow, Loop *loop);
+static void FindWrites(LoopState *s, Instr *code, int first, int last, int depth);
+static void AddWrite(LoopState *s, VMVALUE index);
+static int IsInvariantLeaf(LoopState *s, Instr *instr);
+static void FindValues(LoopState *s, BasicBlock *block);
+static int HoistValue(LoopState *s, Loop *loop, Value *value);
+static int SameCode(Instr *code, int count, Value *value, Instr *hoisted, int n);
+static void MovePreheader(LoopState *s, Loop *loop, int *pCount);
+
+/* HoistLoopInvariants - compute values that don't change within a loop once in a preheader in front of the loop */
+int HoistLoopInvariants(ParseContext *c, Instr **pCode, int *pCount)
+{
+    Instr *code = *pCode;
+    int count = *pCount, changed = VMFALSE, slots = c->localMax, loopCount, i, j;
+    Loop loops[MAXLOOPS], tmp;
+    uint8_t *savedFree;
+    LoopState s;
+    Flow flow;
+
+    /* find the loops (the outer loops first so values are moved as far out as possible) */
+    if (!(loopCount = FindLoops(code, count, loops)))
+        return VMFALSE;
+
+    /* make room for the preheaders and for a frame */
+    if (!ReserveInstrs(c, code, count, MAXHOISTED + 1))
+        return VMFALSE;
+    savedFree = c->localFree;
+
+    /* setup the pass state */
+    s.c = c;
+    s.code = code;
+    s.count = count;
+    s.hoistedCount = 0;
+    if (!BuildFlow(c, code, count, &flow)
+    ||  !(s.values = (Value *)OptimizerAlloc(c, count * sizeof(Value)))
+    ||  !(s.gone = (uint8_t *)OptimizerAlloc(c, count))) {
+        c->localFree = savedFree;
+        return VMFALSE;
+    }
+    memset(s.gone, 0, count);
+
+    /* move the invariant values of each loop into its preheader */
+    for (i = 0; i < loopCount; ++i) {
+        loops[i].start = s.hoistedCount;
+        loops[i].count = 0;
+        if (FindEntry(code, count, &loops[i]) && HoistInvariants(&s, &flow, &loops[i]))
+            changed = VMTRUE;
+    }
+    c->localFree = savedFree;
+
+    /* insert the preheaders from the end of the code (inner loops first when preheaders go in the same place) */
+    for (i = 0; i < loopCount; ++i)
+        for (j = i + 1; j < loopCount; ++j)
+            if (loops[j].entry > loops[i].entry
+            ||  (loops[j].entry == loops[i].entry && loops[j].tail - loops[j].head < loops[i].tail - loops[i].head)) {
+                tmp = loops[i];
+                loops[i] = loops[j];
+                loops[j] = tmp;
+            }
+    for (i = 0; i < loopCount; ++i) {
+        if (loops[i].count == 0)
+            continue;
+        for (j = i + 1; j < loopCount; ++j)
+            if (loops[j].tail >= loops[i].entry)
+                loops[j].tail += loops[i].count;
+        MovePreheader(&s, &loops[i], &count);
+    }
+
+    /* make room in the frame for the slots */
+    if (c->localMax != slots)
+        UpdateFrame(c, code, &count);
+
+    *pCount = count;
+    return changed;
+}
+
+/* FindLoops - find the loops from the branches back to earlier instructions (largest first) */
+static int FindLoops(Instr *code, int count, Loop *loops)
+{
+    int loopCount = 0, target, i, j;
+    Loop tmp;
+
+    for (i = 0; i < count; ++i) {
+        if ((code[i].flags & INSTR_DELETED) || !IsBranch(code[i].fmt))
+            continue;
+        if ((target = ResolveTarget(code, count, code[i].target)) > i)
+            continue;
+
+        /* several branches back to the same instruction make one loop */
+        for (j = 0; j < loopCount && loops[j].head != target; ++j)
+            ;
+        if (j < loopCount)
+            loops[j].tail = i;
+        else if (loopCount < MAXLOOPS) {
+            loops[loopCount].head = target;
+            loops[loopCount].tail = i;
+            ++loopCount;
+        }
+    }
+
+    for (i = 0; i < loopCount; ++i)
+        for (j = i + 1; j < loopCount; ++j)
+            if (loops[j].tail - loops[j].head > loops[i].tail - loops[i].head) {
+                tmp = loops[i];
+                loops[i] = loops[j];
+                loops[j] = tmp;
+            }
+
+    return loopCount;
+}
+
+/* FindEntry - find where to put the preheader of a loop or return false if there is no place every entry goes through */
+static int FindEntry(Instr *code, int count, Loop *loop)
+{
+    int prev = -1, jump, target, i;
+
+    /* find the instruction in front of the loop */
+    for (i = loop->head; --i >= 0; )
+        if (!(code[i].flags & INSTR_DELETED)) {
+            prev = i;
+            break;
+        }
+
+    /* a FOR loop is entered by an unconditional branch to the test at the bottom */
+    jump = (prev >= 0
+        &&  (code[prev].opcode == OP_BR || code[prev].opcode == OP_SBR)
+        &&  (target = ResolveTarget(code, count, code[prev].target)) > loop->head
+        &&  target <= loop->tail);
+    loop->entry = (jump ? prev : loop->head);
+
+    /* every other branch from outside of the loop must go to its first instruction */
+    for (i = 0; i < count; ++i) {
+        if ((code[i].flags & INSTR_DELETED) || !IsBranch(code[i].fmt) || i == prev || (i >= loop->head && i <= loop->tail))
+            continue;
+        target = ResolveTarget(code, count, code[i].target);
+        if (target >= loop->head && target <= loop->tail && (jump || target != loop->head))
+            return VMFALSE;
+    }
+
+    /* the branch in front of the loop must either enter it or leave it alone */
+    if (!jump && prev >= 0 && IsBranch(code[prev].fmt)) {
+        target = ResolveTarget(code, count, code[prev].target);
+        if (target > loop->head && target <= loop->tail)
+            return VMFALSE;
+    }
+
+    return VMTRUE;
+}
+
+/* HoistInvariants - move the invariant values of a loop into the preheader buffer */
+static int HoistInvariants(LoopState *s, Flow *flow, Loop *loop)
+{
+    int changed = VMFALSE, best, i;
+
+    /* find what the loop writes */
+    memset(s->locals, 0, sizeof(s->locals));
+    s->writeCount = 0;
+    s->allGlobals = VMFALSE;
+    FindWrites(s, s->code, loop->head, loop->tail, 0);
+
+    /* find the values computed in the loop */
+    s->valueCount = 0;
+    for (i = 0; i < flow->blockCount; ++i)
+        if (flow->blocks[i].first >= loop->head && flow->blocks[i].last <= loop->tail)
+            FindValues(s, &flow->blocks[i]);
+
+    /* move the largest invariant values first */
+    for (;;) {
+        for (i = 0, best = -1; i < s->valueCount; ++i) {
+            Value *value = &s->values[i];
+            if (value->invariant && value->pure && value->size >= 2 && (best < 0 || value->size > s->values[best].size))
+                best = i;
+        }
+        if (best < 0)
+            break;
+        if (HoistValue(s, loop, &s->values[best]))
+            changed = VMTRUE;
+        s->values[best].invariant = VMFALSE;
+    }
+
+    return changed;
+}
+
+/* FindWrites - find the variables written by a range of instructions and by the functions they call
+   (stores to array elements are assumed to stay within the array so they don't write scalar variables) */
+static void FindWrites(LoopState *s, Instr *code, int first, int last, int depth)
+{
+    int calleeCount, sp = 0, pops, pushes, kind, dest, i;
+    uint8_t stack[MAXSTACK], *savedFree;
+    Function *function;
+    Instr *calleeCode;
+
+    for (i = first; i <= last; ++i) {
+        Instr *instr = &code[i];
+        if (instr->flags & INSTR_DELETED)
+            continue;
+        if (instr->flags & INSTR_TARGET)
+            sp = 0;
+
+        switch (instr->opcode) {
+        case OP_LSET:
+        case OP_INCL:
+            if (depth == 0)
+                s->locals[(uint8_t)instr->operand] = VMTRUE;
+            break;
+        case OP_GSTORE:
+        case OP_GSTOREW:
+        case OP_INCG:
+            AddWrite(s, instr->operand);
+            break;
+        case OP_STORE:
+        case OP_STOREB:
+        case OP_DSTORE:
+            if (sp < 1 || stack[sp - 1] != ADDR_ELEMENT)
+                s->allGlobals = VMTRUE;
+            break;
+        case OP_CALL:
+        case OP_NATIVE:
+        case OP_RDSTORE:
+            s->allGlobals = VMTRUE;
+            break;
+        case OP_DCALL:
+        case OP_TCALL:
+            savedFree = s->c->localFree;
+            if (depth < MAXCALLDEPTH
+            &&  (function = FindCallee(s->c, code, last + 1, i)) != NULL
+            &&  (calleeCode = DecodeStoredCode(s->c, function->code, function->size, &calleeCount)) != NULL) {
+                MarkTargets(calleeCode, calleeCount);
+                FindWrites(s, calleeCode, 0, calleeCount - 1, depth + 1);
+            }
+            else
+                s->allGlobals = VMTRUE;
+            s->c->localFree = savedFree;
+            break;
+        default:
+            /* register instructions in called functions can write globals directly */
+            if ((dest = RegisterDest(instr)) >= ROP_GLOBAL && dest < ROP_CONSTS)
+                AddWrite(s, dest - ROP_GLOBAL);
+            break;
+        }
+
+        /* keep track of which values on the stack are the addresses of array elements
+           (values from before the start of the tracking are unknown) */
+        if (!StackEffect(instr->opcode, &pops, &pushes) || sp + pushes > MAXSTACK) {
+            sp = 0;
+            continue;
+        }
+        switch (instr->opcode) {
+        case OP_LIT:
+        case OP_SLIT:
+            kind = ADDR_CONST;
+            break;
+        case OP_INDEX:
+            kind = (sp >= 2 && stack[sp - 2] == ADDR_CONST ? ADDR_ELEMENT : ADDR_OTHER);
+            break;
+        case OP_DUP:
+            kind = (sp >= 1 ? stack[sp - 1] : ADDR_OTHER);
+            break;
+        case OP_SWAP:
+            if (sp >= 2) {
+                kind = stack[sp - 1];
+                stack[sp - 1] = stack[sp - 2];
+                stack[sp - 2] = kind;
+            }
+            else
+                sp = 0;
+            continue;
+        default:
+            kind = ADDR_OTHER;
+            break;
+        }
+        sp = (pops < sp ? sp - pops : 0);
+        while (--pushes >= 0)
+            stack[sp++] = kind;
+    }
+}
+
+/* AddWrite - add a global variable to the ones written in the loop */
+static void AddWrite(LoopState *s, VMVALUE index)
+{
+    int i;
+    for (i = 0; i < s->writeCount; ++i)
+        if (s->writes[i] == index)
+            return;
+    if (s->writeCount < MAXWRITES)
+        s->writes[s->writeCount++] = index;
+    else
+        s->allGlobals = VMTRUE;
+}
+
+/* IsInvariantLeaf - check to see if an instruction without operands pushes the same value on every trip through the loop */
+static int IsInvariantLeaf(LoopState *s, Instr *instr)
+{
+    int i;
+    switch (instr->opcode) {
+    case OP_LIT:
+    case OP_SLIT:
+        return VMTRUE;
+    case OP_LREF:
+        return !s->locals[(uint8_t)instr->operand];
+    case OP_GLOAD:
+    case OP_GLOADW:
+        if (s->allGlobals)
+            return VMFALSE;
+        for (i = 0; i < s->writeCount; ++i)
+            if (s->writes[i] == instr->operand)
+                return VMFALSE;
+        return VMTRUE;
+    }
+    return VMFALSE;
+}
+
+/* FindValues - find the values computed in a basic block and whether they are invariant */
+static void FindValues(LoopState *s, BasicBlock *block)
+{
+    Instr *code = s->code;
+    int count = s->count, depth = 0, pops, pushes, next, i, k;
+    Value stack[MAXSTACK], value;
+
+    for (i = block->first; i <= block->last; i = NextInstr(code, count, i)) {
+        Instr *instr = &code[i];
+
+        /* forget the stack at instructions with unknown stack effects */
+        if (!StackEffect(instr->opcode, &pops, &pushes)) {
+            depth = 0;
+            continue;
+        }
+
+        /* a copy made by DUP can't be replaced on its own and neither can what uses it */
+        if (instr->opcode == OP_DUP) {
+            if (depth > 0 && depth < MAXSTACK) {
+                stack[depth - 1].pure = VMFALSE;
+                stack[depth] = stack[depth - 1];
+                ++depth;
+            }
+            else
+                depth = 0;
+            continue;
+        }
+
+        /* forget the stack at a SWAP */
+        else if (instr->opcode == OP_SWAP) {
+            depth = 0;
+            continue;
+        }
+
+        /* a value is invariant if its operands are and the operation has no side effects (loads through
+           computed addresses aren't moved because the preheader runs even if the loop body doesn't) */
+        value.start = value.end = i;
+        value.size = 1;
+        value.pure = IsPureOp(instr->opcode);
+        value.invariant = value.pure;
+        switch (instr->opcode) {
+        case OP_LOAD:
+        case OP_LOADB:
+        case OP_DLOAD:
+        case OP_TLOAD:
+            value.invariant = VMFALSE;
+            break;
+        }
+        if (pops > depth) {
+            value.pure = value.invariant = VMFALSE;
+            depth = pops = 0;
+        }
+        if (pops == 0 && value.invariant)
+            value.invariant = IsInvariantLeaf(s, instr);
+        if (pops > 0) {
+            value.start = next = stack[depth - pops].start;
+            for (k = 0; k < pops; ++k) {
+                Value *arg = &stack[depth - pops + k];
+                if (!arg->pure || arg->start != next)
+                    value.pure = VMFALSE;
+                if (!arg->invariant)
+                    value.invariant = VMFALSE;
+                next = NextInstr(code, count, arg->end);
+                value.size += arg->size;
+            }
+            if (next != i)
+                value.pure = VMFALSE;
+            depth -= pops;
+        }
+
+        if (pushes == 0)
+            continue;
+
+        /* remember the value and push it (forgetting the bottom entry if there is no room) */
+        s->values[s->valueCount++] = value;
+        if (depth >= MAXSTACK) {
+            memmove(&stack[0], &stack[1], (MAXSTACK - 1) * sizeof(Value));
+            --depth;
+        }
+        stack[depth++] = value;
+    }
+}
+
+/* HoistValue - move the computation of a value into the preheader and load it from a frame slot in the loop */
+static int HoistValue(LoopState *s, Loop *loop, Value *value)
+{
+    Instr *code = s->code;
+    int n = 0, slot = 0, i;
+
+    /* skip values that are part of ones that have already been moved */
+    for (i = value->start; i <= value->end; ++i)
+        if (s->gone[i])
+            return VMFALSE;
+
+    /* reuse the slot of an identical value already in the preheader */
+    for (i = loop->start; i < loop->start + loop->count; i += n + 1) {
+        for (n = 0; s->hoisted[i + n].opcode != OP_LSET; ++n)
+            ;
+        if (SameCode(code, s->count, value, &s->hoisted[i], n)) {
+            slot = s->hoisted[i + n].operand;
+            break;
+        }
+    }
+
+    /* otherwise copy the computation into the preheader and save the value in a new slot */
+    if (!slot) {
+        if (s->hoistedCount + value->size + 1 > MAXHOISTED || !(slot = NewSlot(s->c)))
+            return VMFALSE;
+        for (i = value->start; i <= value->end; i = NextInstr(code, s->count, i)) {
+            s->hoisted[s->hoistedCount] = code[i];
+            s->hoisted[s->hoistedCount++].flags = 0;
+        }
+        SetOpcode(&s->hoisted[s->hoistedCount], OP_LSET);
+        s->hoisted[s->hoistedCount].flags = 0;
+        s->hoisted[s->hoistedCount++].operand = slot;
+        loop->count = s->hoistedCount - loop->start;
+    }
+
+    /* load the value in the loop */
+    for (i = NextInstr(code, s->count, value->start); i <= value->end; i = NextInstr(code, s->count, i)) {
+        DeleteInstr(code, s->count, i);
+        s->gone[i] = VMTRUE;
+    }
+    SetOpcode(&code[value->start], OP_LREF);
+    code[value->start].operand = slot;
+    code[value->start].operand2 = 0;
+    s->gone[value->start] = VMTRUE;
+
+    return VMTRUE;
+}
+
+/* SameCode - check to see if the computation of a value matches instructions in a preheader */
+static int SameCode(Instr *code, int count, Value *value, Instr *hoisted, int n)
+{
+    int i, j;
+    for (i = value->start, j = 0; i <= value->end && j < n; i = NextInstr(code, count, i), ++j)
+        if (code[i].opcode != hoisted[j].opcode || code[i].operand != hoisted[j].operand)
+            return VMFALSE;
+    return i > value->end && j == n;
+}
+
+/* MovePreheader - insert the preheader of a loop in front of it */
+static void MovePreheader(LoopState *s, Loop *loop, int *pCount)
+{
+    Instr *code = s->code;
+    int n = loop->count, i;
+
+    /* branches from outside of the loop to where the preheader goes now reach the preheader */
+    InsertInstrs(code, pCount, loop->entry, n, VMTRUE);
+    memcpy(&code[loop->entry], &s->hoisted[loop->start], n * sizeof(Instr));
+
+    /* but the branches back to the head of the loop skip it */
+    if (loop->entry == loop->head)
+        for (i = loop->entry + n; i <= loop->tail + n; ++i)
+            if (IsBranch(code[i].fmt) && code[i].target == loop->entry)
+                code[i].target += n;
+}
@@ -0,0 +1,1230 @@
+/* db_optimize.c - bytecode optimizer
+ *
+ * Copyright (c) 2014 by David Michael Betz.  All rights reserved.
+ *
+ */
+
+#include <string.h>
+#include "db_optimize.h"
+#include "db_vmdebug.h"
+
+/* limit on the number of times the passes are run over the code */
+#define MAXROUNDS       16
+
+/* long and short forms of the branch instructions */
+static int branchForms[][2] = {
+{   OP_BRT,     OP_SBRT     },
+{   OP_BRTSC,   OP_SBRTSC   },
+{   OP_BRF,     OP_SBRF     },
+{   OP_BRFSC,   OP_SBRFSC   },
+{   OP_BR,      OP_SBR      },
+{   -1,         -1          }
+};
+
+/* local function prototypes */
+static Instr *DecodeBuffer(ParseContext *c, int *pCount);
+static int CountInstrs(const uint8_t *code, int size);
+static void DecodeCode(ParseContext *c, const uint8_t *bytes, Instr *code, int count);
+static Instr *InlineCalls(ParseContext *c, Instr *code, int *pCount);
+static int DecodeCallee(ParseContext *c, Function *function, int limit, Instr **pCode, int *pFirst);
+static int StoreArguments(Instr *code, int i, int argc, int base, int *storeTo);
+static int StackNeed(ParseContext *c, Instr *code, int count);
+static int StackUses(ParseContext *c, Instr *code, int count, int *use);
+static int SetDepth(int *depth, int i, int value, int *pChanged);
+static int InstrEffect(ParseContext *c, Instr *code, int count, int i, int *pPops, int *pPushes);
+static int RemoveUnreachable(ParseContext *c, Instr **pCode, int *pCount);
+static int LoadOpcode(int opcode);
+static int BranchForm(int opcode, int from, int to);
+static int Peephole(ParseContext *c, Instr **pCode, int *pCount);
+static int ThreadJumps(ParseContext *c, Instr **pCode, int *pCount);
+static void CompactLiterals(ParseContext *c, Instr *code, int count, int grow);
+static int PoolIndex(ParseContext *c, Instr *code, int count, int i, int grow);
+static int EncodeCode(ParseContext *c, Instr *code, int count);
+static OTDEF *LookupOpcode(int opcode);
+static int OperandSize(int fmt);
+static int FindInstr(Instr *code, int count, int addr);
+static int TargetAddr(Instr *code, int count, int i, int end);
+
+/* optimization passes in the order they are run */
+static struct {
+    int level;          /* lowest optimization level that runs the pass */
+    OptPass *pass;      /* function that runs the pass */
+} passes[] = {
+{   1,  Peephole                      },
+{   1,  ThreadJumps                   },
+{   1,  RemoveUnreachable             },
+{   2,  PropagateCopies               },
+{   2,  RemoveDeadValues              },
+{   2,  EliminateCommonSubexpressions },
+{   2,  HoistLoopInvariants           },
+{   2,  ShareFrameSlots               },
+{   0,  NULL                          }
+};
+
+/* OptimizeCode - optimize the code under construction and return the number of bytes saved
+   (a function replaced by register instructions also returns the size of its stack code and the code if it can be inlined,
+   and every function returns the stack a call to it uses beyond its arguments or -1 if it isn't known) */
+int OptimizeCode(ParseContext *c, const uint8_t **pStackCode, int *pStackSize, int *pNeed)
+{
+    uint8_t *savedFree = c->localFree;
+    int size = codeaddr(c), count, stackCount, changed, rounds, i;
+    Instr *code, *stackCode;
+    uint8_t *p;
+
+    /* decode the instructions */
+    if (!(code = DecodeBuffer(c, &count)))
+        return 0;
+
+    /* replace calls to small functions with their code */
+    if (c->optimize && c->inlineSize > 0)
+        code = InlineCalls(c, code, &count);
+
+    /* run the passes of the optimization level until none of them finds anything left to do
+       (the rounds share one allowance of new frame slots) */
+    c->slotLimit = c->localMax + MAXNEWSLOTS;
+    rounds = 0;
+    do {
+        changed = VMFALSE;
+        for (i = 0; passes[i].pass != NULL; ++i) {
+            if (c->optimize < passes[i].level)
+                continue;
+            MarkTargets(code, count);
+            if ((*passes[i].pass)(c, &code, &count))
+                changed = VMTRUE;
+        }
+    } while (changed && ++rounds < MAXROUNDS);
+
+    /* move the code the profile says is usually skipped out of the way */
+    if (c->profile)
+        LayoutBlocks(c, &code, &count);
+
+    /* find how much of the stack a call uses for inlining calls to the code (register code holds back values instead of pushing them) */
+    *pNeed = StackNeed(c, code, count);
+
+    /* replace stack instructions with register instructions (functions small enough to inline keep their stack code) */
+    *pStackCode = NULL;
+    *pStackSize = 0;
+    if (c->encoding == ENCODING_REGISTER) {
+        stackCode = code;
+        stackCount = count;
+        SelectRegisterCode(c, &code, &count);
+        if (code != stackCode && c->codeType != CODE_TYPE_MAIN) {
+            /* only the code that is kept may add constants to the pool */
+            CompactLiterals(c, stackCode, stackCount, VMFALSE);
+            if ((*pStackSize = EncodeCode(c, stackCode, stackCount)) <= InlineLimit(c, NULL)) {
+                p = (uint8_t *)GlobalAllocBasic(c, *pStackSize);
+                memcpy(p, c->codeBuf, *pStackSize);
+                *pStackCode = p;
+            }
+        }
+    }
+
+    /* write the optimized code back into the code buffer */
+    CompactLiterals(c, code, count, VMTRUE);
+    size -= EncodeCode(c, code, count);
+
+    /* remember where the branches and calls are to find them in a profile of the image */
+    if (c->profile && !c->profile->mapped)
+        MarkSites(c, code, count);
+
+    /* release the instruction array */
+    c->localFree = savedFree;
+
+    /* return the number of bytes saved */
+    return size;
+}
+
+/* RelaxBranches - use the short form of branches whose targets are close enough and return the number of bytes saved */
+int RelaxBranches(ParseContext *c)
+{
+    uint8_t *savedFree = c->localFree;
+    int size = codeaddr(c), count;
+    Instr *code;
+
+    /* decode the instructions */
+    if (!(code = DecodeBuffer(c, &count)))
+        return 0;
+
+    /* write the code back into the code buffer choosing the branch and literal forms */
+    CompactLiterals(c, code, count, VMTRUE);
+    size -= EncodeCode(c, code, count);
+
+    /* remember where the branches and calls are to find them in a profile of the image */
+    if (c->profile && !c->profile->mapped)
+        MarkSites(c, code, count);
+
+    /* release the instruction array */
+    c->localFree = savedFree;
+
+    /* return the number of bytes saved */
+    return size;
+}
+
+/* DecodeBuffer - decode the code under construction or return NULL if it can't be decoded */
+static Instr *DecodeBuffer(ParseContext *c, int *pCount)
+{
+    Instr *code;
+    int count;
+
+    /* count the instructions (code that can't be decoded is left alone) */
+    if ((count = CountInstrs(c->codeBuf, codeaddr(c))) <= 0)
+        return NULL;
+
+    /* leave the code alone if there isn't enough memory to decode it */
+    if (!(code = (Instr *)OptimizerAlloc(c, count * sizeof(Instr))))
+        return NULL;
+
+    /* decode the instructions and number the branches and calls a profile counts */
+    DecodeCode(c, c->codeBuf, code, count);
+    if (c->profile)
+        NumberSites(code, count);
+    *pCount = count;
+    return code;
+}
+
+/* DecodeStoredCode - decode the code of a function that has already been stored or return NULL if it can't be decoded */
+Instr *DecodeStoredCode(ParseContext *c, const uint8_t *bytes, int size, int *pCount)
+{
+    Instr *code;
+    int count;
+
+    if (!bytes
+    ||  (count = CountInstrs(bytes, size)) <= 0
+    ||  !(code = (Instr *)OptimizerAlloc(c, count * sizeof(Instr))))
+        return NULL;
+    DecodeCode(c, bytes, code, count);
+
+    *pCount = count;
+    return code;
+}
+
+/* CountInstrs - count the instructions in a block of code */
+static int CountInstrs(const uint8_t *code, int size)
+{
+    const uint8_t *p = code, *end = code + size;
+    int count = 0;
+    OTDEF *def;
+    while (p < end) {
+        if (!(def = LookupOpcode(*p)))
+            return -1;
+        p += 1 + OperandSize(def->fmt);
+        ++count;
+    }
+    return p == end ? count : -1;
+}
+
+/* DecodeCode - decode the instructions in a block of code */
+static void DecodeCode(ParseContext *c, const uint8_t *bytes, Instr *code, int count)
+{
+    const uint8_t *p = bytes;
+    int i, cnt;
+
+    for (i = 0; i < count; ++i) {
+        Instr *instr = &code[i];
+        instr->opcode = *p;
+        instr->fmt = LookupOpcode(*p)->fmt;
+        instr->flags = 0;
+        instr->addr = (int)(p - bytes);
+        instr->operand = 0;
+        instr->operand2 = 0;
+        instr->target = 0;
+        instr->site = 0;
+        ++p;
+        switch (instr->fmt) {
+        case FMT_BYTE:
+            instr->operand = *p++;
+            break;
+        case FMT_SBYTE:
+            instr->operand = (int8_t)*p++;
+            break;
+        case FMT_SBYTE2:
+            instr->operand = (int8_t)*p++;
+            instr->operand2 = (int8_t)*p++;
+            break;
+        case FMT_BYTE_SBYTE:
+            instr->operand = *p++;
+            instr->operand2 = (int8_t)*p++;
+            break;
+        case FMT_BYTE2_WORD:
+            instr->operand2 = (p[0] << 8) | p[1];
+            p += 2;
+            /* fall through */
+        case FMT_WORD:
+            for (cnt = sizeof(VMWORD); --cnt >= 0; )
+                instr->operand = (instr->operand << 8) | *p++;
+            break;
+        case FMT_SWORD:
+            instr->operand = (VMWORD)((p[0] << 8) | p[1]);
+            p += 2;
+            break;
+        case FMT_LONG:
+            for (cnt = sizeof(VMVALUE); --cnt >= 0; )
+                instr->operand = (instr->operand << 8) | *p++;
+            break;
+        case FMT_REG2:
+            instr->operand = *p++;
+            instr->operand2 = *p++;
+            break;
+        case FMT_REG3:
+            instr->operand = *p++;
+            instr->operand2 = (p[0] << 8) | p[1];
+            p += 2;
+            break;
+        case FMT_REG_LONG:
+            instr->operand2 = *p++;
+            for (cnt = sizeof(VMVALUE); --cnt >= 0; )
+                instr->operand = (instr->operand << 8) | *p++;
+            break;
+        case FMT_REG_BR:
+            instr->operand = *p++;
+            for (cnt = sizeof(VMWORD); --cnt >= 0; )
+                instr->target = (instr->target << 8) | *p++;
+            instr->target = (VMWORD)instr->target;
+            break;
+        case FMT_SBYTE_BR:
+            instr->operand = (int8_t)*p++;
+            /* fall through */
+        case FMT_BR:
+            for (cnt = sizeof(VMWORD); --cnt >= 0; )
+                instr->target = (instr->target << 8) | *p++;
+            instr->target = (VMWORD)instr->target;
+            break;
+        case FMT_SBR:
+            instr->target = (int8_t)*p++;
+            break;
+        }
+    }
+
+    /* link each branch to its target (the offset is relative to the end of the instruction) */
+    for (i = 0; i < count; ++i) {
+        Instr *instr = &code[i];
+        if (IsBranch(instr->fmt)) {
+            int addr = instr->addr + 1 + OperandSize(instr->fmt) + instr->target;
+            instr->target = FindInstr(code, count, addr);
+        }
+    }
+
+    /* work with the long form of every branch and literal until the code is encoded again */
+    for (i = 0; i < count; ++i) {
+        if (code[i].fmt == FMT_SBR)
+            SetOpcode(&code[i], BranchForm(code[i].opcode, 1, 0));
+        else if (code[i].opcode == OP_CLIT) {
+            SetOpcode(&code[i], OP_LIT);
+            code[i].operand = c->pool[code[i].operand];
+        }
+        else if (code[i].opcode == OP_WLIT)
+            SetOpcode(&code[i], OP_LIT);
+    }
+
+    /* mark the entries of jump tables */
+    for (i = 0; i < count; ++i)
+        if (code[i].opcode == OP_JUMPTABLE)
+            for (cnt = 1; cnt <= code[i].operand && i + cnt < count; ++cnt)
+                code[i + cnt].flags |= INSTR_TABLE;
+}
+
+/* InlineCalls - replace calls to small functions with the code of the function */
+static Instr *InlineCalls(ParseContext *c, Instr *code, int *pCount)
+{
+    int count = *pCount, base = c->localMax, slots = 0, sites = 0;
+    int needFrame = (code[0].opcode != OP_FRAME);
+    int calleeCount, newCount, newSlots, limit, fits, first, i, j, k;
+    int *size, *frameSlots, *use, *stacked, *storeTo, *map;
+    Function *callee, **callees;
+    uint8_t *savedFree;
+    Instr *newCode, *body;
+
+    /* allocate the call site tables, the stack use table, the argument store table and the instruction index map */
+    if (!(callees = (Function **)OptimizerAlloc(c, count * sizeof(Function *)))
+    ||  !(size = (int *)OptimizerAlloc(c, count * sizeof(int)))
+    ||  !(frameSlots = (int *)OptimizerAlloc(c, count * sizeof(int)))
+    ||  !(use = (int *)OptimizerAlloc(c, count * sizeof(int)))
+    ||  !(stacked = (int *)OptimizerAlloc(c, count * sizeof(int)))
+    ||  !(storeTo = (int *)OptimizerAlloc(c, count * sizeof(int)))
+    ||  !(map = (int *)OptimizerAlloc(c, (count + 1) * sizeof(int))))
+        return code;
+    savedFree = c->localFree;
+
+    /* find the call sites to inline */
+    for (i = 0; i < count; ++i) {
+        callees[i] = NULL;
+        storeTo[i] = -1;
+        if ((callee = FindCallee(c, code, count, i)) != NULL
+        &&  (calleeCount = DecodeCallee(c, callee, InlineLimit(c, &code[i]), &body, &first)) > 0
+        &&  base + (frameSlots[i] = callee->argc + (first ? body[0].operand : 0)) <= MAXLOCALS) {
+            callees[i] = callee;
+            size[i] = calleeCount - first + (code[i].opcode == OP_TCALL ? 1 : 0);
+            ++sites;
+        }
+        c->localFree = savedFree;
+    }
+
+    /* check for nothing to inline */
+    if (sites == 0)
+        return code;
+
+    /* find how much of the stack the code uses at its deepest point (-1 if it isn't known)
+       (functions don't know how deep they are called so they may not use more than before
+       but the main code may grow into the rest of the smallest VM stack less the slots the passes may add) */
+    limit = -1;
+    if (StackUses(c, code, count, use)) {
+        for (i = 0; i < count; ++i)
+            if (use[i] > limit)
+                limit = use[i];
+        if (c->codeType == CODE_TYPE_MAIN && limit < MIN_STACK_SIZE - F_SIZE - MAXNEWSLOTS - base)
+            limit = MIN_STACK_SIZE - F_SIZE - MAXNEWSLOTS - base;
+    }
+
+    /* the inlined arguments and locals stay in the frame while the rest of the code runs
+       (an inlined call doesn't use more of the stack than the call did if its frame was at least that big) */
+    for (i = 0; i < count; ++i) {
+        if (callees[i] == NULL)
+            continue;
+        newSlots = (frameSlots[i] > slots ? frameSlots[i] : slots);
+        fits = (newSlots == 0 || limit >= 0);
+        for (k = 0; k < count && fits && newSlots > 0; ++k) {
+            if (k <= i && callees[k] != NULL)
+                fits = (newSlots <= frameSlots[k] + F_SIZE);
+            else
+                fits = (use[k] + newSlots <= limit);
+        }
+        if (fits)
+            slots = newSlots;
+        else {
+            callees[i] = NULL;
+            --sites;
+        }
+    }
+
+    /* check for nothing left to inline */
+    if (sites == 0)
+        return code;
+
+    /* store the arguments into their frame slots where they are computed when nothing after them uses the stack below them */
+    MarkTargets(code, count);
+    for (i = 0; i < count; ++i)
+        if (callees[i] != NULL)
+            stacked[i] = StoreArguments(code, i, callees[i]->argc, base, storeTo);
+
+    /* find where each instruction will end up (code without a frame needs one for the inlined arguments and locals) */
+    newCount = (needFrame ? 1 : 0);
+    for (i = 0; i < count; ++i) {
+        map[i] = newCount;
+        newCount += (callees[i] != NULL ? stacked[i] + size[i] : 1) + (storeTo[i] >= 0 ? 1 : 0);
+    }
+    map[count] = newCount;
+
+    /* allocate the new code */
+    if (!(newCode = (Instr *)OptimizerAlloc(c, newCount * sizeof(Instr))))
+        return code;
+    savedFree = c->localFree;
+
+    /* start the code with a frame */
+    j = 0;
+    if (needFrame) {
+        memset(&newCode[j], 0, sizeof(Instr));
+        SetOpcode(&newCode[j], OP_FRAME);
+        ++j;
+    }
+
+    /* copy the code expanding the inlined calls */
+    for (i = 0; i < count; ) {
+        if ((callee = callees[i]) != NULL) {
+            int start = j, end;
+
+            /* decode the function again (the code after a tail call returns from the caller) */
+            if ((calleeCount = DecodeCallee(c, callee, InlineLimit(c, &code[i]), &body, &first)) <= 0) {
+
+                /* leave the calls alone if there isn't enough memory left to decode it next to the new code */
+                for (k = 0; k < i; ++k)
+                    if (callees[k] != NULL)
+                        --callees[k]->inlined;
+                c->localFree = (uint8_t *)newCode;
+                return code;
+            }
+            end = start + stacked[i] + calleeCount - first;
+            if (code[i].opcode == OP_TCALL) {
+                memset(&newCode[end], 0, sizeof(Instr));
+                SetOpcode(&newCode[end], OP_RETURN);
+                newCode[end].operand = code[i].operand2 & 0xff;
+            }
+
+            /* store the arguments left on the stack into their frame slots (the last one is on top of the stack) */
+            for (k = stacked[i]; --k >= 0; ) {
+                memset(&newCode[j], 0, sizeof(Instr));
+                SetOpcode(&newCode[j], OP_LSET);
+                newCode[j].operand = LOCALOFFSET(base + k);
+                ++j;
+            }
+
+            /* copy the body of the function without its FRAME instruction */
+            for (k = first; k < calleeCount; ++k, ++j) {
+                Instr *instr = &newCode[j];
+                *instr = body[k];
+                instr->flags &= INSTR_TABLE;
+                switch (instr->opcode) {
+                case OP_LREF:
+                case OP_LSET:
+                case OP_INCL:
+                case OP_FORNEXT:
+                    if (instr->operand >= 0)
+                        instr->operand = LOCALOFFSET(base + callee->argc - instr->operand - 1);
+                    else
+                        instr->operand = LOCALOFFSET(base + callee->argc - instr->operand - F_SIZE - 1);
+                    break;
+                case OP_RETURN:
+                    SetOpcode(instr, OP_BR);
+                    instr->target = end;
+                    break;
+                default:
+                    break;
+                }
+                if (body[k].opcode != OP_RETURN && IsBranch(instr->fmt))
+                    instr->target = (body[k].target < calleeCount ? start + stacked[i] + body[k].target - first : end);
+            }
+
+            if (code[i].opcode == OP_TCALL)
+                ++j;
+            ++callee->inlined;
+            c->localFree = savedFree;
+            ++i;
+        }
+        else {
+            newCode[j] = code[i];
+            if (IsBranch(newCode[j].fmt))
+                newCode[j].target = map[code[i].target];
+            ++j;
+
+            /* store an argument of an inlined call into its frame slot as soon as it is computed */
+            if (storeTo[i] >= 0) {
+                memset(&newCode[j], 0, sizeof(Instr));
+                SetOpcode(&newCode[j], OP_LSET);
+                newCode[j].operand = LOCALOFFSET(storeTo[i]);
+                ++j;
+            }
+            ++i;
+        }
+    }
+
+    /* make room in the frame for the inlined arguments and locals */
+    c->localMax += slots;
+    newCode[0].operand = c->localMax;
+
+    /* return the new code */
+    *pCount = newCount;
+    return newCode;
+}
+
+/* StoreArguments - find the instructions that compute the arguments of a call, mark them to store their values
+   into the frame slots starting at base and return the number of arguments that must still be passed on the stack */
+static int StoreArguments(Instr *code, int i, int argc, int base, int *storeTo)
+{
+    int depth = argc, pops, pushes, floor;
+
+    /* look back through straight line code for the last instruction to write each argument's stack entry
+       (the arguments above it are stored first so the entries below them never move) */
+    while (argc > 0 && --i >= 0) {
+        Instr *instr = &code[i];
+        if (IsBranch(instr->fmt) || (instr->flags & (INSTR_TARGET | INSTR_TABLE))
+        ||  !StackEffect(instr->opcode, &pops, &pushes))
+            break;
+        floor = depth - pushes;
+        if (floor < argc) {
+            if (pushes != 1 || floor != argc - 1)
+                break;
+            storeTo[i] = base + --argc;
+        }
+        depth = floor + pops;
+    }
+
+    return argc;
+}
+
+/* StackNeed - get the number of stack entries a call to the code uses beyond its arguments (-1 if it isn't known) */
+static int StackNeed(ParseContext *c, Instr *code, int count)
+{
+    int *use, first, frame, peak = 0, i;
+
+    if (!(use = (int *)OptimizerAlloc(c, count * sizeof(int))) || !StackUses(c, code, count, use))
+        return -1;
+
+    for (i = 0; i < count; ++i)
+        if (use[i] > peak)
+            peak = use[i];
+
+    first = NextInstr(code, count, -1);
+    frame = (first < count && code[first].opcode == OP_FRAME ? code[first].operand : 0);
+    return F_SIZE + frame + peak;
+}
+
+/* StackUses - find the stack entries above the frame that each instruction uses (a call includes the stack the callee uses)
+   and return VMFALSE if that can't be known */
+static int StackUses(ParseContext *c, Instr *code, int count, int *use)
+{
+    int changed, pops, pushes, after, target, next, i;
+    Function *callee;
+
+    /* find the operand stack depth before each instruction (-1 until it is reached) */
+    for (i = 0; i < count; ++i)
+        use[i] = -1;
+    if ((i = NextInstr(code, count, -1)) < count)
+        use[i] = 0;
+    do {
+        changed = VMFALSE;
+        for (i = 0; i < count; ++i) {
+            if ((code[i].flags & INSTR_DELETED) || use[i] < 0)
+                continue;
+            if (!InstrEffect(c, code, count, i, &pops, &pushes) || use[i] < pops)
+                return VMFALSE;
+            after = use[i] - pops + pushes;
+
+            /* a short circuit branch leaves its condition on the stack when it is taken */
+            if (IsBranch(code[i].fmt)
+            &&  (target = ResolveTarget(code, count, code[i].target)) < count
+            &&  !SetDepth(use, target, (code[i].opcode == OP_BRTSC || code[i].opcode == OP_BRFSC ? use[i] : after), &changed))
+                return VMFALSE;
+            if ((FallsThrough(code[i].opcode) || (code[i].flags & INSTR_TABLE))
+            &&  (next = NextInstr(code, count, i)) < count
+            &&  !SetDepth(use, next, after, &changed))
+                return VMFALSE;
+        }
+    } while (changed);
+
+    /* add the entries each instruction pushes or the callee uses to the depth before it */
+    for (i = 0; i < count; ++i) {
+        if ((code[i].flags & INSTR_DELETED) || use[i] < 0)
+            use[i] = 0;
+        else if (code[i].opcode == OP_DCALL || code[i].opcode == OP_TCALL) {
+            if ((callee = FindCallee(c, code, count, i))->need < 0)
+                return VMFALSE;
+            use[i] += callee->need;
+        }
+        else if (InstrEffect(c, code, count, i, &pops, &pushes) && pushes > pops)
+            use[i] += pushes - pops;
+    }
+
+    return VMTRUE;
+}
+
+/* SetDepth - set the operand stack depth before an instruction and return VMFALSE if it was reached before with another depth */
+static int SetDepth(int *depth, int i, int value, int *pChanged)
+{
+    if (depth[i] < 0) {
+        depth[i] = value;
+        *pChanged = VMTRUE;
+    }
+    return depth[i] == value;
+}
+
+/* InstrEffect - get the number of operand stack entries any instruction pops and pushes or return VMFALSE if it isn't known */
+static int InstrEffect(ParseContext *c, Instr *code, int count, int i, int *pPops, int *pPushes)
+{
+    Function *callee;
+
+    *pPops = *pPushes = 0;
+    switch (code[i].opcode) {
+    case OP_FRAME:
+    case OP_HALT:
+        return VMTRUE;
+    case OP_RETURN:
+    case OP_BRTSC:
+    case OP_BRFSC:
+        *pPops = 1;
+        return VMTRUE;
+    case OP_DCALL:
+    case OP_TCALL:
+        if (!(callee = FindCallee(c, code, count, i)) || callee->argc < 0)
+            return VMFALSE;
+        *pPops = callee->argc;
+        *pPushes = 1;
+        return VMTRUE;
+    case OP_TRAP:
+        switch (code[i].operand) {
+        case TRAP_GetChar:
+            *pPushes = 1;
+            break;
+        case TRAP_PutChar:
+        case TRAP_PrintStr:
+        case TRAP_PrintInt:
+        case TRAP_DelayMs:
+            *pPops = 1;
+            break;
+        case TRAP_PrintTab:
+        case TRAP_PrintNL:
+        case TRAP_PrintFlush:
+        case TRAP_UpdateLeds:
+            break;
+        default:
+            return VMFALSE;
+        }
+        return VMTRUE;
+    }
+    return StackEffect(code[i].opcode, pPops, pPushes);
+}
+
+/* FindCallee - find the function called directly by a call instruction */
+Function *FindCallee(ParseContext *c, Instr *code, int count, int i)
+{
+    Function *function;
+
+    /* only direct calls can be inlined */
+    if (code[i].opcode != OP_DCALL && code[i].opcode != OP_TCALL)
+        return NULL;
+
+    /* find the function (a function can't call itself before it has been stored) */
+    for (function = c->functions; function != NULL; function = function->next)
+        if (function->symbol->value == code[i].operand)
+            return function;
+
+    return NULL;
+}
+
+/* DecodeCallee - decode a function no larger than a limit to inline and return its instruction count or zero if it can't be inlined */
+static int DecodeCallee(ParseContext *c, Function *function, int limit, Instr **pCode, int *pFirst)
+{
+    int count, i;
+    Instr *code;
+
+    /* only decode small functions */
+    if (function->stackSize > limit
+    ||  !(code = DecodeStoredCode(c, function->stackCode, function->stackSize, &count)))
+        return 0;
+
+    /* the only frame is the one at the start (functions without locals have none)
+       and there are no tail calls that would replace the frame of the caller */
+    *pFirst = (code[0].opcode == OP_FRAME ? 1 : 0);
+    for (i = *pFirst; i < count; ++i)
+        if (code[i].opcode == OP_FRAME || code[i].opcode == OP_TCALL)
+            return 0;
+
+    *pCode = code;
+    return count;
+}
+
+/* MarkTargets - mark the instructions that are the targets of branches */
+void MarkTargets(Instr *code, int count)
+{
+    int i, target;
+    for (i = 0; i < count; ++i)
+        code[i].flags &= ~INSTR_TARGET;
+    for (i = 0; i < count; ++i) {
+        Instr *instr = &code[i];
+        if (!(instr->flags & INSTR_DELETED) && IsBranch(instr->fmt)) {
+            if ((target = ResolveTarget(code, count, instr->target)) < count)
+                code[target].flags |= INSTR_TARGET;
+        }
+    }
+}
+
+/* RemoveUnreachable - delete the instructions that can't be reached from the entry point */
+static int RemoveUnreachable(ParseContext *c, Instr **pCode, int *pCount)
+{
+    Instr *code = *pCode;
+    int count = *pCount, changed, i, j;
+
+    /* only the first instruction is known to be reachable at the start */
+    for (i = 0; i < count; ++i)
+        code[i].flags &= ~INSTR_REACHABLE;
+    if ((i = NextInstr(code, count, -1)) >= count)
+        return VMFALSE;
+    code[i].flags |= INSTR_REACHABLE;
+
+    /* follow branches and fall through paths until nothing new is reached */
+    do {
+        changed = VMFALSE;
+        for (i = 0; i < count; ++i) {
+            Instr *instr = &code[i];
+            if ((instr->flags & (INSTR_REACHABLE | INSTR_DELETED)) != INSTR_REACHABLE)
+                continue;
+            if (IsBranch(instr->fmt)
+            &&  (j = ResolveTarget(code, count, instr->target)) < count
+            &&  !(code[j].flags & INSTR_REACHABLE)) {
+                code[j].flags |= INSTR_REACHABLE;
+                changed = VMTRUE;
+            }
+            if ((FallsThrough(instr->opcode) || (instr->flags & INSTR_TABLE))
+            &&  (j = NextInstr(code, count, i)) < count
+            &&  !(code[j].flags & INSTR_REACHABLE)) {
+                code[j].flags |= INSTR_REACHABLE;
+                changed = VMTRUE;
+            }
+        }
+    } while (changed);
+
+    /* delete everything else */
+    for (i = 0; i < count; ++i) {
+        if (!(code[i].flags & (INSTR_REACHABLE | INSTR_DELETED))) {
+            code[i].flags |= INSTR_DELETED;
+            changed = VMTRUE;
+        }
+    }
+
+    return changed;
+}
+
+/* FallsThrough - check to see if execution can continue with the next instruction */
+int FallsThrough(int opcode)
+{
+    switch (opcode) {
+    case OP_HALT:
+    case OP_BR:
+    case OP_RETURN:
+    case OP_TCALL:
+        return VMFALSE;
+    }
+    return VMTRUE;
+}
+
+/* IsBranch - check to see if instructions with an operand format have a branch target */
+int IsBranch(int fmt)
+{
+    return fmt == FMT_BR || fmt == FMT_SBYTE_BR || fmt == FMT_SBR || fmt == FMT_REG_BR;
+}
+
+/* BranchForm - convert a branch opcode between its long (0) and short (1) forms or return -1 if it has none */
+static int BranchForm(int opcode, int from, int to)
+{
+    int i;
+    for (i = 0; branchForms[i][from] != -1; ++i)
+        if (branchForms[i][from] == opcode)
+            return branchForms[i][to];
+    return -1;
+}
+
+/* LoadOpcode - get the load instruction that matches a store instruction */
+static int LoadOpcode(int opcode)
+{
+    switch (opcode) {
+    case OP_LSET:
+        return OP_LREF;
+    case OP_GSTORE:
+        return OP_GLOAD;
+    case OP_GSTOREW:
+        return OP_GLOADW;
+    }
+    return -1;
+}
+
+/* Peephole - make one pass over the code applying peephole patterns */
+static int Peephole(ParseContext *c, Instr **pCode, int *pCount)
+{
+    Instr *code = *pCode;
+    int count = *pCount, changed = VMFALSE;
+    int i, j;
+
+    for (i = 0; i < count; ++i) {
+        Instr *a, *b;
+
+        /* get the next pair of instructions */
+        if (code[i].flags & INSTR_DELETED)
+            continue;
+        if ((j = NextInstr(code, count, i)) >= count)
+            break;
+        a = &code[i];
+        b = &code[j];
+
+        /* pushing a value and dropping it again does nothing */
+        if (b->opcode == OP_DROP && !(b->flags & INSTR_TARGET)) {
+            switch (a->opcode) {
+            case OP_LIT:
+            case OP_SLIT:
+            case OP_LREF:
+            case OP_GLOAD:
+            case OP_GLOADW:
+            case OP_DUP:
+                DeleteInstr(code, count, i);
+                DeleteInstr(code, count, j);
+                changed = VMTRUE;
+                continue;
+            }
+        }
+
+        switch (a->opcode) {
+
+        /* adding or subtracting zero or multiplying or dividing by one does nothing */
+        case OP_SLIT:
+            if (b->flags & INSTR_TARGET)
+                break;
+            switch (b->opcode) {
+            case OP_ADD:
+            case OP_SUB:
+            case OP_BOR:
+            case OP_BXOR:
+            case OP_SHL:
+            case OP_SHR:
+                if (a->operand != 0)
+                    continue;
+                break;
+            case OP_MUL:
+            case OP_DIV:
+                if (a->operand != 1)
+                    continue;
+                break;
+            default:
+                continue;
+            }
+            DeleteInstr(code, count, i);
+            DeleteInstr(code, count, j);
+            changed = VMTRUE;
+            break;
+
+        /* LSET n, LREF n -> DUP, LSET n (and the same for GSTORE n, GLOAD n) */
+        case OP_LSET:
+        case OP_GSTORE:
+        case OP_GSTOREW:
+            if (b->opcode == LoadOpcode(a->opcode) && b->operand == a->operand && !(b->flags & INSTR_TARGET)) {
+                SetOpcode(b, a->opcode);
+                SetOpcode(a, OP_DUP);
+                changed = VMTRUE;
+            }
+            break;
+
+        /* NOT, BRF -> BRT and NOT, BRT -> BRF */
+        case OP_NOT:
+            if ((b->opcode == OP_BRF || b->opcode == OP_BRT) && !(b->flags & INSTR_TARGET)) {
+                b->opcode = (b->opcode == OP_BRF ? OP_BRT : OP_BRF);
+                DeleteInstr(code, count, i);
+                changed = VMTRUE;
+            }
+            break;
+
+        /* a branch to the next instruction does nothing (except pop the condition) */
+        case OP_BR:
+        case OP_BRT:
+        case OP_BRF:
+            if (ResolveTarget(code, count, a->target) == j && !(a->flags & INSTR_TABLE)) {
+                if (a->opcode == OP_BR)
+                    DeleteInstr(code, count, i);
+                else
+                    SetOpcode(a, OP_DROP);
+                changed = VMTRUE;
+            }
+            break;
+        }
+    }
+
+    return changed;
+}
+
+/* ThreadJumps - make one pass over the code shortening paths through unconditional branches */
+static int ThreadJumps(ParseContext *c, Instr **pCode, int *pCount)
+{
+    Instr *code = *pCode;
+    int count = *pCount, changed = VMFALSE;
+    int i, j, target, hops;
+
+    for (i = 0; i < count; ++i) {
+        Instr *instr = &code[i];
+        if ((instr->flags & INSTR_DELETED) || !IsBranch(instr->fmt))
+            continue;
+
+        /* a branch to a BR can go straight to where the BR goes (giving up on BR loops) */
+        target = ResolveTarget(code, count, instr->target);
+        for (hops = 0; target < count && code[target].opcode == OP_BR && hops < count; ++hops)
+            target = ResolveTarget(code, count, code[target].target);
+        if (hops > 0 && hops < count) {
+            instr->target = target;
+            if (target < count)
+                code[target].flags |= INSTR_TARGET;
+            changed = VMTRUE;
+        }
+
+        /* BRF L1, BR L2, L1: -> BRT L2, L1: (and the same for BRT) */
+        if ((instr->opcode == OP_BRF || instr->opcode == OP_BRT)
+        &&  (j = NextInstr(code, count, i)) < count
+        &&  code[j].opcode == OP_BR
+        &&  !(code[j].flags & INSTR_TARGET)
+        &&  NextInstr(code, count, j) == ResolveTarget(code, count, instr->target)) {
+            instr->opcode = (instr->opcode == OP_BRF ? OP_BRT : OP_BRF);
+            instr->target = code[j].target;
+            DeleteInstr(code, count, j);
+            changed = VMTRUE;
+        }
+    }
+
+    return changed;
+}
+
+/* CompactLiterals - choose the shortest form of each literal (grow allows adding constants used more than once to the pool) */
+static void CompactLiterals(ParseContext *c, Instr *code, int count, int grow)
+{
+    int index, i;
+
+    for (i = 0; i < count; ++i) {
+        Instr *instr = &code[i];
+        if ((instr->flags & INSTR_DELETED) || instr->opcode != OP_LIT)
+            continue;
+        if (instr->operand >= -128 && instr->operand <= 127)
+            SetOpcode(instr, OP_SLIT);
+        else if (instr->operand >= -32768 && instr->operand <= 32767)
+            SetOpcode(instr, OP_WLIT);
+        else if ((index = PoolIndex(c, code, count, i, grow)) >= 0) {
+            SetOpcode(instr, OP_CLIT);
+            instr->operand = index;
+        }
+    }
+}
+
+/* PoolIndex - get the constant pool index of the value of a literal or -1 if it isn't worth pooling */
+static int PoolIndex(ParseContext *c, Instr *code, int count, int i, int grow)
+{
+    VMVALUE value = code[i].operand;
+    int index, j;
+
+    /* use a constant that is already in the pool */
+    for (index = 0; index < c->poolCount; ++index)
+        if (c->pool[index] == value)
+            return index;
+
+    /* a pool entry only pays for itself when the value is loaded more than once */
+    if (!grow || c->poolCount >= MAXPOOL)
+        return -1;
+    for (j = i + 1; j < count; ++j)
+        if (!(code[j].flags & INSTR_DELETED) && code[j].opcode == OP_LIT && code[j].operand == value)
+            break;
+    if (j >= count)
+        return -1;
+    c->pool[c->poolCount] = value;
+    return c->poolCount++;
+}
+
+/* EncodeCode - write the instructions back into the code buffer and return the new size */
+static int EncodeCode(ParseContext *c, Instr *code, int count)
+{
+    int shortened, opcode, addr, i;
+
+    /* assign the new instruction offsets shortening branches until no more targets come within reach */
+    do {
+        for (i = 0, addr = 0; i < count; ++i) {
+            if (!(code[i].flags & INSTR_DELETED)) {
+                code[i].addr = addr;
+                addr += 1 + OperandSize(code[i].fmt);
+            }
+        }
+        shortened = VMFALSE;
+        for (i = 0; i < count; ++i) {
+            Instr *instr = &code[i];
+            if (!(instr->flags & (INSTR_DELETED | INSTR_TABLE))
+            &&  instr->fmt == FMT_BR
+            &&  (opcode = BranchForm(instr->opcode, 0, 1)) != -1) {
+                /* shortening never moves a target further away so the current offset is an upper bound */
+                int offset = TargetAddr(code, count, instr->target, addr) - (instr->addr + 2);
+                if (offset >= -128 && offset <= 127) {
+                    SetOpcode(instr, opcode);
+                    shortened = VMTRUE;
+                }
+            }
+        }
+    } while (shortened);
+
+    /* write the instructions (they never move to higher offsets) */
+    c->codeFree = c->codeBuf;
+    for (i = 0; i < count; ++i) {
+        Instr *instr = &code[i];
+        if (instr->flags & INSTR_DELETED)
+            continue;
+        putcbyte(c, instr->opcode);
+        switch (instr->fmt) {
+        case FMT_BYTE:
+        case FMT_SBYTE:
+            putcbyte(c, instr->operand);
+            break;
+        case FMT_SBYTE2:
+        case FMT_BYTE_SBYTE:
+            putcbyte(c, instr->operand);
+            putcbyte(c, instr->operand2);
+            break;
+        case FMT_BYTE2_WORD:
+            putcbyte(c, instr->operand2 >> 8);
+            putcbyte(c, instr->operand2);
+            /* fall through */
+        case FMT_WORD:
+        case FMT_SWORD:
+            putcword(c, instr->operand);
+            break;
+        case FMT_LONG:
+            putclong(c, instr->operand);
+            break;
+        case FMT_REG2:
+            putcbyte(c, instr->operand);
+            putcbyte(c, instr->operand2);
+            break;
+        case FMT_REG3:
+            putcbyte(c, instr->operand);
+            putcbyte(c, instr->operand2 >> 8);
+            putcbyte(c, instr->operand2);
+            break;
+        case FMT_REG_LONG:
+            putcbyte(c, instr->operand2);
+            putclong(c, instr->operand);
+            break;
+        case FMT_SBYTE_BR:
+        case FMT_REG_BR:
+            putcbyte(c, instr->operand);
+            /* fall through */
+        case FMT_BR:
+            putcword(c, TargetAddr(code, count, instr->target, addr) - (instr->addr + 1 + OperandSize(instr->fmt)));
+            break;
+        case FMT_SBR:
+            putcbyte(c, TargetAddr(code, count, instr->target, addr) - (instr->addr + 2));
+            break;
+        }
+    }
+
+    /* return the new code size */
+    return addr;
+}
+
+/* InstrLength - get the length of an instruction or -1 if the opcode is unknown */
+int InstrLength(int opcode)
+{
+    OTDEF *def;
+    if (!(def = LookupOpcode(opcode)))
+        return -1;
+    return 1 + OperandSize(def->fmt);
+}
+
+/* LookupOpcode - find the opcode table entry for an opcode */
+static OTDEF *LookupOpcode(int opcode)
+{
+    OTDEF *def;
+    for (def = OpcodeTable; def->name != NULL; ++def)
+        if (def->code == opcode)
+            return def;
+    return NULL;
+}
+
+/* OperandSize - get the size of an instruction operand */
+static int OperandSize(int fmt)
+{
+    switch (fmt) {
+    case FMT_BYTE:
+    case FMT_SBYTE:
+    case FMT_SBR:
+        return 1;
+    case FMT_SBYTE2:
+    case FMT_BYTE_SBYTE:
+    case FMT_REG2:
+        return 2;
+    case FMT_REG3:
+        return 3;
+    case FMT_REG_LONG:
+        return 1 + sizeof(VMVALUE);
+    case FMT_LONG:
+        return sizeof(VMVALUE);
+    case FMT_WORD:
+    case FMT_SWORD:
+    case FMT_BR:
+        return sizeof(VMWORD);
+    case FMT_SBYTE_BR:
+    case FMT_REG_BR:
+        return 1 + sizeof(VMWORD);
+    case FMT_BYTE2_WORD:
+        return 2 + sizeof(VMWORD);
+    }
+    return 0;
+}
+
+/* FindInstr - find the instruction at an offset (count if it's past the end) */
+static int FindInstr(Instr *code, int count, int addr)
+{
+    int lo = 0, hi = count - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (code[mid].addr == addr)
+            return mid;
+        else if (code[mid].addr < addr)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+    return count;
+}
+
+/* NextInstr - find the next instruction that hasn't been deleted */
+int NextInstr(Instr *code, int count, int i)
+{
+    while (++i < count && (code[i].flags & INSTR_DELETED))
+        ;
+    return i;
+}
+
+/* ResolveTarget - find the instruction a branch to a possibly deleted instruction reaches */
+int ResolveTarget(Instr *code, int count, int i)
+{
+    while (i < count && (code[i].flags & INSTR_DELETED))
+        ++i;
+    return i;
+}
+
+/* TargetAddr - get the address of the instruction a branch reaches (end if it's past the last instruction) */
+static int TargetAddr(Instr *code, int count, int i, int end)
+{
+    i = ResolveTarget(code, count, i);
+    return i < count ? code[i].addr : end;
+}
+
+/* DeleteInstr - delete an instruction passing any branch target on to the next instruction */
+void DeleteInstr(Instr *code, int count, int i)
+{
+    int next;
+    code[i].flags |= INSTR_DELETED;
+    if ((code[i].flags & INSTR_TARGET) && (next = NextInstr(code, count, i)) < count)
+        code[next].flags |= INSTR_TARGET;
+}
+
+/* SetOpcode - change the opcode of an instruction */
+void SetOpcode(Instr *instr, int opcode)
+{
+    instr->opcode = opcode;
+    instr->fmt = LookupOpcode(opcode)->fmt;
+}
+
+/* OptimizerAlloc - allocate memory from the local heap or return NULL if there isn't enough */
+void *OptimizerAlloc(ParseContext *c, size_t size)
+{
+    if ((size_t)(c->globalFree - c->localFree) < size + HOST_ALIGN_MASK)
+        return NULL;
+    return LocalAllocBasic(c, size);
+}
+
+/* ReserveInstrs - make room after the code for inserting instructions (the code must be the last thing allocated) */
+int ReserveInstrs(ParseContext *c, Instr *code, int count, int n)
+{
+    uint8_t *end = (uint8_t *)(code + count + n);
+    return end <= c->localFree || OptimizerAlloc(c, end - c->localFree) != NULL;
+}
+
+/* InsertInstrs - insert empty instructions before instruction i (join is true if branches to i should reach them) */
+void InsertInstrs(Instr *code, int *pCount, int i, int n, int join)
+{
+    int count = *pCount, j;
+
+    memmove(&code[i + n], &code[i], (count - i) * sizeof(Instr));
+    memset(&code[i], 0, n * sizeof(Instr));
+    *pCount = count += n;
+
+    for (j = 0; j < count; ++j)
+        if (IsBranch(code[j].fmt) && (code[j].target > i || (code[j].target == i && !join)))
+            code[j].target += n;
+}
+
+/* NewSlot - add a slot to the frame and return its offset or zero if the frame is full or has grown enough */
+int NewSlot(ParseContext *c)
+{
+    if (c->localMax >= MAXLOCALS || c->localMax >= c->slotLimit)
+        return 0;
+    return LOCALOFFSET(c->localMax++);
+}
+
+/* UpdateFrame - make the frame at the start of the code hold all of the slots (room for an instruction must be reserved) */
+void UpdateFrame(ParseContext *c, Instr *code, int *pCount)
+{
+    int first = NextInstr(code, *pCount, -1);
+    if (first >= *pCount || code[first].opcode != OP_FRAME) {
+        InsertInstrs(code, pCount, 0, 1, VMFALSE);
+        SetOpcode(&code[0], OP_FRAME);
+        first = 0;
+    }
+    code[first].operand = c->localMax;
+}
@@ -0,0 +1,257 @@
+/* db_profile.c - profile-guided code layout, inlining and function placement
+ *
+ * Copyright (c) 2014 by David Michael Betz.  All rights reserved.
+ *
+ */
+
+#include <string.h>
+#include "db_optimize.h"
+
+/* a call site is hot if it makes at least this fraction of the calls of the busiest one */
+#define HOTSHARE        8
+
+/* functions this many times larger than the inline size are inlined at hot call sites */
+#define HOTINLINE       4
+
+/* local function prototypes */
+static int IsProfiledOp(int opcode);
+static int IsCallOp(int opcode);
+static ProfileSite *SiteCounts(ParseContext *c, Instr *instr);
+static ProfileSite *FindOffset(Profile *profile, VMUVALUE offset);
+static void Reverse(Instr *code, int first, int last);
+static int MovedIndex(int i, int branch, int target, int count);
+
+/* NumberSites - number the branches and calls of newly generated code */
+void NumberSites(Instr *code, int count)
+{
+    int next = 0, i;
+    for (i = 0; i < count; ++i)
+        if (IsProfiledOp(code[i].opcode))
+            code[i].site = ++next;
+}
+
+/* MarkSites - remember where the numbered sites ended up in the encoded code */
+void MarkSites(ParseContext *c, Instr *code, int count)
+{
+    ProfileMark *mark;
+    int n = 0, i;
+
+    /* count the sites that are still branches or calls */
+    for (i = 0; i < count; ++i)
+        if (!(code[i].flags & INSTR_DELETED) && code[i].site && (IsBranch(code[i].fmt) || IsCallOp(code[i].opcode)))
+            ++n;
+
+    /* record their offsets */
+    c->marks = NULL;
+    c->markCount = 0;
+    if (n == 0)
+        return;
+    c->marks = mark = (ProfileMark *)GlobalAllocBasic(c, n * sizeof(ProfileMark));
+    for (i = 0; i < count; ++i) {
+        if (!(code[i].flags & INSTR_DELETED) && code[i].site && (IsBranch(code[i].fmt) || IsCallOp(code[i].opcode))) {
+            mark->site = code[i].site;
+            mark->addr = code[i].addr;
+            mark->call = IsCallOp(code[i].opcode);
+            ++mark;
+        }
+    }
+    c->markCount = n;
+}
+
+/* MapSites - find the profiled sites of code placed at a text offset */
+void MapSites(ParseContext *c, ProfileMark *marks, int count, VMVALUE function, VMUVALUE addr)
+{
+    Profile *profile = c->profile;
+    ProfileSite *site;
+    int i;
+
+    for (i = 0; i < count; ++i) {
+        if ((site = FindOffset(profile, addr + marks[i].addr)) != NULL) {
+            site->function = function;
+            site->site = marks[i].site;
+            site->call = marks[i].call;
+            if (site->call && site->counts[0] > profile->maxCalls)
+                profile->maxCalls = site->counts[0];
+        }
+    }
+}
+
+/* OrderFunctions - order the functions by the number of branches and calls the profile counted in them
+   (the hottest ones end up next to each other and to the main code that follows them) */
+void OrderFunctions(ParseContext *c)
+{
+    Profile *profile = c->profile;
+    Function *function, *sorted = NULL, **pNext;
+    ProfileSite *site;
+
+    /* add up the counts of each function */
+    for (function = c->functions; function != NULL; function = function->next) {
+        function->heat = 0;
+        for (site = profile->sites; site < profile->sites + profile->count; ++site)
+            if (site->site && site->function == function->symbol->value)
+                function->heat += site->counts[0] + site->counts[1];
+    }
+
+    /* sort the functions from the coldest to the hottest keeping functions that are just as hot in order */
+    while ((function = c->functions) != NULL) {
+        c->functions = function->next;
+        for (pNext = &sorted; *pNext != NULL && (*pNext)->heat <= function->heat; pNext = &(*pNext)->next)
+            ;
+        function->next = *pNext;
+        *pNext = function;
+    }
+    c->functions = sorted;
+
+    /* find the end of the list again */
+    for (pNext = &c->functions; *pNext != NULL; pNext = &(*pNext)->next)
+        ;
+    c->pNextFunction = pNext;
+}
+
+/* InlineLimit - get the size of the largest function to inline at a call site (or anywhere if the site is NULL) */
+int InlineLimit(ParseContext *c, Instr *instr)
+{
+    Profile *profile = c->profile;
+    ProfileSite *site;
+    if (profile && profile->maxCalls > 0
+    &&  (!instr || ((site = SiteCounts(c, instr)) != NULL && site->counts[0] > 0 && site->counts[0] >= profile->maxCalls / HOTSHARE)))
+        return c->inlineSize * HOTINLINE;
+    return c->inlineSize;
+}
+
+/* LayoutBlocks - move the code that a conditional branch usually skips to the end so the usual path falls through */
+int LayoutBlocks(ParseContext *c, Instr **pCode, int *pCount)
+{
+    Instr *code = *pCode;
+    int count = *pCount, changed = VMFALSE, last, target, end, back, i, j;
+    ProfileSite *site;
+
+    /* the moved code goes after the last instruction so it must not fall through */
+    for (last = count; --last >= 0 && (code[last].flags & INSTR_DELETED); )
+        ;
+    if (last < 0 || FallsThrough(code[last].opcode) || (code[last].flags & INSTR_TABLE))
+        return VMFALSE;
+
+    /* branch straight to instructions that haven't been deleted so deleted ones can move with the code around them */
+    for (i = 0; i < count; ++i)
+        if (IsBranch(code[i].fmt))
+            code[i].target = ResolveTarget(code, count, code[i].target);
+
+    for (i = 0; i < count; ++i) {
+        Instr *instr = &code[i];
+
+        /* look for a forward branch that is taken more often than not past code that doesn't split a jump table */
+        if ((instr->flags & (INSTR_DELETED | INSTR_TABLE))
+        ||  (instr->opcode != OP_BRT && instr->opcode != OP_BRF)
+        ||  !(site = SiteCounts(c, instr))
+        ||  site->counts[0] <= site->counts[1]
+        ||  (target = instr->target) > last
+        ||  NextInstr(code, count, i) >= target
+        ||  (code[target].flags & INSTR_TABLE))
+            continue;
+
+        /* code that falls through to the target needs a branch back to it once it moves */
+        for (end = target; --end > i && (code[end].flags & INSTR_DELETED); )
+            ;
+        back = (FallsThrough(code[end].opcode) || (code[end].flags & INSTR_TABLE));
+        if (back && !ReserveInstrs(c, code, count, 1))
+            break;
+
+        /* rotate the skipped code to the end and point the branches at the new places of their targets */
+        Reverse(code, i + 1, target - 1);
+        Reverse(code, target, count - 1);
+        Reverse(code, i + 1, count - 1);
+        for (j = 0; j < count; ++j)
+            if (IsBranch(code[j].fmt))
+                code[j].target = MovedIndex(code[j].target, i, target, count);
+
+        /* branch to the moved code when the condition is the other way around (the counts no longer apply) */
+        instr->opcode = (instr->opcode == OP_BRT ? OP_BRF : OP_BRT);
+        instr->target = MovedIndex(i + 1, i, target, count);
+        instr->site = 0;
+
+        /* add the branch back */
+        if (back) {
+            memset(&code[count], 0, sizeof(Instr));
+            SetOpcode(&code[count], OP_BR);
+            code[count].target = MovedIndex(target, i, target, count);
+            ++count;
+        }
+        last = count - 1;
+        changed = VMTRUE;
+    }
+
+    *pCount = count;
+    return changed;
+}
+
+/* IsProfiledOp - check to see if the profile counts an instruction generated by the compiler */
+static int IsProfiledOp(int opcode)
+{
+    switch (opcode) {
+    case OP_BRT:
+    case OP_BRF:
+    case OP_DCALL:
+    case OP_TCALL:
+        return VMTRUE;
+    }
+    return VMFALSE;
+}
+
+/* IsCallOp - check to see if an instruction is a call the profile counts */
+static int IsCallOp(int opcode)
+{
+    return opcode == OP_DCALL || opcode == OP_TCALL;
+}
+
+/* SiteCounts - find the profile counts of a numbered instruction of the code under construction */
+static ProfileSite *SiteCounts(ParseContext *c, Instr *instr)
+{
+    Profile *profile = c->profile;
+    VMVALUE function = (c->codeType == CODE_TYPE_MAIN ? 0 : c->codeSymbol->value);
+    ProfileSite *site;
+
+    if (!profile->mapped || !instr->site)
+        return NULL;
+    for (site = profile->sites; site < profile->sites + profile->count; ++site)
+        if (site->site == instr->site && site->function == function)
+            return site;
+    return NULL;
+}
+
+/* FindOffset - find the profile counts of the instruction at a text offset */
+static ProfileSite *FindOffset(Profile *profile, VMUVALUE offset)
+{
+    int lo = 0, hi = profile->count - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (profile->sites[mid].offset == offset)
+            return &profile->sites[mid];
+        else if (profile->sites[mid].offset < offset)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+    return NULL;
+}
+
+/* Reverse - reverse the order of a range of instructions */
+static void Reverse(Instr *code, int first, int last)
+{
+    Instr tmp;
+    for (; first < last; ++first, --last) {
+        tmp = code[first];
+        code[first] = code[last];
+        code[last] = tmp;
+    }
+}
+
+/* MovedIndex - get the new index of an instruction after the code between a branch and its target moves to the end */
+static int MovedIndex(int i, int branch, int target, int count)
+{
+    if (i <= branch || i >= count)
+        return i;
+    if (i >= target)
+        return i - (target - branch - 1);
+    return i + (count - target);
+}
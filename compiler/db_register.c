@@ -0,0 +1,495 @@
+/* db_register.c - replace stack instruction sequences with register instructions
+ *
+ * Copyright (c) 2014 by David Michael Betz.  All rights reserved.
+ *
+ */
+
+#include <string.h>
+#include "db_optimize.h"
+#include "db_vmdebug.h"
+
+/* maximum number of values that can be held back from the stack */
+#define MAXPENDING      16
+
+/* range of frame offsets and global variables that fit in a register specifier */
+#define MINOFFSET       -32
+#define MAXOFFSET       31
+#define MAXGLOBAL       127
+
+/* range of constants that fit in a register specifier */
+#define MINCONST        -31
+#define MAXCONST        31
+
+/* kinds of values held back from the stack */
+#define VAL_REGISTER    0   /* variable or small constant with a register specifier */
+#define VAL_LITERAL     1   /* constant that doesn't fit in a register specifier */
+#define VAL_STACK       2   /* result that is already on the stack */
+
+/* value that hasn't been pushed onto the stack yet */
+typedef struct {
+    int kind;           /* kind of value */
+    int spec;           /* register specifier of a variable or small constant */
+    int opcode;         /* instruction that pushes a literal (LIT is kept for text addresses) */
+    VMVALUE value;      /* value of a literal */
+    int index;          /* where the value would have been pushed or the instruction that pushed a result */
+} Pending;
+
+/* register selection state */
+typedef struct {
+    Instr *code;                    /* new instructions */
+    int count;                      /* number of new instructions */
+    int size;                       /* room for new instructions */
+    Pending pending[MAXPENDING];    /* values held back (the last one is on top of the stack) */
+    int depth;                      /* number of values held back */
+} RegState;
+
+/* stack opcodes and the register opcodes that replace them */
+static int registerForms[][2] = {
+{   OP_ADD,     OP_RADD     },
+{   OP_SUB,     OP_RSUB     },
+{   OP_MUL,     OP_RMUL     },
+{   OP_DIV,     OP_RDIV     },
+{   OP_REM,     OP_RREM     },
+{   OP_BAND,    OP_RBAND    },
+{   OP_BOR,     OP_RBOR     },
+{   OP_BXOR,    OP_RBXOR    },
+{   OP_SHL,     OP_RSHL     },
+{   OP_SHR,     OP_RSHR     },
+{   OP_LT,      OP_RLT      },
+{   OP_LE,      OP_RLE      },
+{   OP_EQ,      OP_REQ      },
+{   OP_NE,      OP_RNE      },
+{   OP_GE,      OP_RGE      },
+{   OP_GT,      OP_RGT      },
+{   OP_INDEX,   OP_RINDEX   },
+{   OP_NEG,     OP_RNEG     },
+{   OP_NOT,     OP_RNOT     },
+{   OP_BNOT,    OP_RBNOT    },
+{   OP_DLOAD,   OP_RDLOAD   },
+{   OP_DSTORE,  OP_RDSTORE  },
+{   OP_BRT,     OP_RBRT     },
+{   OP_BRF,     OP_RBRF     },
+{   -1,         -1          }
+};
+
+/* local function prototypes */
+static int SelectInstr(RegState *s, Instr *instr);
+static int SelectOperation(RegState *s, Instr *instr, int opcode);
+static int SelectStore(RegState *s, Instr *instr, int spec);
+static int HoldValue(RegState *s, int kind, int spec, int opcode, VMVALUE value);
+static void Flush(RegState *s, int keep);
+static int PushValue(RegState *s, Pending *value);
+static int IsPending(RegState *s, int spec);
+static Instr *Emit(RegState *s, int opcode, int index);
+static int CopyInstr(RegState *s, Instr *instr);
+static int RegisterForm(int opcode);
+static int FrameSpec(VMVALUE offset);
+static void SetDest(Instr *instr, int spec);
+
+/* SelectRegisterCode - replace stack instruction sequences within basic blocks with register instructions */
+int SelectRegisterCode(ParseContext *c, Instr **pCode, int *pCount)
+{
+    Instr *code = *pCode;
+    int count = *pCount, i;
+    uint8_t *savedFree = c->localFree;
+    int *map;
+    RegState s;
+
+    /* each instruction becomes at most one instruction and one push of a value it held back */
+    s.size = 2 * count;
+    s.count = 0;
+    s.depth = 0;
+    if (!(map = (int *)OptimizerAlloc(c, (count + 1) * sizeof(int)))
+    ||  !(s.code = (Instr *)OptimizerAlloc(c, s.size * sizeof(Instr)))) {
+        c->localFree = savedFree;
+        return VMFALSE;
+    }
+
+    /* hold values back from the stack until they're used (the stack must be complete at the start of each basic block) */
+    MarkTargets(code, count);
+    for (i = 0; i < count; ++i) {
+        Instr *instr = &code[i];
+        if (instr->flags & INSTR_DELETED)
+            continue;
+        if (instr->flags & INSTR_TARGET)
+            Flush(&s, 0);
+        map[i] = s.count;
+        if (!SelectInstr(&s, instr))
+            break;
+    }
+    Flush(&s, 0);
+    map[count] = s.count;
+
+    /* leave the code alone if it didn't fit */
+    if (i < count || s.count > s.size) {
+        c->localFree = savedFree;
+        return VMFALSE;
+    }
+
+    /* point the branches at the new instructions (only the targets start basic blocks so only their indices are right) */
+    for (i = 0; i < s.count; ++i)
+        if (IsBranch(s.code[i].fmt))
+            s.code[i].target = map[ResolveTarget(code, count, s.code[i].target)];
+
+    *pCode = s.code;
+    *pCount = s.count;
+    return VMTRUE;
+}
+
+/* RegisterDest - get the destination register specifier of an instruction or -1 if it has none */
+int RegisterDest(Instr *instr)
+{
+    switch (instr->fmt) {
+    case FMT_REG2:
+        return instr->opcode == OP_RDSTORE ? -1 : instr->operand;
+    case FMT_REG3:
+        return instr->operand;
+    case FMT_REG_LONG:
+        return instr->operand2;
+    }
+    return -1;
+}
+
+/* SelectInstr - select the instructions for a stack instruction and return VMFALSE if there isn't room */
+static int SelectInstr(RegState *s, Instr *instr)
+{
+    Pending tmp;
+    int spec, opcode;
+
+    switch (instr->opcode) {
+
+    /* variables and constants are held back until they're used */
+    case OP_LREF:
+        if ((spec = FrameSpec(instr->operand)) >= 0)
+            return HoldValue(s, VAL_REGISTER, spec, 0, 0);
+        break;
+    case OP_GLOAD:
+        if (instr->operand <= MAXGLOBAL)
+            return HoldValue(s, VAL_REGISTER, ROP_GLOBAL + (int)instr->operand, 0, 0);
+        break;
+    case OP_SLIT:
+        if (instr->operand >= MINCONST && instr->operand <= MAXCONST)
+            return HoldValue(s, VAL_REGISTER, ROP_CONST + (int)instr->operand, 0, 0);
+        /* fall through */
+    case OP_LIT:
+        return HoldValue(s, VAL_LITERAL, 0, instr->opcode, instr->operand);
+
+    /* stores take the value held back on top of the stack */
+    case OP_LSET:
+        if ((spec = FrameSpec(instr->operand)) >= 0)
+            return SelectStore(s, instr, spec);
+        break;
+    case OP_GSTORE:
+        if (instr->operand <= MAXGLOBAL)
+            return SelectStore(s, instr, ROP_GLOBAL + (int)instr->operand);
+        break;
+
+    /* values held back from a variable must be pushed before it is updated in place */
+    case OP_INCL:
+        if ((spec = FrameSpec(instr->operand)) >= 0 && IsPending(s, spec))
+            Flush(s, 0);
+        return CopyInstr(s, instr);
+    case OP_INCG:
+        if (instr->operand <= MAXGLOBAL && IsPending(s, ROP_GLOBAL + (int)instr->operand))
+            Flush(s, 0);
+        return CopyInstr(s, instr);
+
+    /* stack shuffles of values held back need no instructions */
+    case OP_DUP:
+        if (s->depth > 0 && s->depth < MAXPENDING && s->pending[s->depth - 1].kind != VAL_STACK) {
+            s->pending[s->depth] = s->pending[s->depth - 1];
+            ++s->depth;
+            return VMTRUE;
+        }
+        break;
+    case OP_SWAP:
+        if (s->depth >= 2 && s->pending[s->depth - 1].kind != VAL_STACK && s->pending[s->depth - 2].kind != VAL_STACK) {
+            tmp = s->pending[s->depth - 1];
+            s->pending[s->depth - 1] = s->pending[s->depth - 2];
+            s->pending[s->depth - 2] = tmp;
+            return VMTRUE;
+        }
+        break;
+    case OP_DROP:
+        if (s->depth > 0 && s->pending[s->depth - 1].kind != VAL_STACK) {
+            --s->depth;
+            return VMTRUE;
+        }
+        break;
+
+    /* operations on values held back become register instructions */
+    default:
+        if ((opcode = RegisterForm(instr->opcode)) != -1 && s->depth > 0)
+            return SelectOperation(s, instr, opcode);
+        break;
+    }
+
+    /* anything else works on the stack */
+    Flush(s, 0);
+    return CopyInstr(s, instr);
+}
+
+/* SelectOperation - select the instruction for an operation on values held back */
+static int SelectOperation(RegState *s, Instr *instr, int opcode)
+{
+    int sources, held, spec[2], i;
+    Pending *value;
+    Instr *rinstr;
+
+    /* get the number of sources */
+    switch (opcode) {
+    case OP_RNEG:
+    case OP_RNOT:
+    case OP_RBNOT:
+    case OP_RDLOAD:
+    case OP_RBRT:
+    case OP_RBRF:
+        sources = 1;
+        break;
+    default:
+        sources = 2;
+        break;
+    }
+
+    /* the stack must be complete before a branch and before a store that might write a variable held back */
+    if (opcode == OP_RBRT || opcode == OP_RBRF || opcode == OP_RDSTORE)
+        Flush(s, sources);
+
+    /* push the values held back below the sources */
+    held = (s->depth < sources ? s->depth : sources);
+    Flush(s, held);
+
+    /* literals go on the stack where they would have been pushed and the other sources become specifiers
+       (the first source is already on the stack if only the second one was held back) */
+    spec[0] = spec[1] = ROP_STACK;
+    for (i = 0; i < held; ++i) {
+        value = &s->pending[i];
+        if (value->kind == VAL_REGISTER)
+            spec[2 - held + i] = value->spec;
+        else if (!PushValue(s, value))
+            return VMFALSE;
+    }
+    s->depth = 0;
+
+    /* use the stack instruction if all of the sources are on the stack
+       (the result is held back so a store can still take it from the instruction) */
+    if (spec[0] == ROP_STACK && spec[1] == ROP_STACK) {
+        if (!CopyInstr(s, instr))
+            return VMFALSE;
+    }
+
+    /* otherwise use the register instruction */
+    else {
+        if (!(rinstr = Emit(s, opcode, s->count)))
+            return VMFALSE;
+        switch (opcode) {
+        case OP_RBRT:
+        case OP_RBRF:
+            rinstr->operand = spec[1];
+            rinstr->target = instr->target;
+            rinstr->site = instr->site;
+            return VMTRUE;
+        case OP_RDSTORE:
+            rinstr->operand = spec[0];
+            rinstr->operand2 = spec[1];
+            return VMTRUE;
+        }
+        rinstr->operand = ROP_STACK;
+        rinstr->operand2 = (sources == 1 ? spec[1] : (spec[0] << 8) | spec[1]);
+    }
+
+    /* keep track of the instruction that pushed the result */
+    if (opcode == OP_RBRT || opcode == OP_RBRF || opcode == OP_RDSTORE)
+        return VMTRUE;
+    return HoldValue(s, VAL_STACK, 0, 0, 0);
+}
+
+/* SelectStore - select the instructions to store the value on top of the stack into a variable */
+static int SelectStore(RegState *s, Instr *instr, int spec)
+{
+    Pending *value;
+    Instr *rinstr;
+
+    /* store values that aren't held back with the stack instruction */
+    if (s->depth == 0)
+        return CopyInstr(s, instr);
+
+    /* the values below the one being stored must be read before the variable is written */
+    if (IsPending(s, spec))
+        Flush(s, 1);
+    value = &s->pending[--s->depth];
+
+    switch (value->kind) {
+    case VAL_REGISTER:
+        if (!(rinstr = Emit(s, OP_RMOV, s->count)))
+            return VMFALSE;
+        rinstr->operand = spec;
+        rinstr->operand2 = value->spec;
+        break;
+    case VAL_LITERAL:
+        /* pushing a literal that fits in 16 bits and storing it with the stack instruction is shorter */
+        if (value->value >= -32768 && value->value <= 32767) {
+            if (!(rinstr = Emit(s, value->opcode, s->count)))
+                return VMFALSE;
+            rinstr->operand = value->value;
+            return CopyInstr(s, instr);
+        }
+        if (!(rinstr = Emit(s, OP_RLIT, s->count)))
+            return VMFALSE;
+        rinstr->operand = value->value;
+        rinstr->operand2 = spec;
+        break;
+    case VAL_STACK:
+        /* compute a result directly into the variable if nothing has been done since */
+        if (value->index != s->count - 1)
+            return CopyInstr(s, instr);
+        SetDest(&s->code[value->index], spec);
+        break;
+    }
+    return VMTRUE;
+}
+
+/* HoldValue - hold a value back from the stack */
+static int HoldValue(RegState *s, int kind, int spec, int opcode, VMVALUE value)
+{
+    Pending *pending;
+
+    /* a result is already on the stack so it can be held back even if the others have to be pushed */
+    if (s->depth == MAXPENDING)
+        Flush(s, 0);
+    pending = &s->pending[s->depth++];
+    pending->kind = kind;
+    pending->spec = spec;
+    pending->opcode = opcode;
+    pending->value = value;
+    pending->index = (kind == VAL_STACK ? s->count - 1 : s->count);
+    return s->count <= s->size;
+}
+
+/* Flush - push all but the top values held back onto the stack
+   (each one is pushed where it would have been so it ends up below the results that came after it) */
+static void Flush(RegState *s, int keep)
+{
+    int n, i;
+
+    if (keep > s->depth)
+        keep = s->depth;
+    n = s->depth - keep;
+
+    for (i = 0; i < n; ++i)
+        if (!PushValue(s, &s->pending[i]))
+            return;
+
+    /* move the values that are still held back to the bottom */
+    memmove(&s->pending[0], &s->pending[n], keep * sizeof(Pending));
+    s->depth = keep;
+}
+
+/* PushValue - push a value held back where it would have been pushed */
+static int PushValue(RegState *s, Pending *value)
+{
+    Instr *instr;
+
+    switch (value->kind) {
+    case VAL_REGISTER:
+        if (value->spec < ROP_GLOBAL) {
+            if (!(instr = Emit(s, OP_LREF, value->index)))
+                return VMFALSE;
+            instr->operand = ROP_OFFSET(value->spec);
+        }
+        else if (value->spec < ROP_CONSTS) {
+            if (!(instr = Emit(s, OP_GLOAD, value->index)))
+                return VMFALSE;
+            instr->operand = value->spec - ROP_GLOBAL;
+        }
+        else {
+            if (!(instr = Emit(s, OP_SLIT, value->index)))
+                return VMFALSE;
+            instr->operand = value->spec - ROP_CONST;
+        }
+        break;
+    case VAL_LITERAL:
+        if (!(instr = Emit(s, value->opcode, value->index)))
+            return VMFALSE;
+        instr->operand = value->value;
+        break;
+    case VAL_STACK:
+        /* already pushed */
+        break;
+    }
+    return VMTRUE;
+}
+
+/* IsPending - check to see if a value held back comes from a variable */
+static int IsPending(RegState *s, int spec)
+{
+    int i;
+    for (i = 0; i < s->depth; ++i)
+        if (s->pending[i].kind == VAL_REGISTER && s->pending[i].spec == spec)
+            return VMTRUE;
+    return VMFALSE;
+}
+
+/* Emit - insert an instruction into the new code before an index or return NULL if there isn't room
+   (values held back after that point move along with the instructions) */
+static Instr *Emit(RegState *s, int opcode, int index)
+{
+    Instr *instr;
+    int i;
+
+    if (s->count >= s->size) {
+        s->count = s->size + 1;
+        return NULL;
+    }
+
+    memmove(&s->code[index + 1], &s->code[index], (s->count - index) * sizeof(Instr));
+    ++s->count;
+    for (i = 0; i < s->depth; ++i)
+        if (s->pending[i].index >= index)
+            ++s->pending[i].index;
+
+    instr = &s->code[index];
+    memset(instr, 0, sizeof(Instr));
+    SetOpcode(instr, opcode);
+    return instr;
+}
+
+/* CopyInstr - copy an instruction into the new code */
+static int CopyInstr(RegState *s, Instr *instr)
+{
+    Instr *copy;
+    if (!(copy = Emit(s, instr->opcode, s->count)))
+        return VMFALSE;
+    *copy = *instr;
+    copy->flags &= INSTR_TABLE;
+    return VMTRUE;
+}
+
+/* RegisterForm - get the register opcode that replaces a stack opcode or -1 if there is none */
+static int RegisterForm(int opcode)
+{
+    int i;
+    for (i = 0; registerForms[i][0] != -1; ++i)
+        if (registerForms[i][0] == opcode)
+            return registerForms[i][1];
+    return -1;
+}
+
+/* FrameSpec - get the register specifier of a frame offset or -1 if it doesn't fit */
+static int FrameSpec(VMVALUE offset)
+{
+    return offset >= MINOFFSET && offset <= MAXOFFSET ? (int)offset & 0x3f : -1;
+}
+
+/* SetDest - make an instruction that pushes its result store it somewhere else */
+static void SetDest(Instr *instr, int spec)
+{
+    int opcode;
+
+    /* replace a stack instruction with the register instruction that takes its sources from the stack */
+    if (instr->fmt == FMT_NONE && (opcode = RegisterForm(instr->opcode)) != -1) {
+        SetOpcode(instr, opcode);
+        instr->operand2 = (instr->fmt == FMT_REG3 ? (ROP_STACK << 8) | ROP_STACK : ROP_STACK);
+    }
+    instr->operand = spec;
+}
@@ -9,7 +9,6 @@
 #include <stdarg.h>
 #include <string.h>
 #include <setjmp.h>
-#include <ctype.h>
 #include "db_compiler.h"
 
 /* keyword table */
@@ -45,16 +44,96 @@ static struct {
 {   "STOP",     T_STOP      },
 {   "RETURN",   T_RETURN    },
 {   "PRINT",    T_PRINT     },
+{   "SELECT",   T_SELECT    },
+{   "CASE",     T_CASE      },
+{   "INC",      T_INC       },
+{   "DEC",      T_DEC       },
 #ifdef USE_ASM
 {   "ASM",      T_ASM       },
 #endif
 {   NULL,       0           }
 };
 
+/* keyword hash table size (must be a power of two) */
+#define KHASH_SIZE      32
+#define KHASH_MAXLEN    6
+
+/* keyword hash letter values (indexed by letter - 'A')
+
+   the hash of a keyword is its length plus the values of its first,
+   next to last and last letters masked to the table size.  these
+   values were found by a simple search so that no two keywords collide.
+   they must be regenerated if a keyword is added to the table above
+   (a COMPILER_DEBUG build checks them with CheckKeywords).
+*/
+static uint8_t khashValues[26] = {
+    14,  0, 18,  8, 17,  2, 28,  0, 17,  0,  0,  0, 19,
+    26,  5, 22,  0,  6, 30,  5, 11,  0, 18,  8,  0,  0
+};
+
+/* keyword hash table (perfect for the keywords above) */
+static short khash[KHASH_SIZE] = {
+    T_INC,      T_UNTIL,
+#ifdef USE_ASM
+                            T_ASM,
+#else
+                            T_NONE,
+#endif
+                                        T_MOD,
+    T_ELSE,     T_CASE,     T_IF,       T_NOT,
+    T_WHILE,    T_STEP,     T_GOTO,     T_NEXT,
+    T_RETURN,   T_REM,      T_DEC,      T_DIM,
+    T_FOR,      T_TO,       T_OR,       T_AND,
+    T_THEN,     T_NONE,     T_END,      T_DO,
+    T_DOWNTO,   T_LET,      T_PRINT,    T_SELECT,
+    T_AS,       T_STOP,     T_DEF,      T_LOOP
+};
+
+/* character classes */
+#define CT_SPACE    0x01    /* white space */
+#define CT_DIGIT    0x02    /* decimal digit */
+#define CT_XDIGIT   0x04    /* hexadecimal digit */
+#define CT_ALPHA    0x08    /* letter */
+#define CT_IDENT    0x10    /* identifier character */
+
+#define C_SP        CT_SPACE
+#define C_DG        (CT_DIGIT | CT_XDIGIT | CT_IDENT)
+#define C_HX        (CT_ALPHA | CT_XDIGIT | CT_IDENT)
+#define C_AL        (CT_ALPHA | CT_IDENT)
+#define C_ID        CT_IDENT
+
+/* character class table (characters above 0x7f have no class) */
+static uint8_t ctab[256] = {
+    0,    0,    0,    0,    0,    0,    0,    0,    0,    C_SP, C_SP, C_SP, C_SP, C_SP, 0,    0,
+    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,
+    C_SP, 0,    0,    0,    C_ID, C_ID, 0,    0,    0,    0,    0,    0,    0,    0,    0,    0,
+    C_DG, C_DG, C_DG, C_DG, C_DG, C_DG, C_DG, C_DG, C_DG, C_DG, 0,    0,    0,    0,    0,    0,
+    0,    C_HX, C_HX, C_HX, C_HX, C_HX, C_HX, C_AL, C_AL, C_AL, C_AL, C_AL, C_AL, C_AL, C_AL, C_AL,
+    C_AL, C_AL, C_AL, C_AL, C_AL, C_AL, C_AL, C_AL, C_AL, C_AL, C_AL, 0,    0,    0,    0,    C_ID,
+    0,    C_HX, C_HX, C_HX, C_HX, C_HX, C_HX, C_AL, C_AL, C_AL, C_AL, C_AL, C_AL, C_AL, C_AL, C_AL,
+    C_AL, C_AL, C_AL, C_AL, C_AL, C_AL, C_AL, C_AL, C_AL, C_AL, C_AL, 0,    0,    0,    0,    0
+};
+
+/* character class macros */
+#define CharClass(ch)       (ctab[(uint8_t)(ch)])
+#define IdentifierCharP(ch) (CharClass(ch) & CT_IDENT)
+#define DigitCharP(ch)      (CharClass(ch) & CT_DIGIT)
+
+/* KHashLetter - get the hash value of a letter (either case) */
+#define KHashLetter(ch)     (khashValues[((ch) & 0x1f) - 1])
+
+/* XGetC - get the next character without checking for comments */
+#define XGetC(c)            (*(c)->linePtr ? *(c)->linePtr++ : EOF)
+
+/* GetC - get the next character handling the common case in line */
+#define GetC(c)             ((c)->inComment || *(c)->linePtr == '/' || *(c)->linePtr == '\0' ? GetChar(c) : *(c)->linePtr++)
+
 /* local function prototypes */
 static int NextToken(ParseContext *c);
+static int CompoundToken(ParseContext *c, int tkn);
+static int AssignmentToken(ParseContext *c, int tkn, int assignTkn);
 static int IdentifierToken(ParseContext *c, int ch);
-static int IdentifierCharP(int ch);
+static int KeywordToken(const char *name, int len);
 static int NumberToken(ParseContext *c, int ch);
 static int HexNumberToken(ParseContext *c);
 static int BinaryNumberToken(ParseContext *c);
@@ -62,7 +141,6 @@ static int StringToken(ParseContext *c);
 static int CharToken(ParseContext *c);
 static int LiteralChar(ParseContext *c);
 static int SkipComment(ParseContext *c);
-static int XGetC(ParseContext *c);
 
 /* GetLine - get the next input line */
 int GetLine(ParseContext *c)
@@ -149,6 +227,10 @@ char *TokenName(int token)
     case T_STOP:
     case T_RETURN:
     case T_PRINT:
+    case T_SELECT:
+    case T_CASE:
+    case T_INC:
+    case T_DEC:
 #ifdef USE_ASM
     case T_ASM:
 #endif
@@ -177,6 +259,15 @@ char *TokenName(int token)
     case T_LOOP_UNTIL:
         name = "LOOP UNTIL";
         break;
+    case T_SELECT_CASE:
+        name = "SELECT CASE";
+        break;
+    case T_CASE_ELSE:
+        name = "CASE ELSE";
+        break;
+    case T_END_SELECT:
+        name = "END SELECT";
+        break;
     case T_LE:
         name = "<=";
         break;
@@ -192,6 +283,27 @@ char *TokenName(int token)
     case T_SHR:
         name = ">>";
         break;
+    case T_ADD_ASSIGN:
+        name = "+=";
+        break;
+    case T_SUB_ASSIGN:
+        name = "-=";
+        break;
+    case T_MUL_ASSIGN:
+        name = "*=";
+        break;
+    case T_AND_ASSIGN:
+        name = "&=";
+        break;
+    case T_OR_ASSIGN:
+        name = "|=";
+        break;
+    case T_SHL_ASSIGN:
+        name = "<<=";
+        break;
+    case T_SHR_ASSIGN:
+        name = ">>=";
+        break;
     case T_IDENTIFIER:
         name = "<IDENTIFIER>";
         break;
@@ -243,29 +355,44 @@ static int NextToken(ParseContext *c)
         tkn = CharToken(c);
         break;
     case '<':
-        if ((ch = GetChar(c)) == '=')
+        if ((ch = GetC(c)) == '=')
             tkn = T_LE;
         else if (ch == '>')
             tkn = T_NE;
         else if (ch == '<')
-            tkn = T_SHL;
+            tkn = AssignmentToken(c, T_SHL, T_SHL_ASSIGN);
         else {
             UngetC(c);
             tkn = '<';
         }
         break;
     case '>':
-        if ((ch = GetChar(c)) == '=')
+        if ((ch = GetC(c)) == '=')
             tkn = T_GE;
         else if (ch == '>')
-            tkn = T_SHR;
+            tkn = AssignmentToken(c, T_SHR, T_SHR_ASSIGN);
         else {
             UngetC(c);
             tkn = '>';
         }
         break;
+    case '+':
+        tkn = AssignmentToken(c, '+', T_ADD_ASSIGN);
+        break;
+    case '-':
+        tkn = AssignmentToken(c, '-', T_SUB_ASSIGN);
+        break;
+    case '*':
+        tkn = AssignmentToken(c, '*', T_MUL_ASSIGN);
+        break;
+    case '&':
+        tkn = AssignmentToken(c, '&', T_AND_ASSIGN);
+        break;
+    case '|':
+        tkn = AssignmentToken(c, '|', T_OR_ASSIGN);
+        break;
     case '0':
-        switch (GetChar(c)) {
+        switch (GetC(c)) {
         case 'x':
         case 'X':
             tkn = HexNumberToken(c);
@@ -281,84 +408,17 @@ static int NextToken(ParseContext *c)
         }
         break;
     default:
-        if (isdigit(ch))
+        if (DigitCharP(ch))
             tkn = NumberToken(c, ch);
         else if (IdentifierCharP(ch)) {
-            char *savePtr;
-            switch (tkn = IdentifierToken(c,ch)) {
+            switch (tkn = IdentifierToken(c, ch)) {
             case T_ELSE:
-                savePtr = c->linePtr;
-                if ((ch = SkipSpaces(c)) != EOF && IdentifierCharP(ch)) {
-                    switch (IdentifierToken(c, ch)) {
-                    case T_IF:
-                        tkn = T_ELSE_IF;
-                        break;
-                    default:
-                        c->linePtr = savePtr;
-                        break;
-                    }
-                }
-                else
-                    c->linePtr = savePtr;
-                break;
             case T_END:
-                savePtr = c->linePtr;
-                if ((ch = SkipSpaces(c)) != EOF && IdentifierCharP(ch)) {
-                    switch (IdentifierToken(c, ch)) {
-                    case T_DEF:
-                        tkn = T_END_DEF;
-                        break;
-                    case T_IF:
-                        tkn = T_END_IF;
-                        break;
-#ifdef USE_ASM
-                    case T_ASM:
-                        tkn = T_END_ASM;
-                        break;
-#endif
-                    default:
-                        c->linePtr = savePtr;
-                        break;
-                    }
-                }
-                else
-                    c->linePtr = savePtr;
-                break;
             case T_DO:
-                savePtr = c->linePtr;
-                if ((ch = SkipSpaces(c)) != EOF && IdentifierCharP(ch)) {
-                    switch (IdentifierToken(c, ch)) {
-                    case T_WHILE:
-                        tkn = T_DO_WHILE;
-                        break;
-                    case T_UNTIL:
-                        tkn = T_DO_UNTIL;
-                        break;
-                    default:
-                        c->linePtr = savePtr;
-                        break;
-                    }
-                }
-                else
-                    c->linePtr = savePtr;
-                break;
             case T_LOOP:
-                savePtr = c->linePtr;
-                if ((ch = SkipSpaces(c)) != EOF && IdentifierCharP(ch)) {
-                    switch (IdentifierToken(c, ch)) {
-                    case T_WHILE:
-                        tkn = T_LOOP_WHILE;
-                        break;
-                    case T_UNTIL:
-                        tkn = T_LOOP_UNTIL;
-                        break;
-                    default:
-                        c->linePtr = savePtr;
-                        break;
-                    }
-                }
-                else
-                    c->linePtr = savePtr;
+            case T_SELECT:
+            case T_CASE:
+                tkn = CompoundToken(c, tkn);
                 break;
             }
         }
@@ -370,15 +430,117 @@ static int NextToken(ParseContext *c)
     return tkn;
 }
 
+/* CompoundToken - check for a keyword that combines with the next keyword */
+static int CompoundToken(ParseContext *c, int tkn)
+{
+    char *savePtr = c->linePtr;
+    int ch, len, next;
+    char *p;
+
+    /* skip the blanks between the two words */
+    p = c->linePtr;
+    while (CharClass(*p) & CT_SPACE)
+        ++p;
+
+    /* fall back to the character by character scan if there might be a comment */
+    if (c->inComment || *p == '/') {
+        if ((ch = SkipSpaces(c)) != EOF && IdentifierCharP(ch))
+            next = IdentifierToken(c, ch);
+        else
+            next = T_NONE;
+    }
+
+    /* otherwise, look at the next word in place */
+    else {
+        char *word = p;
+        while (IdentifierCharP(*p))
+            ++p;
+        if (*p == '/') {
+            c->linePtr = word;
+            next = IdentifierToken(c, *c->linePtr++);
+        }
+        else if ((len = (int)(p - word)) == 0)
+            next = T_NONE;
+        else if (len > MAXTOKEN)
+            ParseError(c, "Identifier too long");
+        else if ((next = KeywordToken(word, len)) != T_IDENTIFIER) {
+            memcpy(c->token, word, len);
+            c->token[len] = '\0';
+            c->linePtr = p;
+        }
+    }
+
+    /* check for a compound keyword */
+    switch (tkn) {
+    case T_ELSE:
+        switch (next) {
+        case T_IF:
+            return T_ELSE_IF;
+        }
+        break;
+    case T_END:
+        switch (next) {
+        case T_DEF:
+            return T_END_DEF;
+        case T_IF:
+            return T_END_IF;
+        case T_SELECT:
+            return T_END_SELECT;
+#ifdef USE_ASM
+        case T_ASM:
+            return T_END_ASM;
+#endif
+        }
+        break;
+    case T_DO:
+        switch (next) {
+        case T_WHILE:
+            return T_DO_WHILE;
+        case T_UNTIL:
+            return T_DO_UNTIL;
+        }
+        break;
+    case T_LOOP:
+        switch (next) {
+        case T_WHILE:
+            return T_LOOP_WHILE;
+        case T_UNTIL:
+            return T_LOOP_UNTIL;
+        }
+        break;
+    case T_SELECT:
+        if (next == T_CASE)
+            return T_SELECT_CASE;
+        break;
+    case T_CASE:
+        if (next == T_ELSE)
+            return T_CASE_ELSE;
+        break;
+    }
+
+    /* not a compound keyword so leave the next word for the next token */
+    c->linePtr = savePtr;
+    return tkn;
+}
+
+/* AssignmentToken - check for an operator immediately followed by '=' */
+static int AssignmentToken(ParseContext *c, int tkn, int assignTkn)
+{
+    if (*c->linePtr != '=')
+        return tkn;
+    ++c->linePtr;
+    return assignTkn;
+}
+
 /* IdentifierToken - get an identifier */
 static int IdentifierToken(ParseContext *c, int ch)
 {
-    int len, i;
+    int len;
     char *p;
 
     /* get the identifier */
     p = c->token; *p++ = ch; len = 1;
-    while ((ch = GetChar(c)) != EOF && IdentifierCharP(ch)) {
+    while ((ch = GetC(c)) != EOF && IdentifierCharP(ch)) {
         if (++len > MAXTOKEN)
             ParseError(c, "Identifier too long");
         *p++ = ch;
@@ -388,22 +550,44 @@ static int IdentifierToken(ParseContext *c, int ch)
     *p = '\0';
 
     /* check to see if it is a keyword */
-    for (i = 0; ktab[i].keyword != NULL; ++i)
-        if (strcasecmp(ktab[i].keyword, c->token) == 0)
-            return ktab[i].token;
+    return KeywordToken(c->token, len);
+}
+
+/* KeywordToken - look up a keyword in the perfect hash table */
+static int KeywordToken(const char *name, int len)
+{
+    int first, prev, last, tkn;
+    const char *keyword;
+
+    /* only words made of letters that aren't too long can be keywords */
+    if (len < 2 || len > KHASH_MAXLEN)
+        return T_IDENTIFIER;
+    first = name[0]; prev = name[len - 2]; last = name[len - 1];
+    if (!(CharClass(first) & CharClass(prev) & CharClass(last) & CT_ALPHA))
+        return T_IDENTIFIER;
+
+    /* check the only keyword that could match */
+    tkn = khash[(len + KHashLetter(first) + KHashLetter(prev) + KHashLetter(last)) & (KHASH_SIZE - 1)];
+    if (tkn != T_NONE) {
+        keyword = ktab[tkn - T_REM].keyword;
+        if (strncasecmp(keyword, name, len) == 0 && keyword[len] == '\0')
+            return tkn;
+    }
 
     /* otherwise, it is an identifier */
     return T_IDENTIFIER;
 }
 
-/* IdentifierCharP - is this an identifier character? */
-static int IdentifierCharP(int ch)
+#ifdef COMPILER_DEBUG
+/* CheckKeywords - make sure every keyword hashes to its own entry in the keyword hash table */
+void CheckKeywords(ParseContext *c)
 {
-    return isupper(ch)
-        || islower(ch)
-        || isdigit(ch)
-        || strchr("$%_", ch) != NULL;
+    int i;
+    for (i = 0; ktab[i].keyword != NULL; ++i)
+        if (KeywordToken(ktab[i].keyword, (int)strlen(ktab[i].keyword)) != ktab[i].token)
+            Abort(c, "keyword %s is not in the keyword hash table", ktab[i].keyword);
 }
+#endif
 
 /* NumberToken - get a number */
 static int NumberToken(ParseContext *c, int ch)
@@ -412,8 +596,8 @@ static int NumberToken(ParseContext *c, int ch)
 
     /* get the number */
     *p++ = ch;
-    while ((ch = GetChar(c)) != EOF) {
-        if (isdigit(ch))
+    while ((ch = GetC(c)) != EOF) {
+        if (DigitCharP(ch))
             *p++ = ch;
         else if (ch != '_')
             break;
@@ -435,8 +619,8 @@ static int HexNumberToken(ParseContext *c)
     int ch;
 
     /* get the number */
-    while ((ch = GetChar(c)) != EOF) {
-        if (isxdigit(ch))
+    while ((ch = GetC(c)) != EOF) {
+        if (CharClass(ch) & CT_XDIGIT)
             *p++ = ch;
         else if (ch != '_')
             break;
@@ -458,7 +642,7 @@ static int BinaryNumberToken(ParseContext *c)
     int ch;
 
     /* get the number */
-    while ((ch = GetChar(c)) != EOF) {
+    while ((ch = GetC(c)) != EOF) {
         if (ch == '0' || ch == '1')
             *p++ = ch;
         else if (ch != '_')
@@ -534,8 +718,8 @@ static int LiteralChar(ParseContext *c)
 int SkipSpaces(ParseContext *c)
 {
     int ch;
-    while ((ch = GetChar(c)) != EOF)
-        if (!isspace(ch))
+    while ((ch = GetC(c)) != EOF)
+        if (!(CharClass(ch) & CT_SPACE))
             break;
     return ch;
 }
@@ -600,21 +784,6 @@ int GetChar(ParseContext *c)
     return ch;
 }
 
-/* XGetC - get the next character without checking for comments */
-static int XGetC(ParseContext *c)
-{
-    int ch;
-    
-    /* get the next character on the current line */
-    if (!(ch = *c->linePtr++)) {
-        --c->linePtr;
-        return EOF;
-    }
-    
-    /* return the character */
-    return ch;
-}
-
 /* UngetC - unget the most recent character */
 void UngetC(ParseContext *c)
 {
@@ -18,6 +18,8 @@ static void ParseArrayInitializers(ParseContext *c, VMVALUE size);
 static void ClearArrayInitializers(ParseContext *c, VMVALUE size);
 static void ParseImpliedLetOrFunctionCall(ParseContext *c);
 static void ParseLet(ParseContext *c);
+static int ParseAssignment(ParseContext *c, ParseTreeNode *lvalue, int tkn);
+static void ParseIncDec(ParseContext *c, int op);
 static void ParseIf(ParseContext *c);
 static void ParseElse(ParseContext *c);
 static void ParseElseIf(ParseContext *c);
@@ -32,6 +34,10 @@ static void ParseDoUntil(ParseContext *c);
 static void ParseLoop(ParseContext *c);
 static void ParseLoopWhile(ParseContext *c);
 static void ParseLoopUntil(ParseContext *c);
+static void ParseSelectCase(ParseContext *c);
+static void ParseCase(ParseContext *c);
+static void ParseCaseElse(ParseContext *c);
+static void ParseEndSelect(ParseContext *c);
 static void ParseStop(ParseContext *c);
 static void ParseGoto(ParseContext *c);
 static void ParseReturn(ParseContext *c);
@@ -42,8 +48,20 @@ static void ParseAsm(ParseContext *c);
 
 /* prototypes */
 static void CallHandler(ParseContext *c, int trap, ParseTreeNode *expr);
+static void CodeIfTest(ParseContext *c, ParseTreeNode *expr);
+static VMVALUE ParseIntegerConstant(ParseContext *c);
+static void EndCase(ParseContext *c);
+static void CodeSelectDispatch(ParseContext *c);
+static void CodeCaseTree(ParseContext *c, CaseRange **cases, int lo, int hi, int slot);
+static void CodeCaseTest(ParseContext *c, int slot, VMVALUE value, int op);
+static void CodeSelectBranch(ParseContext *c, int op, int target);
+static int CompareCases(const void *p1, const void *p2);
+static void StartDeadCode(ParseContext *c, DeadCode *dead, int end);
+static int EndDeadCode(ParseContext *c, DeadCode *dead);
 static void DefineLabel(ParseContext *c, char *name, int offset);
 static int ReferenceLabel(ParseContext *c, char *name, int offset);
+static int AllocLocals(ParseContext *c, int count);
+static void FreeLocals(ParseContext *c, int slot, int count);
 static void PushBlock(ParseContext *c);
 static void PopBlock(ParseContext *c);
 
@@ -106,6 +124,18 @@ void ParseStatement(ParseContext *c, int tkn)
     case T_LOOP_UNTIL:
         ParseLoopUntil(c);
         break;
+    case T_SELECT_CASE:
+        ParseSelectCase(c);
+        break;
+    case T_CASE:
+        ParseCase(c);
+        break;
+    case T_CASE_ELSE:
+        ParseCaseElse(c);
+        break;
+    case T_END_SELECT:
+        ParseEndSelect(c);
+        break;
     case T_STOP:
         ParseStop(c);
         break;
@@ -118,6 +148,12 @@ void ParseStatement(ParseContext *c, int tkn)
     case T_PRINT:
         ParsePrint(c);
         break;
+    case T_INC:
+        ParseIncDec(c, OP_ADD);
+        break;
+    case T_DEC:
+        ParseIncDec(c, OP_SUB);
+        break;
 #ifdef USE_ASM
     case T_ASM:
         ParseAsm(c);
@@ -129,6 +165,7 @@ void ParseStatement(ParseContext *c, int tkn)
             break;
         }
         UngetC(c);
+        /* fall through */
     default:
         SaveToken(c, tkn);
         ParseImpliedLetOrFunctionCall(c);
@@ -152,13 +189,24 @@ static void ParseDef(ParseContext *c)
 
     /* otherwise, assume a function definition */
     else {
-        VMVALUE *value = (VMVALUE *)ImageTextAlloc(c, sizeof(VMVALUE));
+        Function *function = NULL;
+        Symbol *symbol;
 
         /* save the lookahead token */
         SaveToken(c, tkn);
 
-        /* enter the function name in the global symbol table */
-        c->codeSymbol = AddGlobal(c, name, SC_VARIABLE, (VMVALUE)((uint8_t *)value - (uint8_t *)c->image));
+        /* use the code vector of a function that was called before it was defined */
+        if ((symbol = FindSymbol(&c->globals, name)) != NULL) {
+            if (!(function = FindFunction(c, symbol)) || function->code)
+                ParseError(c, "'%s' is already defined", name);
+            c->codeSymbol = symbol;
+        }
+
+        /* otherwise, enter the function name in the global symbol table */
+        else {
+            VMVALUE *value = (VMVALUE *)ImageTextAlloc(c, sizeof(VMVALUE));
+            c->codeSymbol = AddGlobal(c, name, SC_VARIABLE, (VMVALUE)((uint8_t *)value - (uint8_t *)c->image));
+        }
 
         /* start the code under construction */
         StartCode(c, CODE_TYPE_FUNCTION);
@@ -178,6 +226,10 @@ static void ParseDef(ParseContext *c)
         }
         else
             SaveToken(c, tkn);
+
+        /* make sure the earlier calls passed the right number of arguments */
+        if (function && function->argc >= 0 && function->argc != c->arguments.count)
+            ParseError(c, "wrong number of arguments in an earlier call");
     }
 
     FRequire(c, T_EOL);
@@ -186,11 +238,9 @@ static void ParseDef(ParseContext *c)
 /* ParseEndDef - parse the 'END DEF' statement */
 static void ParseEndDef(ParseContext *c)
 {
-    VMVALUE *pValue;
     if (c->codeType != CODE_TYPE_FUNCTION)
         ParseError(c, "not in a function definition");
-    pValue = (VMVALUE *)((uint8_t *)c->image + c->codeSymbol->value);
-    *pValue = StoreCode(c);
+    StoreCode(c);
     c->codeSymbol = NULL;
 }
 
@@ -229,25 +279,20 @@ static void ParseDim(ParseContext *c)
         /* add to the global symbol table if outside a function definition */
         if (c->codeType == CODE_TYPE_MAIN) {
 
-            /* check for initializers */
+            /* check for initializers (the elements without one are zero) */
+            ClearArrayInitializers(c, size);
             if ((tkn = GetToken(c)) == '=') {
                 if (isArray)
                     ParseArrayInitializers(c, size);
-                else {
-                    VMVALUE *dataPtr = (VMVALUE *)c->codeBuf;
-                    if (dataPtr >= (VMVALUE *)c->dataFree)
-                        ParseError(c, "insufficient image data space");
-                    *dataPtr = ParseScalarInitializer(c);
-                }
+                else
+                    *(VMVALUE *)c->dataFree = ParseScalarInitializer(c);
             }
 
             /* no initializers */
-            else {
-                ClearArrayInitializers(c, isArray ? size : 1);
+            else
                 SaveToken(c, tkn);
-            }
 
-            /* allocate space for the data */
+            /* allocate space for the data (zeros left at the end of the data become the BSS) */
             value = (VMVALUE)(DATA_OFFSET + ((uint8_t *)ImageDataAlloc(c, size * sizeof(VMVALUE)) - c->dataBase));
             
             /* add the symbol to the global symbol table */
@@ -258,8 +303,7 @@ static void ParseDim(ParseContext *c)
         else {
             if (isArray)
                 ParseError(c, "local arrays are not supported");
-            AddLocal(c, name, SC_VARIABLE, c->localOffset);
-            ++c->localOffset;
+            AddLocal(c, name, SC_VARIABLE, AllocLocals(c, 1));
         }
 
     } while ((tkn = GetToken(c)) == ',');
@@ -403,19 +447,11 @@ static void ParseImpliedLetOrFunctionCall(ParseContext *c)
 {
     ParseTreeNode *expr;
     int tkn;
-    PVAL pv;
-    expr = ParsePrimary(c);
-    switch (tkn = GetToken(c)) {
-    case '=':
-        ParseRValue(c);
-        code_lvalue(c, expr, &pv);
-        (*pv.fcn)(c, PV_STORE, &pv);
-        break;
-    default:
+    expr = SimplifyExpr(c, ParsePrimary(c));
+    if (!ParseAssignment(c, expr, tkn = GetToken(c))) {
         SaveToken(c, tkn);
         code_rvalue(c, expr);
         putcbyte(c, OP_DROP);
-        break;
     }
     FRequire(c, T_EOL);
 }
@@ -424,29 +460,76 @@ static void ParseImpliedLetOrFunctionCall(ParseContext *c)
 static void ParseLet(ParseContext *c)
 {
     ParseTreeNode *lvalue;
-    PVAL pv;
-    lvalue = ParsePrimary(c);
-    FRequire(c, '=');
-    ParseRValue(c);
-    code_lvalue(c, lvalue, &pv);
-    (*pv.fcn)(c, PV_STORE, &pv);
+    int tkn;
+    lvalue = SimplifyExpr(c, ParsePrimary(c));
+    if (!ParseAssignment(c, lvalue, tkn = GetToken(c)))
+        Require(c, tkn, '=');
+    FRequire(c, T_EOL);
+}
+
+/* ParseAssignment - parse the rest of an assignment or return VMFALSE if the token isn't an assignment operator */
+static int ParseAssignment(ParseContext *c, ParseTreeNode *lvalue, int tkn)
+{
+    int op;
+    switch (tkn) {
+    case '=':
+        code_assign(c, lvalue, ParseExpr(c));
+        return VMTRUE;
+    case T_ADD_ASSIGN:
+        op = OP_ADD;
+        break;
+    case T_SUB_ASSIGN:
+        op = OP_SUB;
+        break;
+    case T_MUL_ASSIGN:
+        op = OP_MUL;
+        break;
+    case T_AND_ASSIGN:
+        op = OP_BAND;
+        break;
+    case T_OR_ASSIGN:
+        op = OP_BOR;
+        break;
+    case T_SHL_ASSIGN:
+        op = OP_SHL;
+        break;
+    case T_SHR_ASSIGN:
+        op = OP_SHR;
+        break;
+    default:
+        return VMFALSE;
+    }
+    code_update(c, lvalue, op, ParseExpr(c));
+    return VMTRUE;
+}
+
+/* ParseIncDec - parse the 'INC' and 'DEC' statements */
+static void ParseIncDec(ParseContext *c, int op)
+{
+    ParseTreeNode *lvalue;
+    lvalue = SimplifyExpr(c, ParsePrimary(c));
+    code_update(c, lvalue, op, MakeIntegerLitNode(c, 1));
     FRequire(c, T_EOL);
 }
 
 /* ParseIf - parse the 'IF' statement */
 static void ParseIf(ParseContext *c)
 {
+    ParseTreeNode *expr;
     int tkn;
-    ParseRValue(c);
+    expr = ParseExpr(c);
     FRequire(c, T_THEN);
     PushBlock(c);
     c->bptr->type = BLOCK_IF;
-    putcbyte(c, OP_BRF);
-    c->bptr->u.IfBlock.nxt = putcword(c, 0);
+    c->bptr->u.IfBlock.nxt = 0;
     c->bptr->u.IfBlock.end = 0;
+    c->bptr->u.IfBlock.taken = VMFALSE;
+    c->bptr->u.IfBlock.dead.start = -1;
+    CodeIfTest(c, expr);
     if ((tkn = GetToken(c)) != T_EOL) {
         ParseStatement(c, tkn);
         fixupbranch(c, c->bptr->u.IfBlock.nxt, codeaddr(c));
+        EndDeadCode(c, &c->bptr->u.IfBlock.dead);
         PopBlock(c);
     }
     else
@@ -456,16 +539,20 @@ static void ParseIf(ParseContext *c)
 /* ParseElseIf - parse the 'ELSE IF' statement */
 static void ParseElseIf(ParseContext *c)
 {
+    ParseTreeNode *expr;
     switch (CurrentBlockType(c)) {
     case BLOCK_IF:
+        if (c->bptr->u.IfBlock.taken && c->bptr->u.IfBlock.dead.start < 0)
+            StartDeadCode(c, &c->bptr->u.IfBlock.dead, c->bptr->u.IfBlock.end);
         putcbyte(c, OP_BR);
         c->bptr->u.IfBlock.end = putcword(c, c->bptr->u.IfBlock.end);
         fixupbranch(c, c->bptr->u.IfBlock.nxt, codeaddr(c));
         c->bptr->u.IfBlock.nxt = 0;
-        ParseRValue(c);
+        if (!c->bptr->u.IfBlock.taken && EndDeadCode(c, &c->bptr->u.IfBlock.dead))
+            c->bptr->u.IfBlock.end = c->bptr->u.IfBlock.dead.end;
+        expr = ParseExpr(c);
         FRequire(c, T_THEN);
-        putcbyte(c, OP_BRF);
-        c->bptr->u.IfBlock.nxt = putcword(c, 0);
+        CodeIfTest(c, expr);
         FRequire(c, T_EOL);
         break;
     default:
@@ -477,14 +564,23 @@ static void ParseElseIf(ParseContext *c)
 /* ParseElse - parse the 'ELSE' statement */
 static void ParseElse(ParseContext *c)
 {
-    int end;
+    DeadCode dead;
+    int end, taken;
     switch (CurrentBlockType(c)) {
     case BLOCK_IF:
+        if (c->bptr->u.IfBlock.taken && c->bptr->u.IfBlock.dead.start < 0)
+            StartDeadCode(c, &c->bptr->u.IfBlock.dead, c->bptr->u.IfBlock.end);
         putcbyte(c, OP_BR);
         end = putcword(c, c->bptr->u.IfBlock.end);
         fixupbranch(c, c->bptr->u.IfBlock.nxt, codeaddr(c));
+        taken = c->bptr->u.IfBlock.taken;
+        dead = c->bptr->u.IfBlock.dead;
+        if (!taken && EndDeadCode(c, &dead))
+            end = dead.end;
         c->bptr->type = BLOCK_ELSE;
         c->bptr->u.ElseBlock.end = end;
+        c->bptr->u.ElseBlock.taken = taken;
+        c->bptr->u.ElseBlock.dead = dead;
         break;
     default:
         ParseError(c, "ELSE without a matching IF");
@@ -498,11 +594,17 @@ static void ParseEndIf(ParseContext *c)
 {
     switch (CurrentBlockType(c)) {
     case BLOCK_IF:
+        if (EndDeadCode(c, &c->bptr->u.IfBlock.dead)) {
+            c->bptr->u.IfBlock.nxt = 0;
+            c->bptr->u.IfBlock.end = c->bptr->u.IfBlock.dead.end;
+        }
         fixupbranch(c, c->bptr->u.IfBlock.nxt, codeaddr(c));
         fixupbranch(c, c->bptr->u.IfBlock.end, codeaddr(c));
         PopBlock(c);
         break;
     case BLOCK_ELSE:
+        if (EndDeadCode(c, &c->bptr->u.ElseBlock.dead))
+            c->bptr->u.ElseBlock.end = c->bptr->u.ElseBlock.dead.end;
         fixupbranch(c, c->bptr->u.ElseBlock.end, codeaddr(c));
         PopBlock(c);
         break;
@@ -524,9 +626,8 @@ static void ParseEnd(ParseContext *c)
 /* ParseFor - parse the 'FOR' statement */
 static void ParseFor(ParseContext *c)
 {
-    ParseTreeNode *var, *step;
-    int test, body, inst;
-    int dir, tkn;
+    ParseTreeNode *var, *start, *step;
+    int dir, slot, tkn;
     PVAL pv;
 
     PushBlock(c);
@@ -538,14 +639,11 @@ static void ParseFor(ParseContext *c)
     code_lvalue(c, var, &pv);
     FRequire(c, '=');
 
-    /* parse the starting value expression */
-    ParseRValue(c);
+    /* parse the starting value expression (a constant is combined with the step below) */
+    start = ParseExpr(c);
+    if (!IsIntegerLit(start))
+        code_rvalue(c, start);
 
-    /* parse the TO expression and generate the loop termination test */
-    test = codeaddr(c);
-    (*pv.fcn)(c, PV_STORE, &pv);
-    (*pv.fcn)(c, PV_LOAD, &pv);
-    
     /* check for 'to' or 'downto' */
     if ((tkn = GetToken(c)) == T_TO)
         dir = 1;
@@ -554,55 +652,79 @@ static void ParseFor(ParseContext *c)
         dir = -1;
     }
 
-    /* parse the end value expression */
+    /* the limit and the step are evaluated once and kept in hidden locals */
+    slot = AllocLocals(c, 2);
     ParseRValue(c);
-    putcbyte(c, dir == 1 ? OP_LE : OP_GE);
-    putcbyte(c, OP_BRT);
-    body = putcword(c, 0);
-
-    /* branch to the end if the termination test fails */
-    putcbyte(c, OP_BR);
-    c->bptr->u.ForBlock.end = putcword(c, 0);
+    putcbyte(c, OP_LSET);
+    putcbyte(c, LOCALOFFSET(slot));
 
-    /* update the for variable after an iteration of the loop */
-    c->bptr->u.ForBlock.nxt = codeaddr(c);
-    (*pv.fcn)(c, PV_LOAD, &pv);
-
-    /* get the STEP expression */
+    /* get the STEP expression (a signed increment as in TO loops) */
     if ((tkn = GetToken(c)) == T_STEP) {
         step = ParseExpr(c);
         code_rvalue(c, step);
         tkn = GetToken(c);
     }
 
-    /* no step so default to one */
+    /* no step so count by one in the direction of TO or DOWNTO */
     else {
+        step = NULL;
         putcbyte(c, OP_SLIT);
-        putcbyte(c, 1);
+        putcbyte(c, dir);
+    }
+    putcbyte(c, OP_LSET);
+    putcbyte(c, LOCALOFFSET(slot + 1));
+
+    /* enter the loop at the FORNEXT with the starting value less the step since it adds the step first */
+    if (IsIntegerLit(start) && (!step || IsIntegerLit(step))) {
+        VMUVALUE value = (VMUVALUE)start->u.integerLit.value;
+        start->u.integerLit.value = (VMVALUE)(value - (VMUVALUE)(step ? step->u.integerLit.value : dir));
+        code_rvalue(c, start);
     }
+    else {
+        if (IsIntegerLit(start))
+            code_rvalue(c, start);
+        putcbyte(c, OP_LREF);
+        putcbyte(c, LOCALOFFSET(slot + 1));
+        putcbyte(c, OP_SUB);
+    }
+    putcbyte(c, OP_BR);
+    c->bptr->u.ForBlock.nxt = putcword(c, 0);
 
-    /* generate the increment code */
-    putcbyte(c, OP_ADD);
-    inst = putcbyte(c, OP_BR);
-    putcword(c, test - inst - 1 - sizeof(VMWORD));
+    /* each iteration starts by storing the new value of the control variable */
+    c->bptr->u.ForBlock.top = codeaddr(c);
+    c->bptr->u.ForBlock.slot = slot;
+    c->bptr->u.ForBlock.var = var;
+    (*pv.fcn)(c, PV_STORE, &pv);
 
-    /* branch to the loop body */
-    fixupbranch(c, body, codeaddr(c));
     Require(c, tkn, T_EOL);
 }
 
 /* ParseNext - parse the 'NEXT' statement */
 static void ParseNext(ParseContext *c)
 {
+    ParseTreeNode *var;
     int inst;
+    PVAL pv;
     switch (CurrentBlockType(c)) {
     case BLOCK_FOR:
         FRequire(c, T_IDENTIFIER);
-        GetSymbolRef(c, c->token);
-        /* BUG: check to make sure it matches the symbol used in the FOR */
-        inst = putcbyte(c, OP_BR);
-        putcword(c, c->bptr->u.ForBlock.nxt - inst - 1 - sizeof(VMWORD));
-        fixupbranch(c, c->bptr->u.ForBlock.end, codeaddr(c));
+        var = GetSymbolRef(c, c->token);
+        if (var->nodeType != NodeTypeSymbolRef
+        ||  var->u.symbolRef.symbol != c->bptr->u.ForBlock.var->u.symbolRef.symbol)
+            ParseError(c, "NEXT variable does not match the FOR variable");
+
+        /* step the control variable and branch back to the top while it is within the limit */
+        code_rvalue(c, var);
+        fixupbranch(c, c->bptr->u.ForBlock.nxt, codeaddr(c));
+        inst = putcbyte(c, OP_FORNEXT);
+        putcbyte(c, LOCALOFFSET(c->bptr->u.ForBlock.slot));
+        putcword(c, c->bptr->u.ForBlock.top - inst - 2 - sizeof(VMWORD));
+
+        /* the control variable is left one step past the limit */
+        code_lvalue(c, var, &pv);
+        (*pv.fcn)(c, PV_STORE, &pv);
+
+        FreeLocals(c, c->bptr->u.ForBlock.slot, 2);
         PopBlock(c);
         break;
     default:
@@ -702,6 +824,90 @@ static void ParseLoopUntil(ParseContext *c)
     FRequire(c, T_EOL);
 }
 
+/* ParseSelectCase - parse the 'SELECT CASE' statement */
+static void ParseSelectCase(ParseContext *c)
+{
+    /* the selector is left on the stack for the dispatch code that follows the cases */
+    ParseRValue(c);
+    PushBlock(c);
+    c->bptr->type = BLOCK_SELECT;
+    putcbyte(c, OP_BR);
+    c->bptr->u.SelectBlock.dispatch = putcword(c, 0);
+    c->bptr->u.SelectBlock.end = 0;
+    c->bptr->u.SelectBlock.other = -1;
+    c->bptr->u.SelectBlock.open = VMFALSE;
+    c->bptr->u.SelectBlock.cases = NULL;
+    c->bptr->u.SelectBlock.count = 0;
+    FRequire(c, T_EOL);
+}
+
+/* ParseCase - parse the 'CASE' statement */
+static void ParseCase(ParseContext *c)
+{
+    CaseRange *range, *prev;
+    int tkn;
+
+    /* make sure the CASE is in a SELECT before any CASE ELSE */
+    if (CurrentBlockType(c) != BLOCK_SELECT)
+        ParseError(c, "CASE without a matching SELECT CASE");
+    if (c->bptr->u.SelectBlock.other >= 0)
+        ParseError(c, "CASE after CASE ELSE");
+    EndCase(c);
+
+    /* parse the list of values and ranges of values */
+    do {
+        range = (CaseRange *)LocalAllocBasic(c, sizeof(CaseRange));
+        range->lo = range->hi = ParseIntegerConstant(c);
+        if ((tkn = GetToken(c)) == T_TO) {
+            range->hi = ParseIntegerConstant(c);
+            if (range->hi < range->lo)
+                ParseError(c, "empty CASE range");
+            tkn = GetToken(c);
+        }
+        for (prev = c->bptr->u.SelectBlock.cases; prev != NULL; prev = prev->next)
+            if (range->lo <= prev->hi && prev->lo <= range->hi)
+                ParseError(c, "duplicate CASE value");
+        range->addr = codeaddr(c);
+        range->next = c->bptr->u.SelectBlock.cases;
+        c->bptr->u.SelectBlock.cases = range;
+        ++c->bptr->u.SelectBlock.count;
+    } while (tkn == ',');
+    Require(c, tkn, T_EOL);
+
+    c->bptr->u.SelectBlock.open = VMTRUE;
+}
+
+/* ParseCaseElse - parse the 'CASE ELSE' statement */
+static void ParseCaseElse(ParseContext *c)
+{
+    if (CurrentBlockType(c) != BLOCK_SELECT)
+        ParseError(c, "CASE ELSE without a matching SELECT CASE");
+    if (c->bptr->u.SelectBlock.other >= 0)
+        ParseError(c, "more than one CASE ELSE");
+    EndCase(c);
+    c->bptr->u.SelectBlock.other = codeaddr(c);
+    c->bptr->u.SelectBlock.open = VMTRUE;
+    FRequire(c, T_EOL);
+}
+
+/* ParseEndSelect - parse the 'END SELECT' statement */
+static void ParseEndSelect(ParseContext *c)
+{
+    switch (CurrentBlockType(c)) {
+    case BLOCK_SELECT:
+        EndCase(c);
+        fixupbranch(c, c->bptr->u.SelectBlock.dispatch, codeaddr(c));
+        CodeSelectDispatch(c);
+        fixupbranch(c, c->bptr->u.SelectBlock.end, codeaddr(c));
+        PopBlock(c);
+        break;
+    default:
+        ParseError(c, "END SELECT without a matching SELECT CASE");
+        break;
+    }
+    FRequire(c, T_EOL);
+}
+
 /* ParseStop - parse the 'STOP' statement */
 static void ParseStop(ParseContext *c)
 {
@@ -721,6 +927,7 @@ static void ParseGoto(ParseContext *c)
 /* ParseReturn - parse the 'RETURN' statement */
 static void ParseReturn(ParseContext *c)
 {
+    ParseTreeNode *expr;
     int tkn;
     if ((tkn = GetToken(c)) == T_EOL) {
         putcbyte(c, OP_SLIT);
@@ -728,10 +935,16 @@ static void ParseReturn(ParseContext *c)
     }
     else {
         SaveToken(c, tkn);
-        ParseRValue(c);
+        expr = ParseExpr(c);
         FRequire(c, T_EOL);
+
+        /* a function call in tail position reuses the frame of the current function */
+        if (c->codeType != CODE_TYPE_MAIN && code_tailcall(c, expr))
+            return;
+        code_rvalue(c, expr);
     }
     putcbyte(c, OP_RETURN);
+    putcbyte(c, c->arguments.count);
 }
 
 /* ParsePrint - handle the 'PRINT' statement */
@@ -777,7 +990,6 @@ static void ParsePrint(ParseContext *c)
 #include "db_vmdebug.h"
 
 static void Assemble(ParseContext *c, char *name);
-static VMVALUE ParseIntegerConstant(ParseContext *c);
 
 /* ParseAsm - parse the 'ASM ... END ASM' statement */
 static void ParseAsm(ParseContext *c)
@@ -830,6 +1042,12 @@ static void Assemble(ParseContext *c, char *name)
             case FMT_SBYTE:
                 putcbyte(c, ParseIntegerConstant(c));
                 break;
+            case FMT_SBYTE2:
+            case FMT_BYTE_SBYTE:
+                putcbyte(c, ParseIntegerConstant(c));
+                FRequire(c, ',');
+                putcbyte(c, ParseIntegerConstant(c));
+                break;
             case FMT_LONG:
                 putcword(c, ParseIntegerConstant(c));
                 break;
@@ -844,16 +1062,6 @@ static void Assemble(ParseContext *c, char *name)
     ParseError(c, "undefined opcode");
 }
 
-/* ParseIntegerConstant - parse an integer constant expression */
-static VMVALUE ParseIntegerConstant(ParseContext *c)
-{
-    ParseTreeNode *expr;
-    expr = ParseExpr(c);
-    if (!IsIntegerLit(expr))
-        ParseError(c, "expecting an integer constant expression");
-    return expr->u.integerLit.value;
-}
-
 #endif
 
 /* CallHandler - compile a call to a runtime print function */
@@ -868,11 +1076,195 @@ static void CallHandler(ParseContext *c, int trap, ParseTreeNode *expr)
     putcbyte(c, trap);
 }
 
+/* CodeIfTest - generate the test at the start of an IF or ELSE IF clause */
+static void CodeIfTest(ParseContext *c, ParseTreeNode *expr)
+{
+    Block *block = c->bptr;
+
+    /* a constant test either always or never executes the clause */
+    if (c->optimize && IsIntegerLit(expr) && !block->u.IfBlock.taken) {
+        if (expr->u.integerLit.value)
+            block->u.IfBlock.taken = VMTRUE;
+        else {
+            StartDeadCode(c, &block->u.IfBlock.dead, block->u.IfBlock.end);
+            putcbyte(c, OP_BR);
+            block->u.IfBlock.nxt = putcword(c, 0);
+        }
+    }
+
+    /* otherwise, branch to the next clause if the test fails */
+    else {
+        code_rvalue(c, expr);
+        putcbyte(c, OP_BRF);
+        block->u.IfBlock.nxt = putcword(c, 0);
+    }
+}
+
+/* ParseIntegerConstant - parse an integer constant expression */
+static VMVALUE ParseIntegerConstant(ParseContext *c)
+{
+    ParseTreeNode *expr;
+    expr = ParseExpr(c);
+    if (!IsIntegerLit(expr))
+        ParseError(c, "expecting an integer constant expression");
+    return expr->u.integerLit.value;
+}
+
+/* EndCase - end the code for the current CASE by branching past the end of the SELECT */
+static void EndCase(ParseContext *c)
+{
+    if (c->bptr->u.SelectBlock.open) {
+        CodeSelectBranch(c, OP_BR, -1);
+        c->bptr->u.SelectBlock.open = VMFALSE;
+    }
+}
+
+/* CodeSelectDispatch - code the selection of a CASE using the selector on the stack */
+static void CodeSelectDispatch(ParseContext *c)
+{
+    int count = c->bptr->u.SelectBlock.count;
+    int other = c->bptr->u.SelectBlock.other;
+    CaseRange **cases, *range;
+    VMVALUE value;
+    int slot, i;
+
+    /* only CASE ELSE (if anything) is left when there are no values */
+    if (count == 0) {
+        putcbyte(c, OP_DROP);
+        CodeSelectBranch(c, OP_BR, other);
+        return;
+    }
+
+    /* sort the ranges by value */
+    cases = (CaseRange **)LocalAllocBasic(c, count * sizeof(CaseRange *));
+    for (range = c->bptr->u.SelectBlock.cases, i = 0; range != NULL; range = range->next)
+        cases[i++] = range;
+    qsort(cases, count, sizeof(CaseRange *), CompareCases);
+
+    /* dense values index a table of branches with one entry for each value between the lowest and the highest */
+    if (count >= 4
+    &&  (VMUVALUE)(cases[count - 1]->hi - cases[0]->lo) < MAXJUMPTABLE
+    &&  (VMUVALUE)(cases[count - 1]->hi - cases[0]->lo) < 4 * count) {
+        if (cases[0]->lo != 0) {
+            code_lit(c, cases[0]->lo);
+            putcbyte(c, OP_SUB);
+        }
+        putcbyte(c, OP_JUMPTABLE);
+        putcbyte(c, cases[count - 1]->hi - cases[0]->lo + 1);
+        for (value = cases[0]->lo, i = 0; ; ++value) {
+            CodeSelectBranch(c, OP_BR, value >= cases[i]->lo ? cases[i]->addr : other);
+            if (value == cases[i]->hi && ++i >= count)
+                break;
+        }
+        CodeSelectBranch(c, OP_BR, other);
+    }
+
+    /* sparse values are found by a binary search on the selector in a hidden local */
+    else {
+        slot = AllocLocals(c, 1);
+        putcbyte(c, OP_LSET);
+        putcbyte(c, LOCALOFFSET(slot));
+        CodeCaseTree(c, cases, 0, count - 1, slot);
+        FreeLocals(c, slot, 1);
+    }
+}
+
+/* CodeCaseTree - code a binary search for the selector in a sorted array of ranges */
+static void CodeCaseTree(ParseContext *c, CaseRange **cases, int lo, int hi, int slot)
+{
+    int other = c->bptr->u.SelectBlock.other;
+    int mid = (lo + hi) / 2, lower = 0;
+
+    /* a single value only needs one comparison */
+    if (lo == hi && cases[mid]->lo == cases[mid]->hi) {
+        CodeCaseTest(c, slot, cases[mid]->lo, OP_EQ);
+        CodeSelectBranch(c, OP_BRT, cases[mid]->addr);
+        CodeSelectBranch(c, OP_BR, other);
+        return;
+    }
+
+    /* values below the middle range are in the lower half */
+    CodeCaseTest(c, slot, cases[mid]->lo, OP_LT);
+    if (lo < mid) {
+        putcbyte(c, OP_BRT);
+        lower = putcword(c, 0);
+    }
+    else
+        CodeSelectBranch(c, OP_BRT, other);
+
+    /* values that aren't above the middle range are in it */
+    CodeCaseTest(c, slot, cases[mid]->hi, OP_LE);
+    CodeSelectBranch(c, OP_BRT, cases[mid]->addr);
+
+    /* everything else is in the upper half */
+    if (mid < hi)
+        CodeCaseTree(c, cases, mid + 1, hi, slot);
+    else
+        CodeSelectBranch(c, OP_BR, other);
+
+    /* code the lower half */
+    if (lo < mid) {
+        fixupbranch(c, lower, codeaddr(c));
+        CodeCaseTree(c, cases, lo, mid - 1, slot);
+    }
+}
+
+/* CodeCaseTest - code a comparison of the selector with a value */
+static void CodeCaseTest(ParseContext *c, int slot, VMVALUE value, int op)
+{
+    putcbyte(c, OP_LREF);
+    putcbyte(c, LOCALOFFSET(slot));
+    code_lit(c, value);
+    putcbyte(c, op);
+}
+
+/* CodeSelectBranch - code a branch to the code for a CASE or to the end of the SELECT if the target is negative */
+static void CodeSelectBranch(ParseContext *c, int op, int target)
+{
+    int inst = putcbyte(c, op);
+    if (target < 0)
+        c->bptr->u.SelectBlock.end = putcword(c, c->bptr->u.SelectBlock.end);
+    else
+        putcword(c, target - inst - 1 - sizeof(VMWORD));
+}
+
+/* CompareCases - compare two ranges of CASE values for sorting */
+static int CompareCases(const void *p1, const void *p2)
+{
+    VMVALUE lo1 = (*(CaseRange **)p1)->lo, lo2 = (*(CaseRange **)p2)->lo;
+    return lo1 < lo2 ? -1 : lo1 > lo2 ? 1 : 0;
+}
+
+/* StartDeadCode - start code that can never be executed */
+static void StartDeadCode(ParseContext *c, DeadCode *dead, int end)
+{
+    dead->start = codeaddr(c);
+    dead->end = end;
+    dead->labelRefs = c->labelRefs;
+}
+
+/* EndDeadCode - discard dead code unless a label was defined or referenced inside it */
+static int EndDeadCode(ParseContext *c, DeadCode *dead)
+{
+    int discarded = VMFALSE;
+    if (dead->start >= 0) {
+        if (dead->labelRefs == c->labelRefs) {
+            c->codeFree = c->codeBuf + dead->start;
+            discarded = VMTRUE;
+        }
+        dead->start = -1;
+    }
+    return discarded;
+}
+
 /* DefineLabel - define a local label */
 static void DefineLabel(ParseContext *c, char *name, int offset)
 {
     Label *label;
 
+    /* count the definition */
+    ++c->labelRefs;
+
     /* check to see if the label is already in the table */
     for (label = c->labels; label != NULL; label = label->next)
         if (strcasecmp(name, label->name) == 0) {
@@ -900,6 +1292,9 @@ static int ReferenceLabel(ParseContext *c, char *name, int offset)
 {
     Label *label;
 
+    /* count the reference */
+    ++c->labelRefs;
+
     /* check to see if the label is already in the table */
     for (label = c->labels; label != NULL; label = label->next)
         if (strcasecmp(name, label->name) == 0) {
@@ -942,6 +1337,25 @@ BlockType  CurrentBlockType(ParseContext *c)
     return c->bptr < c->blockBuf ? BLOCK_NONE : c->bptr->type;
 }
 
+/* AllocLocals - allocate local variable slots in the frame and return the first one */
+static int AllocLocals(ParseContext *c, int count)
+{
+    int slot = c->localOffset;
+    if (slot + count > MAXLOCALS)
+        ParseError(c, "too many local variables");
+    c->localOffset += count;
+    if (c->localOffset > c->localMax)
+        c->localMax = c->localOffset;
+    return slot;
+}
+
+/* FreeLocals - free hidden local variable slots if nothing was allocated after them */
+static void FreeLocals(ParseContext *c, int slot, int count)
+{
+    if (c->localOffset == slot + count)
+        c->localOffset = slot;
+}
+
 /* PushBlock - push a block on the block stack */
 static void PushBlock(ParseContext *c)
 {
@@ -0,0 +1,12 @@
+REM optimizing must not turn a division by an expression that is zero
+REM into a compile error (the VM divides by zero as zero)
+REM every line prints 0 at any optimization level
+
+dim g
+g = 5
+
+print 7 / (g - g)
+print g mod (g * 0)
+print 7 / (g and 0)
+print 3 mod ((g - g) or (g - g))
+print -7 / (0 * g)
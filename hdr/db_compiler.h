@@ -20,6 +20,7 @@ extern "C"
 
 #ifdef WIN32
 #define strcasecmp  _stricmp
+#define strncasecmp _strnicmp
 #endif
 
 /* program limits */
@@ -32,6 +33,12 @@ typedef struct ExprListEntry ExprListEntry;
 /* program limits */
 #define MAXLINE         128
 #define MAXCODE         32768
+#define MAXLOCALS       (128 - F_SIZE)  /* frame offsets must fit in a signed byte */
+#define MAXJUMPTABLE    255             /* jump table sizes must fit in a byte */
+#define MAXPOOL         256             /* constant pool indices must fit in a byte */
+
+/* frame pointer relative offset of local variable slot n */
+#define LOCALOFFSET(n)  (-F_SIZE - (n) - 1)
 
 /* line input handler */
 typedef int GetLineHandler(void *cookie, char *buf, int len);
@@ -65,6 +72,10 @@ enum {
     T_STOP,
     T_RETURN,
     T_PRINT,
+    T_SELECT,
+    T_CASE,
+    T_INC,
+    T_DEC,
 #ifdef USE_ASM
     T_ASM,
 #endif
@@ -78,11 +89,21 @@ enum {
     T_DO_UNTIL,
     T_LOOP_WHILE,
     T_LOOP_UNTIL,
+    T_SELECT_CASE,
+    T_CASE_ELSE,
+    T_END_SELECT,
     T_LE,       /* non-keyword tokens */
     T_NE,
     T_GE,
     T_SHL,
     T_SHR,
+    T_ADD_ASSIGN,
+    T_SUB_ASSIGN,
+    T_MUL_ASSIGN,
+    T_AND_ASSIGN,
+    T_OR_ASSIGN,
+    T_SHL_ASSIGN,
+    T_SHR_ASSIGN,
     T_IDENTIFIER,
     T_NUMBER,
     T_STRING,
@@ -96,9 +117,26 @@ typedef enum {
     BLOCK_IF,
     BLOCK_ELSE,
     BLOCK_FOR,
-    BLOCK_DO
+    BLOCK_DO,
+    BLOCK_SELECT
 } BlockType;
 
+/* range of values selecting a CASE */
+typedef struct CaseRange CaseRange;
+struct CaseRange {
+    CaseRange *next;
+    VMVALUE lo;     /* first value in the range */
+    VMVALUE hi;     /* last value in the range */
+    int addr;       /* offset of the code for the CASE */
+};
+
+/* code that can be discarded if nothing refers to it */
+typedef struct {
+    int start;      /* offset to the start of the dead code or -1 */
+    int end;        /* end of block fixup chain at the start of the dead code */
+    int labelRefs;  /* label reference count at the start of the dead code */
+} DeadCode;
+
 /* block structure */
 typedef struct Block Block;
 struct Block {
@@ -107,18 +145,32 @@ struct Block {
         struct {
             int nxt;
             int end;
+            int taken;
+            DeadCode dead;
         } IfBlock;
         struct {
             int end;
+            int taken;
+            DeadCode dead;
         } ElseBlock;
         struct {
             int nxt;
-            int end;
+            int top;
+            int slot;
+            ParseTreeNode *var;
         } ForBlock;
         struct {
             int nxt;
             int end;
         } DoBlock;
+        struct {
+            int dispatch;
+            int end;
+            int other;
+            int open;
+            CaseRange *cases;
+            int count;
+        } SelectBlock;
     } u;
 };
 
@@ -154,6 +206,50 @@ struct Symbol {
     char name[1];
 };
 
+/* branch or call counted by a previous run of the program */
+typedef struct {
+    VMUVALUE offset;    /* text offset of the instruction in the profiled image */
+    VMUVALUE counts[2]; /* times a branch was taken and not taken or a call was made */
+    VMVALUE function;   /* code vector of the function containing the instruction (zero for the main code) */
+    int site;           /* number of the instruction among those generated for the function (zero if unknown) */
+    int call;           /* true if the instruction is a call */
+} ProfileSite;
+
+/* profile guiding a compile (the sites are found by compiling the program the way it was profiled first) */
+typedef struct {
+    ProfileSite *sites; /* sites in the order of their text offsets */
+    int count;          /* number of sites */
+    int mapped;         /* true once the sites are known by function and site number */
+    VMUVALUE textSize;  /* size of the header and text of the profiled image */
+    uint32_t textHash;  /* hash of the header and text of the profiled image */
+    VMUVALUE maxCalls;  /* number of calls made from the busiest call site */
+} Profile;
+
+/* offset of a numbered branch or call in the code of a function */
+typedef struct {
+    int site;           /* site number */
+    int addr;           /* offset of the instruction */
+    int call;           /* true if the instruction is a call */
+} ProfileMark;
+
+/* function code waiting to be placed in the image */
+typedef struct Function Function;
+struct Function {
+    Function *next;
+    Symbol *symbol;     /* symbol whose value is the address of the code vector */
+    int argc;           /* number of arguments (-1 if only called so far) */
+    const uint8_t *code;    /* code or NULL if the function isn't defined yet */
+    int size;
+    const uint8_t *stackCode;   /* code without register instructions (NULL if it is too big to inline) */
+    int stackSize;
+    int used;
+    int inlined;        /* number of call sites where the code was inlined */
+    int need;           /* stack entries a call uses beyond its arguments (-1 if it isn't known) */
+    ProfileMark *marks; /* offsets of the profiled sites in the code */
+    int markCount;
+    VMUVALUE heat;      /* branches and calls counted in the code by the profile */
+};
+
 /* string structure */
 typedef struct String String;
 struct String {
@@ -185,16 +281,21 @@ typedef struct {
     VMVALUE value;              /* current token integer value */
     int inComment;              /* inside of a slash/star comment */
     Label *labels;              /* local labels */
+    int labelRefs;              /* number of label definitions and references */
     CodeType codeType;          /* type of code under construction */
     Symbol *codeSymbol;         /* symbol table entry of code under construction */
     SymbolTable arguments;      /* arguments of current function definition */
     SymbolTable locals;         /* local variables of current function definition */
     int localOffset;            /* offset to next available local variable */
+    int localMax;               /* number of local variable slots in the frame */
+    int slotLimit;              /* number of slots the optimizer passes may grow the frame to */
     Block blockBuf[10];         /* stack of nested blocks */
     Block *bptr;                /* current block */
     Block *btop;                /* top of block stack */
     SymbolTable globals;        /* global variables and constants */
     String *strings;            /* string constants */
+    Function *functions;        /* functions waiting to be placed */
+    Function **pNextFunction;   /* where to link the next function */
     uint8_t codeBuf[MAXCODE];   /* code staging buffer */
     uint8_t *codeFree;          /* next free location in code stating buffer */
     uint8_t *codeTop;           /* top of code staging buffer */
@@ -205,6 +306,15 @@ typedef struct {
     uint8_t *dataBase;          /* base of data buffer */
     uint8_t *dataFree;          /* next free data location */
     uint8_t *dataTop;           /* top of data buffer */
+    int optimize;               /* optimization level */
+    int inlineSize;             /* size of the largest function to inline */
+    int encoding;               /* instruction encoding to generate */
+    int bytesSaved;             /* bytes saved by the optimizer */
+    Profile *profile;           /* profile from a previous run or NULL */
+    ProfileMark *marks;         /* offsets of the profiled sites in the code under construction */
+    int markCount;              /* number of profiled sites in the code under construction */
+    VMVALUE pool[MAXPOOL];      /* constant pool loaded by OP_CLIT */
+    int poolCount;              /* number of constants in the pool */
 } ParseContext;
 
 /* partial value function codes */
@@ -252,6 +362,7 @@ struct ParseTreeNode {
         } stringLit;
         struct {
             VMVALUE value;
+            int derived;    /* value comes from an identity that is only applied when optimizing */
         } integerLit;
         struct {
             int op;
@@ -288,6 +399,10 @@ ParseContext *InitCompiler(uint8_t *freeSpace, size_t freeSize);
 int Compile(ParseContext *c, uint8_t *imageSpace, size_t imageSize, size_t textMax, size_t dataMax);
 void StartCode(ParseContext *c, CodeType type);
 VMVALUE StoreCode(ParseContext *c);
+Function *AddFunction(ParseContext *c, Symbol *symbol, int argc, const uint8_t *code, int size);
+void AddForwardFunction(ParseContext *c, char *name);
+Function *FindFunction(ParseContext *c, Symbol *symbol);
+int IsDirectCall(ParseContext *c, ParseTreeNode *expr);
 String *AddString(ParseContext *c, char *value);
 VMVALUE AddStringRef(String *str, int offset);
 void *LocalAllocBasic(ParseContext *c, size_t size);
@@ -307,7 +422,11 @@ void ParseRValue(ParseContext *c);
 ParseTreeNode *ParseExpr(ParseContext *c);
 ParseTreeNode *ParsePrimary(ParseContext *c);
 ParseTreeNode *GetSymbolRef(ParseContext *c, char *name);
+ParseTreeNode *SimplifyExpr(ParseContext *c, ParseTreeNode *expr);
+ParseTreeNode *MakeIntegerLitNode(ParseContext *c, VMVALUE value);
 int IsIntegerLit(ParseTreeNode *node);
+int IsPure(ParseTreeNode *expr);
+int SameExpr(ParseTreeNode *expr, ParseTreeNode *expr2);
 
 /* db_scan.c */
 int GetLine(ParseContext *c);
@@ -320,6 +439,9 @@ int SkipSpaces(ParseContext *c);
 int GetChar(ParseContext *c);
 void UngetC(ParseContext *c);
 void ParseError(ParseContext *c, char *fmt, ...);
+#ifdef COMPILER_DEBUG
+void CheckKeywords(ParseContext *c);
+#endif
 
 /* db_symbols.c */
 void InitSymbolTable(SymbolTable *table);
@@ -333,6 +455,10 @@ void DumpSymbols(SymbolTable *table, char *tag);
 /* db_generate.c */
 void code_lvalue(ParseContext *c, ParseTreeNode *expr, PVAL *pv);
 void code_rvalue(ParseContext *c, ParseTreeNode *expr);
+void code_assign(ParseContext *c, ParseTreeNode *lvalue, ParseTreeNode *expr);
+void code_update(ParseContext *c, ParseTreeNode *lvalue, int op, ParseTreeNode *expr);
+int code_tailcall(ParseContext *c, ParseTreeNode *expr);
+void code_lit(ParseContext *c, VMVALUE value);
 void rvalue(ParseContext *c, PVAL *pv);
 void chklvalue(ParseContext *c, PVAL *pv);
 void code_global(ParseContext *c, PValOp fcn, PVAL *pv);
@@ -340,8 +466,18 @@ void code_local(ParseContext *c, PValOp fcn, PVAL *pv);
 int codeaddr(ParseContext *c);
 int putcbyte(ParseContext *c, int v);
 int putcword(ParseContext *c, VMWORD v);
+int putclong(ParseContext *c, VMVALUE v);
 void fixupbranch(ParseContext *c, VMUVALUE chn, VMUVALUE val);
 
+/* db_optimize.c */
+int OptimizeCode(ParseContext *c, const uint8_t **pStackCode, int *pStackSize, int *pNeed);
+int RelaxBranches(ParseContext *c);
+int InstrLength(int opcode);
+
+/* db_profile.c */
+void MapSites(ParseContext *c, ProfileMark *marks, int count, VMVALUE function, VMUVALUE addr);
+void OrderFunctions(ParseContext *c);
+
 #ifdef __cplusplus
 }
 #endif
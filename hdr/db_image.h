@@ -21,8 +21,15 @@ typedef struct {
     VMUVALUE imageSize;     /* size of entire image */
     VMUVALUE dataOffset;    /* offset to data */
     VMUVALUE dataSize;      /* data size in bytes */
+    VMUVALUE bssSize;       /* size of the zero-filled data that follows the data (not stored in the image) */
+    VMUVALUE encoding;      /* instruction encoding of the code */
+    VMUVALUE poolOffset;    /* offset to the constant pool in the text section */
 } ImageHdr;
 
+/* instruction encodings */
+#define ENCODING_STACK      0   /* stack instructions only */
+#define ENCODING_REGISTER   1   /* stack instructions mixed with three address register instructions */
+
 /* opcodes */
 #define OP_HALT         0x00    /* halt */
 #define OP_BRT          0x01    /* branch on true */
@@ -58,13 +65,78 @@ typedef struct {
 #define OP_LREF         0x1f    /* load a local variable relative to the frame pointer */
 #define OP_LSET         0x20    /* set a local variable relative to the frame pointer */
 #define OP_INDEX        0x21    /* index into a vector of longs */
-#define OP_CALL         0x22    /* call a function */
-#define OP_FRAME        0x23    /* create a stack frame */
-#define OP_RETURN       0x24    /* remove a stack frame and return from a function call */
+#define OP_CALL         0x22    /* call the function whose address is on the stack */
+#define OP_FRAME        0x23    /* reserve space for local variables */
+#define OP_RETURN       0x24    /* remove a stack frame and its arguments and return from a function call */
 #define OP_DROP         0x25    /* drop the top element of the stack */
 #define OP_DUP          0x26    /* duplicate the top element of the stack */
 #define OP_NATIVE       0x27    /* execute native code */
 #define OP_TRAP         0x28    /* trap to handler */
+#define OP_FORNEXT      0x29    /* step a FOR loop variable and branch while it is within the limit */
+#define OP_DCALL        0x2a    /* call a function at a known address */
+#define OP_TCALL        0x2b    /* replace the current frame with a call to a function at a known address */
+#define OP_GLOAD        0x2c    /* load a global variable using an 8 bit data section index */
+#define OP_GSTORE       0x2d    /* store a global variable using an 8 bit data section index */
+#define OP_GLOADW       0x2e    /* load a global variable using a 16 bit data section index */
+#define OP_GSTOREW      0x2f    /* store a global variable using a 16 bit data section index */
+#define OP_DLOAD        0x30    /* load a long from the data section */
+#define OP_DSTORE       0x31    /* store a long into the data section */
+#define OP_TLOAD        0x32    /* load a long from the text section */
+#define OP_SBRT         0x33    /* branch on true (8 bit offset) */
+#define OP_SBRTSC       0x34    /* branch on true for short circuit booleans (8 bit offset) */
+#define OP_SBRF         0x35    /* branch on false (8 bit offset) */
+#define OP_SBRFSC       0x36    /* branch on false for short circuit booleans (8 bit offset) */
+#define OP_SBR          0x37    /* branch unconditionally (8 bit offset) */
+#define OP_JUMPTABLE    0x38    /* take the branch indexed by the top of stack from the table of BRs that follows */
+#define OP_DIVP2        0x39    /* divide by a power of two (rounding toward zero like OP_DIV) */
+#define OP_REMP2        0x3a    /* remainder of a division by a power of two (with the sign of the dividend like OP_REM) */
+#define OP_SWAP         0x3b    /* swap the top two elements of the stack */
+#define OP_INCL         0x3c    /* add a signed 8 bit constant to a local variable in place */
+#define OP_INCG         0x3d    /* add a signed 8 bit constant to a global variable in place (8 bit data section index) */
+
+/* register opcodes (operands are register specifiers, the destination first and the sources evaluated last to first) */
+#define OP_RADD         0x3e    /* add two registers */
+#define OP_RSUB         0x3f    /* subtract two registers */
+#define OP_RMUL         0x40    /* multiply two registers */
+#define OP_RDIV         0x41    /* divide two registers */
+#define OP_RREM         0x42    /* remainder of two registers */
+#define OP_RBAND        0x43    /* bitwise and of two registers */
+#define OP_RBOR         0x44    /* bitwise or of two registers */
+#define OP_RBXOR        0x45    /* bitwise exclusive or of two registers */
+#define OP_RSHL         0x46    /* shift a register left */
+#define OP_RSHR         0x47    /* shift a register right */
+#define OP_RLT          0x48    /* less than */
+#define OP_RLE          0x49    /* less than or equal to */
+#define OP_REQ          0x4a    /* equal to */
+#define OP_RNE          0x4b    /* not equal to */
+#define OP_RGE          0x4c    /* greater than or equal to */
+#define OP_RGT          0x4d    /* greater than */
+#define OP_RINDEX       0x4e    /* index into a vector of longs */
+#define OP_RNEG         0x4f    /* negate a register */
+#define OP_RNOT         0x50    /* logical negate a register */
+#define OP_RBNOT        0x51    /* bitwise not of a register */
+#define OP_RMOV         0x52    /* copy a register */
+#define OP_RDLOAD       0x53    /* load a long from the data section at the address in a register */
+#define OP_RDSTORE      0x54    /* store a register into the data section (value, address) */
+#define OP_RLIT         0x55    /* load a literal into a register */
+#define OP_RBRT         0x56    /* branch if a register is true */
+#define OP_RBRF         0x57    /* branch if a register is false */
+
+/* compact literal opcodes (chosen over OP_LIT when the compiler encodes the code) */
+#define OP_WLIT         0x58    /* load a 16 bit literal (-32768 to 32767) */
+#define OP_CLIT         0x59    /* load a literal from the constant pool using an 8 bit index */
+
+/* register specifiers (0x00-0x3f are frame offsets from -32 to 31) */
+#define ROP_GLOBAL      0x40    /* 0x40-0xbf are global variables 0 to 127 */
+#define ROP_CONSTS      0xc0    /* 0xc0-0xfe are the constants -31 to 31 */
+#define ROP_CONST       0xdf    /* specifier of the constant zero */
+#define ROP_STACK       0xff    /* pop a source from the stack or push a destination onto it */
+#define ROP_OFFSET(s)   ((((s) & 0x3f) ^ 0x20) - 0x20)
+
+/* stack frame layout (below the frame pointer, built by OP_CALL and OP_DCALL) */
+#define F_FP            -1      /* saved frame pointer */
+#define F_RET           -2      /* return address */
+#define F_SIZE          2       /* number of frame entries before the first local */
 
 /* VM trap codes */
 enum {
@@ -0,0 +1,103 @@
+/* db_optimize.h - definitions shared by the optimizer passes
+ *
+ * Copyright (c) 2014 by David Michael Betz.  All rights reserved.
+ *
+ */
+
+#ifndef __DB_OPTIMIZE_H__
+#define __DB_OPTIMIZE_H__
+
+#include "db_compiler.h"
+
+#ifdef __cplusplus
+extern "C" 
+{
+#endif
+
+/* frame slots the passes may add to a function in all (frames come out of a small stack) */
+#define MAXNEWSLOTS     4
+
+/* instruction flags */
+#define INSTR_TARGET    0x01    /* instruction is the target of a branch */
+#define INSTR_DELETED   0x02    /* instruction has been deleted */
+#define INSTR_REACHABLE 0x04    /* instruction can be reached from the entry point */
+#define INSTR_TABLE     0x08    /* BR entry in the table following a JUMPTABLE (must stay in place) */
+
+/* decoded instruction */
+typedef struct {
+    int opcode;         /* opcode */
+    int fmt;            /* operand format */
+    int flags;          /* instruction flags */
+    int addr;           /* offset in the code buffer */
+    VMVALUE operand;    /* operand */
+    int operand2;       /* second operand (tail call argument counts (new << 8 | current) or an increment) */
+    int target;         /* index of the branch target instruction */
+    int site;           /* number of a branch or call in the code as generated (zero for other instructions) */
+} Instr;
+
+/* basic block */
+typedef struct {
+    int first;          /* index of the first instruction */
+    int last;           /* index of the last instruction */
+    int succ[2];        /* successor blocks (-1 if there is none) */
+} BasicBlock;
+
+/* control flow graph of the code being optimized */
+typedef struct {
+    Instr *code;        /* instructions */
+    int count;          /* number of instructions */
+    BasicBlock *blocks; /* basic blocks in code order */
+    int blockCount;     /* number of basic blocks */
+    int *blockOf;       /* block containing each instruction (-1 for deleted instructions) */
+} Flow;
+
+/* optimization pass (returns true if it changed the code) */
+typedef int OptPass(ParseContext *c, Instr **pCode, int *pCount);
+
+/* db_optimize.c */
+Instr *DecodeStoredCode(ParseContext *c, const uint8_t *bytes, int size, int *pCount);
+Function *FindCallee(ParseContext *c, Instr *code, int count, int i);
+void MarkTargets(Instr *code, int count);
+int NextInstr(Instr *code, int count, int i);
+int ResolveTarget(Instr *code, int count, int i);
+void DeleteInstr(Instr *code, int count, int i);
+void SetOpcode(Instr *instr, int opcode);
+int IsBranch(int fmt);
+int FallsThrough(int opcode);
+void *OptimizerAlloc(ParseContext *c, size_t size);
+int ReserveInstrs(ParseContext *c, Instr *code, int count, int n);
+void InsertInstrs(Instr *code, int *pCount, int i, int n, int join);
+int NewSlot(ParseContext *c);
+void UpdateFrame(ParseContext *c, Instr *code, int *pCount);
+
+/* db_flow.c */
+int BuildFlow(ParseContext *c, Instr *code, int count, Flow *flow);
+int StackEffect(int opcode, int *pPops, int *pPushes);
+int IsPureOp(int opcode);
+int PropagateCopies(ParseContext *c, Instr **pCode, int *pCount);
+int RemoveDeadValues(ParseContext *c, Instr **pCode, int *pCount);
+
+/* db_cse.c */
+int EliminateCommonSubexpressions(ParseContext *c, Instr **pCode, int *pCount);
+
+/* db_loop.c */
+int HoistLoopInvariants(ParseContext *c, Instr **pCode, int *pCount);
+
+/* db_live.c */
+int ShareFrameSlots(ParseContext *c, Instr **pCode, int *pCount);
+
+/* db_profile.c */
+void NumberSites(Instr *code, int count);
+void MarkSites(ParseContext *c, Instr *code, int count);
+int InlineLimit(ParseContext *c, Instr *instr);
+int LayoutBlocks(ParseContext *c, Instr **pCode, int *pCount);
+
+/* db_register.c */
+int SelectRegisterCode(ParseContext *c, Instr **pCode, int *pCount);
+int RegisterDest(Instr *instr);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
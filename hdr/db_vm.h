@@ -15,6 +15,11 @@ extern "C"
 {
 #endif
 
+/* branches and calls can be counted for profile-guided compiles (the small targets have no RAM to spare) */
+#if !defined(AVR) && !defined(PROPELLER_GCC)
+#define VM_PROFILE
+#endif
+
 /* interpreter state structure */
 typedef struct {
     jmp_buf errorTarget;
@@ -27,6 +32,9 @@ typedef struct {
     VMVALUE *fp;
     VMVALUE *sp;
     VMVALUE tos;
+#ifdef VM_PROFILE
+    VMUVALUE *counts;   /* two counts for each text offset (branch taken and not taken or calls) or NULL */
+#endif
 } Interpreter;
 
 /* prototypes from db_vmint.c */
@@ -20,6 +20,17 @@ extern "C"
 #define FMT_SBYTE       2
 #define FMT_LONG        3
 #define FMT_BR          4
+#define FMT_SBYTE_BR    5   /* frame offset followed by a branch offset */
+#define FMT_WORD        6   /* unsigned 16 bit text address */
+#define FMT_BYTE2_WORD  7   /* two bytes followed by an unsigned 16 bit text address */
+#define FMT_SBR         8   /* signed 8 bit branch offset */
+#define FMT_SBYTE2      9   /* frame offset followed by a signed byte */
+#define FMT_BYTE_SBYTE  10  /* unsigned byte followed by a signed byte */
+#define FMT_REG2        11  /* two register specifiers */
+#define FMT_REG3        12  /* three register specifiers */
+#define FMT_REG_LONG    13  /* register specifier followed by a long */
+#define FMT_REG_BR      14  /* register specifier followed by a branch offset */
+#define FMT_SWORD       15  /* signed 16 bit literal */
 
 typedef struct {
     int code;
@@ -31,6 +42,7 @@ extern OTDEF OpcodeTable[];
 
 void DecodeFunction(const uint8_t *base, const uint8_t *code, int len);
 int DecodeInstruction(const uint8_t *base, const uint8_t *lc);
+uint32_t TextHash(const uint8_t *text, VMUVALUE size);
 
 #ifdef __cplusplus
 }
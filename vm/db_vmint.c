@@ -32,20 +32,177 @@
 #define Top(i)          (*(i)->sp)
 #define Drop(i, n)      ((i)->sp += (n))
 
+/* global variables are indexed in units of a value from the start of the data section */
+#define Global(i, n)    (((VMVALUE *)((i)->data + DATA_OFFSET))[n])
+
+/* frame entries hold native pointers when they fit in a value and offsets otherwise */
+#if defined(AVR) || (defined(PROPELLER_GCC) && defined(VM_VALUE_32))
+#define SaveFP(i, p)    ((VMVALUE)(uintptr_t)(p))
+#define RestoreFP(i, v) ((VMVALUE *)(uintptr_t)(v))
+#define SavePC(i, p)    ((VMVALUE)(uintptr_t)(p))
+#define RestorePC(i, v) ((uint8_t *)(uintptr_t)(v))
+#else
+#define SaveFP(i, p)    ((VMVALUE)((p) - (i)->stack))
+#define RestoreFP(i, v) ((i)->stack + (v))
+#define SavePC(i, p)    ((VMVALUE)((p) - (i)->text))
+#define RestorePC(i, v) ((i)->text + (v))
+#endif
+
+/* call a function whose arguments are on the stack */
+#define Call(i, addr)   do {                                              \
+                            Reserve(i, F_SIZE);                           \
+                            (i)->sp[F_SIZE + F_FP] = SaveFP(i, (i)->fp);  \
+                            (i)->sp[F_SIZE + F_RET] = SavePC(i, (i)->pc); \
+                            (i)->fp = (i)->sp + F_SIZE;                   \
+                            (i)->pc = (i)->text + (addr);                 \
+                        } while (0)
+
+/* get a signed 16 bit operand (high byte first) */
+#define FetchWord(i)    ((i)->pc += 2, (VMWORD)((VMCODEBYTE((i)->pc - 2) << 8) | VMCODEBYTE((i)->pc - 1)))
+
+/* get the constant at an index in the constant pool */
+#define PoolValue(i, n) VMCODEVALUE((i)->text + VMCODEUVALUE(&(i)->image->poolOffset) + (n) * sizeof(VMVALUE))
+
+/* count a branch or call whose operands have been read (n is 1 for a branch that isn't taken) */
+#ifdef VM_PROFILE
+#define Count(i, len, n)    do {                                                        \
+                                if ((i)->counts)                                        \
+                                    ++(i)->counts[2 * ((i)->pc - (len) - (i)->text) + (n)]; \
+                            } while (0)
+#else
+#define Count(i, len, n)
+#endif
+
+/* top of stack cache states (the number of values held in tos and nos above i->tos) */
+#define TOS_NONE        0x000
+#define TOS_ONE         0x100
+#define TOS_TWO         0x200
+
+/* push a value onto the cached stack (spilling a value when both registers are in use) */
+#define PushCached(i, v)    do {                                        \
+                                if (cache == TOS_TWO) {                 \
+                                    CPush(i, (i)->tos);                 \
+                                    (i)->tos = nos;                     \
+                                }                                       \
+                                else                                    \
+                                    cache += TOS_ONE;                   \
+                                nos = tos;                              \
+                                tos = (v);                              \
+                            } while (0)
+
+/* move the cached values onto the stack where the uncached instructions expect them */
+#define FlushCache(i)       do {                                        \
+                                if (cache == TOS_TWO) {                 \
+                                    CPush(i, (i)->tos);                 \
+                                    (i)->tos = nos;                     \
+                                }                                       \
+                                if (cache != TOS_NONE) {                \
+                                    CPush(i, (i)->tos);                 \
+                                    (i)->tos = tos;                     \
+                                    cache = TOS_NONE;                   \
+                                }                                       \
+                            } while (0)
+
+/* all cache state variants of an instruction that pushes a value */
+#define PushOp(op, expr)    case TOS_NONE | (op):                       \
+                                tos = (expr);                           \
+                                cache = TOS_ONE;                        \
+                                break;                                  \
+                            case TOS_ONE | (op):                        \
+                                nos = tos;                              \
+                                tos = (expr);                           \
+                                cache = TOS_TWO;                        \
+                                break;                                  \
+                            case TOS_TWO | (op):                        \
+                                CPush(i, i->tos);                       \
+                                i->tos = nos;                           \
+                                nos = tos;                              \
+                                tos = (expr);                           \
+                                break
+
+/* all cache state variants of a binary operator (tmp is the left operand and tmp2 the right) */
+#define BinaryOp(op, expr)  case TOS_NONE | (op):                       \
+                                tmp2 = i->tos;                          \
+                                tmp = Pop(i);                           \
+                                i->tos = (expr);                        \
+                                break;                                  \
+                            case TOS_ONE | (op):                        \
+                                tmp = i->tos;                           \
+                                tmp2 = tos;                             \
+                                i->tos = (expr);                        \
+                                cache = TOS_NONE;                       \
+                                break;                                  \
+                            case TOS_TWO | (op):                        \
+                                tmp = nos;                              \
+                                tmp2 = tos;                             \
+                                tos = (expr);                           \
+                                cache = TOS_ONE;                        \
+                                break
+
+#ifndef VM_STACK_ONLY
+/* all cache state variants of a register instruction */
+#define RegisterOp(op)      case TOS_NONE | (op):                       \
+                            case TOS_ONE | (op):                        \
+                            case TOS_TWO | (op)
+
+/* get a register instruction source (stack operands are popped from the cache first) */
+#define GetOperand(i, spec, v)  do {                                                \
+                                    int s_ = (spec);                                \
+                                    if (s_ != ROP_STACK)                            \
+                                        v = GetRegister(i, s_);                     \
+                                    else if (cache != TOS_NONE) {                   \
+                                        v = tos;                                    \
+                                        tos = nos;                                  \
+                                        cache -= TOS_ONE;                           \
+                                    }                                               \
+                                    else {                                          \
+                                        v = (i)->tos;                               \
+                                        (i)->tos = Pop(i);                          \
+                                    }                                               \
+                                } while (0)
+
+/* set a register instruction destination (stack results are pushed onto the cache) */
+#define SetOperand(i, spec, v)  do {                                                \
+                                    if ((spec) != ROP_STACK)                        \
+                                        SetRegister(i, spec, v);                    \
+                                    else                                            \
+                                        PushCached(i, v);                           \
+                                } while (0)
+
+/* get the destination and the sources of a three register instruction (the last source first) */
+#define Reg3(i, d, a, b)    do {                                                    \
+                                d = VMCODEBYTE((i)->pc);                            \
+                                GetOperand(i, VMCODEBYTE((i)->pc + 2), b);          \
+                                GetOperand(i, VMCODEBYTE((i)->pc + 1), a);          \
+                                (i)->pc += 3;                                       \
+                            } while (0)
+
+/* get the destination and the source of a two register instruction */
+#define Reg2(i, d, a)       do {                                                    \
+                                d = VMCODEBYTE((i)->pc);                            \
+                                GetOperand(i, VMCODEBYTE((i)->pc + 1), a);          \
+                                (i)->pc += 2;                                       \
+                            } while (0)
+#endif
+
 /* prototypes for local functions */
 static void DoTrap(Interpreter *i, int op);
 static void StackOverflow(Interpreter *i);
+#ifndef VM_STACK_ONLY
+static VMVALUE GetRegister(Interpreter *i, int spec);
+static void SetRegister(Interpreter *i, int spec, VMVALUE value);
+#endif
 #ifdef VM_DEBUG
-static void ShowStack(Interpreter *i);
+static void ShowStack(Interpreter *i, int cache, VMVALUE tos, VMVALUE nos);
 #endif
 
 /* Execute - execute the main code */
 int Execute(Interpreter *i, VMVALUE *stack, int stackSize)
 {
-    VMVALUE tmp;
+    VMVALUE tmp, tmp2, tos, nos;
     VMWORD tmpw;
     int8_t tmpb;
-    int cnt;
+    int cnt, op, cache;
 
 	/* make sure there is enough space for the runtime structures */
 	if (stackSize < MIN_STACK_SIZE)
@@ -63,21 +220,44 @@ int Execute(Interpreter *i, VMVALUE *stack, int stackSize)
     if (setjmp(i->errorTarget))
         return -1;
 
+    /* make sure the code uses an encoding this interpreter handles */
+#ifdef VM_STACK_ONLY
+    if (VMCODEUVALUE(&i->image->encoding) != ENCODING_STACK)
+#else
+    if (VMCODEUVALUE(&i->image->encoding) > ENCODING_REGISTER)
+#endif
+        VM_abort(i, "unsupported instruction encoding");
+
+    /* start with nothing cached (after the setjmp so the cache can live in registers) */
+    cache = TOS_NONE;
+    tos = nos = 0;
+
     for (;;) {
 #ifdef VM_DEBUG
-        ShowStack(i);
+        ShowStack(i, cache, tos, nos);
         DecodeInstruction(i->text, i->pc);
 #endif
-        switch (VMCODEBYTE(i->pc++)) {
+        switch (cache | (op = VMCODEBYTE(i->pc++))) {
         case OP_HALT:
             return 0;
         case OP_BRT:
             for (tmpw = 0, cnt = sizeof(VMWORD); --cnt >= 0; )
                 tmpw = (tmpw << 8) | VMCODEBYTE(i->pc++);
+            Count(i, 1 + sizeof(VMWORD), i->tos == 0);
             if (i->tos)
                 i->pc += tmpw;
             i->tos = Pop(i);
             break;
+        case TOS_ONE | OP_BRT:
+        case TOS_TWO | OP_BRT:
+            for (tmpw = 0, cnt = sizeof(VMWORD); --cnt >= 0; )
+                tmpw = (tmpw << 8) | VMCODEBYTE(i->pc++);
+            Count(i, 1 + sizeof(VMWORD), tos == 0);
+            if (tos)
+                i->pc += tmpw;
+            tos = nos;              /* tos is dead when only one value was cached */
+            cache -= TOS_ONE;
+            break;
         case OP_BRTSC:
             for (tmpw = 0, cnt = sizeof(VMWORD); --cnt >= 0; )
                 tmpw = (tmpw << 8) | VMCODEBYTE(i->pc++);
@@ -89,10 +269,21 @@ int Execute(Interpreter *i, VMVALUE *stack, int stackSize)
         case OP_BRF:
             for (tmpw = 0, cnt = sizeof(VMWORD); --cnt >= 0; )
                 tmpw = (tmpw << 8) | VMCODEBYTE(i->pc++);
+            Count(i, 1 + sizeof(VMWORD), i->tos != 0);
             if (!i->tos)
                 i->pc += tmpw;
             i->tos = Pop(i);
             break;
+        case TOS_ONE | OP_BRF:
+        case TOS_TWO | OP_BRF:
+            for (tmpw = 0, cnt = sizeof(VMWORD); --cnt >= 0; )
+                tmpw = (tmpw << 8) | VMCODEBYTE(i->pc++);
+            Count(i, 1 + sizeof(VMWORD), tos != 0);
+            if (!tos)
+                i->pc += tmpw;
+            tos = nos;
+            cache -= TOS_ONE;
+            break;
         case OP_BRFSC:
             for (tmpw = 0, cnt = sizeof(VMWORD); --cnt >= 0; )
                 tmpw = (tmpw << 8) | VMCODEBYTE(i->pc++);
@@ -102,6 +293,8 @@ int Execute(Interpreter *i, VMVALUE *stack, int stackSize)
                 i->tos = Pop(i);
             break;
         case OP_BR:
+        case TOS_ONE | OP_BR:
+        case TOS_TWO | OP_BR:
             for (tmpw = 0, cnt = sizeof(VMWORD); --cnt >= 0; )
                 tmpw = (tmpw << 8) | VMCODEBYTE(i->pc++);
             i->pc += tmpw;
@@ -109,93 +302,63 @@ int Execute(Interpreter *i, VMVALUE *stack, int stackSize)
         case OP_NOT:
             i->tos = (i->tos ? VMFALSE : VMTRUE);
             break;
+        case TOS_ONE | OP_NOT:
+        case TOS_TWO | OP_NOT:
+            tos = (tos ? VMFALSE : VMTRUE);
+            break;
         case OP_NEG:
             i->tos = -i->tos;
             break;
-        case OP_ADD:
-            tmp = Pop(i);
-            i->tos = tmp + i->tos;
-            break;
-        case OP_SUB:
-            tmp = Pop(i);
-            i->tos = tmp - i->tos;
-            break;
-        case OP_MUL:
-            tmp = Pop(i);
-            i->tos = tmp * i->tos;
-            break;
-        case OP_DIV:
-            tmp = Pop(i);
-            i->tos = (i->tos == 0 ? 0 : tmp / i->tos);
-            break;
-        case OP_REM:
-            tmp = Pop(i);
-            i->tos = (i->tos == 0 ? 0 : tmp % i->tos);
+        case TOS_ONE | OP_NEG:
+        case TOS_TWO | OP_NEG:
+            tos = -tos;
             break;
+        BinaryOp(OP_ADD, tmp + tmp2);
+        BinaryOp(OP_SUB, tmp - tmp2);
+        BinaryOp(OP_MUL, tmp * tmp2);
+        BinaryOp(OP_DIV, (tmp2 == 0 ? 0 : tmp / tmp2));
+        BinaryOp(OP_REM, (tmp2 == 0 ? 0 : tmp % tmp2));
         case OP_BNOT:
             i->tos = ~i->tos;
             break;
-        case OP_BAND:
-            tmp = Pop(i);
-            i->tos = tmp & i->tos;
-            break;
-        case OP_BOR:
-            tmp = Pop(i);
-            i->tos = tmp | i->tos;
-            break;
-        case OP_BXOR:
-            tmp = Pop(i);
-            i->tos = tmp ^ i->tos;
-            break;
-        case OP_SHL:
-            tmp = Pop(i);
-            i->tos = tmp << i->tos;
-            break;
-        case OP_SHR:
-            tmp = Pop(i);
-            i->tos = tmp >> i->tos;
-            break;
-        case OP_LT:
-            tmp = Pop(i);
-            i->tos = (tmp < i->tos ? VMTRUE : VMFALSE);
-            break;
-        case OP_LE:
-            tmp = Pop(i);
-            i->tos = (tmp <= i->tos ? VMTRUE : VMFALSE);
-            break;
-        case OP_EQ:
-            tmp = Pop(i);
-            i->tos = (tmp == i->tos ? VMTRUE : VMFALSE);
-            break;
-        case OP_NE:
-            tmp = Pop(i);
-            i->tos = (tmp != i->tos ? VMTRUE : VMFALSE);
-            break;
-        case OP_GE:
-            tmp = Pop(i);
-            i->tos = (tmp >= i->tos ? VMTRUE : VMFALSE);
-            break;
-        case OP_GT:
-            tmp = Pop(i);
-            i->tos = (tmp > i->tos ? VMTRUE : VMFALSE);
-            break;
+        case TOS_ONE | OP_BNOT:
+        case TOS_TWO | OP_BNOT:
+            tos = ~tos;
+            break;
+        BinaryOp(OP_BAND, tmp & tmp2);
+        BinaryOp(OP_BOR, tmp | tmp2);
+        BinaryOp(OP_BXOR, tmp ^ tmp2);
+        BinaryOp(OP_SHL, tmp << tmp2);
+        BinaryOp(OP_SHR, tmp >> tmp2);
+        BinaryOp(OP_LT, (tmp < tmp2 ? VMTRUE : VMFALSE));
+        BinaryOp(OP_LE, (tmp <= tmp2 ? VMTRUE : VMFALSE));
+        BinaryOp(OP_EQ, (tmp == tmp2 ? VMTRUE : VMFALSE));
+        BinaryOp(OP_NE, (tmp != tmp2 ? VMTRUE : VMFALSE));
+        BinaryOp(OP_GE, (tmp >= tmp2 ? VMTRUE : VMFALSE));
+        BinaryOp(OP_GT, (tmp > tmp2 ? VMTRUE : VMFALSE));
         case OP_LIT:
+        case TOS_ONE | OP_LIT:
+        case TOS_TWO | OP_LIT:
             for (tmp = 0, cnt = sizeof(VMUVALUE); --cnt >= 0; )
                 tmp = (tmp << 8) | VMCODEBYTE(i->pc++);
-            CPush(i, i->tos);
-            i->tos = tmp;
-            break;
-        case OP_SLIT:
-            tmpb = (int8_t)VMCODEBYTE(i->pc++);
-            CPush(i, i->tos);
-            i->tos = tmpb;
+            PushCached(i, tmp);
             break;
+        PushOp(OP_SLIT, (int8_t)VMCODEBYTE(i->pc++));
+        PushOp(OP_WLIT, FetchWord(i));
+        PushOp(OP_CLIT, PoolValue(i, VMCODEBYTE(i->pc++)));
         case OP_LOAD:
             if ((VMUVALUE)i->tos >= DATA_OFFSET)
                 i->tos = *(VMVALUE *)(i->data + (VMUVALUE)i->tos);
             else
                 i->tos = VMCODEUVALUE(i->text + (VMUVALUE)i->tos);
             break;
+        case TOS_ONE | OP_LOAD:
+        case TOS_TWO | OP_LOAD:
+            if ((VMUVALUE)tos >= DATA_OFFSET)
+                tos = *(VMVALUE *)(i->data + (VMUVALUE)tos);
+            else
+                tos = VMCODEUVALUE(i->text + (VMUVALUE)tos);
+            break;
         case OP_LOADB:
             if ((VMUVALUE)i->tos >= DATA_OFFSET)
                 i->tos = *(uint8_t *)(i->data + (VMUVALUE)i->tos);
@@ -208,50 +371,100 @@ int Execute(Interpreter *i, VMVALUE *stack, int stackSize)
                 *(VMVALUE *)(i->data + (VMUVALUE)i->tos) = tmp;
             i->tos = Pop(i);
             break;
+        case TOS_ONE | OP_STORE:
+            if ((VMUVALUE)tos >= DATA_OFFSET)
+                *(VMVALUE *)(i->data + (VMUVALUE)tos) = i->tos;
+            i->tos = Pop(i);
+            cache = TOS_NONE;
+            break;
+        case TOS_TWO | OP_STORE:
+            if ((VMUVALUE)tos >= DATA_OFFSET)
+                *(VMVALUE *)(i->data + (VMUVALUE)tos) = nos;
+            cache = TOS_NONE;
+            break;
         case OP_STOREB:
             tmp = Pop(i);
             if ((VMUVALUE)i->tos >= DATA_OFFSET)
                 *(uint8_t *)(i->data + (VMUVALUE)i->tos) = tmp;
             i->tos = Pop(i);
             break;
-        case OP_LREF:
-            tmpb = (int8_t)VMCODEBYTE(i->pc++);
-            CPush(i, i->tos);
-            i->tos = i->fp[(int)tmpb];
-            break;
+        PushOp(OP_LREF, i->fp[(int8_t)VMCODEBYTE(i->pc++)]);
         case OP_LSET:
             tmpb = (int8_t)VMCODEBYTE(i->pc++);
             i->fp[(int)tmpb] = i->tos;
             i->tos = Pop(i);
             break;
-        case OP_INDEX:
-            i->tos = Pop(i) + i->tos * sizeof (VMVALUE);
+        case TOS_ONE | OP_LSET:
+        case TOS_TWO | OP_LSET:
+            tmpb = (int8_t)VMCODEBYTE(i->pc++);
+            i->fp[(int)tmpb] = tos;
+            tos = nos;
+            cache -= TOS_ONE;
             break;
+        BinaryOp(OP_INDEX, tmp + tmp2 * sizeof (VMVALUE));
         case OP_CALL:
-            ++i->pc; // skip over the argument count
-            tmp = i->tos;
-            i->tos = (VMVALUE)(i->pc - i->text);
-            i->pc = (uint8_t *)(i->text + tmp);
+            Call(i, (VMUVALUE)i->tos);
+            break;
+        case OP_DCALL:
+            for (tmpw = 0, cnt = sizeof(VMWORD); --cnt >= 0; )
+                tmpw = (tmpw << 8) | VMCODEBYTE(i->pc++);
+            Count(i, 1 + sizeof(VMWORD), 0);
+            CPush(i, i->tos);
+            Call(i, (uint16_t)tmpw);
+            break;
+        case OP_TCALL:
+            {
+                VMVALUE *fp, savedFP, savedPC;
+                cnt = VMCODEBYTE(i->pc++);
+                fp = i->fp + VMCODEBYTE(i->pc++) - cnt;
+                for (tmpw = 0, tmp = sizeof(VMWORD); --tmp >= 0; )
+                    tmpw = (tmpw << 8) | VMCODEBYTE(i->pc++);
+                Count(i, 3 + sizeof(VMWORD), 0);
+                CPush(i, i->tos);
+                savedFP = i->fp[F_FP];
+                savedPC = i->fp[F_RET];
+                memmove(fp, i->sp, cnt * sizeof(VMVALUE));
+                fp[F_FP] = savedFP;
+                fp[F_RET] = savedPC;
+                i->fp = fp;
+                i->sp = fp - F_SIZE;
+                i->pc = i->text + (uint16_t)tmpw;
+            }
             break;
         case OP_FRAME:
-            cnt = VMCODEBYTE(i->pc++);
-            tmp = (VMVALUE)((uint8_t *)i->fp - i->text);
-            i->fp = i->sp;
-            Reserve(i, cnt);
-            i->sp[0] = i->tos;
-            i->sp[1] = tmp;
+            cnt = F_SIZE + VMCODEBYTE(i->pc++);
+            if (i->fp - cnt < i->stack)
+                StackOverflow(i);
+            i->sp = i->fp - cnt;
             break;
         case OP_RETURN:
-            i->pc = i->text + Top(i);
-            i->sp = i->fp;
-            Drop(i, VMCODEBYTE(&i->pc[-1]));
-            i->fp = (VMVALUE *)(i->text + i->fp[-1]);
+            i->sp = i->fp + VMCODEBYTE(i->pc);
+            i->pc = RestorePC(i, i->fp[F_RET]);
+            i->fp = RestoreFP(i, i->fp[F_FP]);
+            break;
+        case TOS_ONE | OP_RETURN:
+        case TOS_TWO | OP_RETURN:
+            i->tos = tos;
+            cache = TOS_NONE;
+            i->sp = i->fp + VMCODEBYTE(i->pc);
+            i->pc = RestorePC(i, i->fp[F_RET]);
+            i->fp = RestoreFP(i, i->fp[F_FP]);
             break;
         case OP_DROP:
             i->tos = Pop(i);
             break;
+        case TOS_ONE | OP_DROP:
+        case TOS_TWO | OP_DROP:
+            tos = nos;
+            cache -= TOS_ONE;
+            break;
         case OP_DUP:
-            CPush(i, i->tos);
+            tos = i->tos;
+            cache = TOS_ONE;
+            break;
+        case TOS_ONE | OP_DUP:
+        case TOS_TWO | OP_DUP:
+            PushCached(i, tos);
             break;
         case OP_NATIVE:
             for (tmp = 0, cnt = sizeof(VMUVALUE); --cnt >= 0; )
@@ -260,8 +473,307 @@ int Execute(Interpreter *i, VMVALUE *stack, int stackSize)
         case OP_TRAP:
             DoTrap(i, VMCODEBYTE(i->pc++));
             break;
+        case OP_FORNEXT:
+            tmpb = (int8_t)VMCODEBYTE(i->pc++);
+            for (tmpw = 0, cnt = sizeof(VMWORD); --cnt >= 0; )
+                tmpw = (tmpw << 8) | VMCODEBYTE(i->pc++);
+            tmp = i->fp[(int)tmpb - 1];
+            i->tos += tmp;
+            if (tmp >= 0 ? i->tos <= i->fp[(int)tmpb] : i->tos >= i->fp[(int)tmpb])
+                i->pc += tmpw;
+            break;
+        case TOS_ONE | OP_FORNEXT:
+        case TOS_TWO | OP_FORNEXT:
+            tmpb = (int8_t)VMCODEBYTE(i->pc++);
+            for (tmpw = 0, cnt = sizeof(VMWORD); --cnt >= 0; )
+                tmpw = (tmpw << 8) | VMCODEBYTE(i->pc++);
+            tmp = i->fp[(int)tmpb - 1];
+            tos += tmp;
+            if (tmp >= 0 ? tos <= i->fp[(int)tmpb] : tos >= i->fp[(int)tmpb])
+                i->pc += tmpw;
+            break;
+        PushOp(OP_GLOAD, Global(i, VMCODEBYTE(i->pc++)));
+        case OP_GSTORE:
+            Global(i, VMCODEBYTE(i->pc++)) = i->tos;
+            i->tos = Pop(i);
+            break;
+        case TOS_ONE | OP_GSTORE:
+        case TOS_TWO | OP_GSTORE:
+            Global(i, VMCODEBYTE(i->pc++)) = tos;
+            tos = nos;
+            cache -= TOS_ONE;
+            break;
+        case OP_GLOADW:
+            for (tmpw = 0, cnt = sizeof(VMWORD); --cnt >= 0; )
+                tmpw = (tmpw << 8) | VMCODEBYTE(i->pc++);
+            CPush(i, i->tos);
+            i->tos = Global(i, (uint16_t)tmpw);
+            break;
+        case OP_GSTOREW:
+            for (tmpw = 0, cnt = sizeof(VMWORD); --cnt >= 0; )
+                tmpw = (tmpw << 8) | VMCODEBYTE(i->pc++);
+            Global(i, (uint16_t)tmpw) = i->tos;
+            i->tos = Pop(i);
+            break;
+        case OP_DLOAD:
+            i->tos = *(VMVALUE *)(i->data + (VMUVALUE)i->tos);
+            break;
+        case TOS_ONE | OP_DLOAD:
+        case TOS_TWO | OP_DLOAD:
+            tos = *(VMVALUE *)(i->data + (VMUVALUE)tos);
+            break;
+        case OP_DSTORE:
+            tmp = Pop(i);
+            *(VMVALUE *)(i->data + (VMUVALUE)i->tos) = tmp;
+            i->tos = Pop(i);
+            break;
+        case TOS_ONE | OP_DSTORE:
+            *(VMVALUE *)(i->data + (VMUVALUE)tos) = i->tos;
+            i->tos = Pop(i);
+            cache = TOS_NONE;
+            break;
+        case TOS_TWO | OP_DSTORE:
+            *(VMVALUE *)(i->data + (VMUVALUE)tos) = nos;
+            cache = TOS_NONE;
+            break;
+        case OP_TLOAD:
+            i->tos = VMCODEUVALUE(i->text + (VMUVALUE)i->tos);
+            break;
+        case TOS_ONE | OP_TLOAD:
+        case TOS_TWO | OP_TLOAD:
+            tos = VMCODEUVALUE(i->text + (VMUVALUE)tos);
+            break;
+        case OP_SBRT:
+            tmpb = (int8_t)VMCODEBYTE(i->pc++);
+            Count(i, 2, i->tos == 0);
+            if (i->tos)
+                i->pc += tmpb;
+            i->tos = Pop(i);
+            break;
+        case TOS_ONE | OP_SBRT:
+        case TOS_TWO | OP_SBRT:
+            tmpb = (int8_t)VMCODEBYTE(i->pc++);
+            Count(i, 2, tos == 0);
+            if (tos)
+                i->pc += tmpb;
+            tos = nos;
+            cache -= TOS_ONE;
+            break;
+        case OP_SBRTSC:
+            tmpb = (int8_t)VMCODEBYTE(i->pc++);
+            if (i->tos)
+                i->pc += tmpb;
+            else
+                i->tos = Pop(i);
+            break;
+        case OP_SBRF:
+            tmpb = (int8_t)VMCODEBYTE(i->pc++);
+            Count(i, 2, i->tos != 0);
+            if (!i->tos)
+                i->pc += tmpb;
+            i->tos = Pop(i);
+            break;
+        case TOS_ONE | OP_SBRF:
+        case TOS_TWO | OP_SBRF:
+            tmpb = (int8_t)VMCODEBYTE(i->pc++);
+            Count(i, 2, tos != 0);
+            if (!tos)
+                i->pc += tmpb;
+            tos = nos;
+            cache -= TOS_ONE;
+            break;
+        case OP_SBRFSC:
+            tmpb = (int8_t)VMCODEBYTE(i->pc++);
+            if (!i->tos)
+                i->pc += tmpb;
+            else
+                i->tos = Pop(i);
+            break;
+        case OP_SBR:
+        case TOS_ONE | OP_SBR:
+        case TOS_TWO | OP_SBR:
+            tmpb = (int8_t)VMCODEBYTE(i->pc++);
+            i->pc += tmpb;
+            break;
+        case OP_JUMPTABLE:
+            cnt = VMCODEBYTE(i->pc++);
+            tmp = i->tos;
+            i->tos = Pop(i);
+            if ((VMUVALUE)tmp < (VMUVALUE)cnt) {
+                i->pc += tmp * (1 + sizeof(VMWORD)) + 1;
+                for (tmpw = 0, cnt = sizeof(VMWORD); --cnt >= 0; )
+                    tmpw = (tmpw << 8) | VMCODEBYTE(i->pc++);
+                i->pc += tmpw;
+            }
+            else
+                i->pc += cnt * (1 + sizeof(VMWORD));
+            break;
+        case OP_DIVP2:
+            cnt = VMCODEBYTE(i->pc++);
+            if (i->tos < 0)
+                i->tos += ((VMVALUE)1 << cnt) - 1;
+            i->tos >>= cnt;
+            break;
+        case OP_REMP2:
+            cnt = VMCODEBYTE(i->pc++);
+            tmp = i->tos & (((VMVALUE)1 << cnt) - 1);
+            if (i->tos < 0 && tmp != 0)
+                tmp -= (VMVALUE)1 << cnt;
+            i->tos = tmp;
+            break;
+        case OP_SWAP:
+            tmp = Top(i);
+            Top(i) = i->tos;
+            i->tos = tmp;
+            break;
+        case TOS_ONE | OP_SWAP:
+            tmp = i->tos;
+            i->tos = tos;
+            tos = tmp;
+            break;
+        case TOS_TWO | OP_SWAP:
+            tmp = nos;
+            nos = tos;
+            tos = tmp;
+            break;
+        case OP_INCL:
+        case TOS_ONE | OP_INCL:
+        case TOS_TWO | OP_INCL:
+            tmpb = (int8_t)VMCODEBYTE(i->pc++);
+            i->fp[(int)tmpb] += (int8_t)VMCODEBYTE(i->pc++);
+            break;
+        case OP_INCG:
+        case TOS_ONE | OP_INCG:
+        case TOS_TWO | OP_INCG:
+            tmp = VMCODEBYTE(i->pc++);
+            Global(i, tmp) += (int8_t)VMCODEBYTE(i->pc++);
+            break;
+#ifndef VM_STACK_ONLY
+        RegisterOp(OP_RADD):
+            Reg3(i, cnt, tmp, tmp2);
+            SetOperand(i, cnt, tmp + tmp2);
+            break;
+        RegisterOp(OP_RSUB):
+            Reg3(i, cnt, tmp, tmp2);
+            SetOperand(i, cnt, tmp - tmp2);
+            break;
+        RegisterOp(OP_RMUL):
+            Reg3(i, cnt, tmp, tmp2);
+            SetOperand(i, cnt, tmp * tmp2);
+            break;
+        RegisterOp(OP_RDIV):
+            Reg3(i, cnt, tmp, tmp2);
+            SetOperand(i, cnt, (tmp2 == 0 ? 0 : tmp / tmp2));
+            break;
+        RegisterOp(OP_RREM):
+            Reg3(i, cnt, tmp, tmp2);
+            SetOperand(i, cnt, (tmp2 == 0 ? 0 : tmp % tmp2));
+            break;
+        RegisterOp(OP_RBAND):
+            Reg3(i, cnt, tmp, tmp2);
+            SetOperand(i, cnt, tmp & tmp2);
+            break;
+        RegisterOp(OP_RBOR):
+            Reg3(i, cnt, tmp, tmp2);
+            SetOperand(i, cnt, tmp | tmp2);
+            break;
+        RegisterOp(OP_RBXOR):
+            Reg3(i, cnt, tmp, tmp2);
+            SetOperand(i, cnt, tmp ^ tmp2);
+            break;
+        RegisterOp(OP_RSHL):
+            Reg3(i, cnt, tmp, tmp2);
+            SetOperand(i, cnt, tmp << tmp2);
+            break;
+        RegisterOp(OP_RSHR):
+            Reg3(i, cnt, tmp, tmp2);
+            SetOperand(i, cnt, tmp >> tmp2);
+            break;
+        RegisterOp(OP_RLT):
+            Reg3(i, cnt, tmp, tmp2);
+            SetOperand(i, cnt, (tmp < tmp2 ? VMTRUE : VMFALSE));
+            break;
+        RegisterOp(OP_RLE):
+            Reg3(i, cnt, tmp, tmp2);
+            SetOperand(i, cnt, (tmp <= tmp2 ? VMTRUE : VMFALSE));
+            break;
+        RegisterOp(OP_REQ):
+            Reg3(i, cnt, tmp, tmp2);
+            SetOperand(i, cnt, (tmp == tmp2 ? VMTRUE : VMFALSE));
+            break;
+        RegisterOp(OP_RNE):
+            Reg3(i, cnt, tmp, tmp2);
+            SetOperand(i, cnt, (tmp != tmp2 ? VMTRUE : VMFALSE));
+            break;
+        RegisterOp(OP_RGE):
+            Reg3(i, cnt, tmp, tmp2);
+            SetOperand(i, cnt, (tmp >= tmp2 ? VMTRUE : VMFALSE));
+            break;
+        RegisterOp(OP_RGT):
+            Reg3(i, cnt, tmp, tmp2);
+            SetOperand(i, cnt, (tmp > tmp2 ? VMTRUE : VMFALSE));
+            break;
+        RegisterOp(OP_RINDEX):
+            Reg3(i, cnt, tmp, tmp2);
+            SetOperand(i, cnt, tmp + tmp2 * sizeof (VMVALUE));
+            break;
+        RegisterOp(OP_RNEG):
+            Reg2(i, cnt, tmp);
+            SetOperand(i, cnt, -tmp);
+            break;
+        RegisterOp(OP_RNOT):
+            Reg2(i, cnt, tmp);
+            SetOperand(i, cnt, (tmp ? VMFALSE : VMTRUE));
+            break;
+        RegisterOp(OP_RBNOT):
+            Reg2(i, cnt, tmp);
+            SetOperand(i, cnt, ~tmp);
+            break;
+        RegisterOp(OP_RMOV):
+            Reg2(i, cnt, tmp);
+            SetOperand(i, cnt, tmp);
+            break;
+        RegisterOp(OP_RDLOAD):
+            Reg2(i, cnt, tmp);
+            SetOperand(i, cnt, *(VMVALUE *)(i->data + (VMUVALUE)tmp));
+            break;
+        RegisterOp(OP_RDSTORE):
+            GetOperand(i, VMCODEBYTE(i->pc + 1), tmp2);
+            GetOperand(i, VMCODEBYTE(i->pc), tmp);
+            i->pc += 2;
+            *(VMVALUE *)(i->data + (VMUVALUE)tmp2) = tmp;
+            break;
+        RegisterOp(OP_RLIT):
+            tmp2 = VMCODEBYTE(i->pc++);
+            for (tmp = 0, cnt = sizeof(VMUVALUE); --cnt >= 0; )
+                tmp = (tmp << 8) | VMCODEBYTE(i->pc++);
+            SetOperand(i, (int)tmp2, tmp);
+            break;
+        RegisterOp(OP_RBRT):
+            GetOperand(i, VMCODEBYTE(i->pc++), tmp);
+            for (tmpw = 0, cnt = sizeof(VMWORD); --cnt >= 0; )
+                tmpw = (tmpw << 8) | VMCODEBYTE(i->pc++);
+            Count(i, 2 + sizeof(VMWORD), tmp == 0);
+            if (tmp)
+                i->pc += tmpw;
+            break;
+        RegisterOp(OP_RBRF):
+            GetOperand(i, VMCODEBYTE(i->pc++), tmp);
+            for (tmpw = 0, cnt = sizeof(VMWORD); --cnt >= 0; )
+                tmpw = (tmpw << 8) | VMCODEBYTE(i->pc++);
+            Count(i, 2 + sizeof(VMWORD), tmp != 0);
+            if (!tmp)
+                i->pc += tmpw;
+            break;
+#endif
+
         default:
-            VM_abort(i, "undefined opcode 0x%02x", VMCODEBYTE(i->pc - 1));
+            if (cache == TOS_NONE)
+                VM_abort(i, "undefined opcode 0x%02x", op);
+
+            /* execute the instruction again without the cache */
+            FlushCache(i);
+            --i->pc;
             break;
         }
     }
@@ -328,6 +840,29 @@ static void StackOverflow(Interpreter *i)
     VM_abort(i, "stack overflow");
 }
 
+#ifndef VM_STACK_ONLY
+/* GetRegister - get the value of a register instruction source other than the stack */
+static VMVALUE GetRegister(Interpreter *i, int spec)
+{
+    if (spec < ROP_GLOBAL)
+        return i->fp[ROP_OFFSET(spec)];
+    else if (spec < ROP_CONSTS)
+        return Global(i, spec - ROP_GLOBAL);
+    return spec - ROP_CONST;
+}
+
+/* SetRegister - set the destination of a register instruction other than the stack */
+static void SetRegister(Interpreter *i, int spec, VMVALUE value)
+{
+    if (spec < ROP_GLOBAL)
+        i->fp[ROP_OFFSET(spec)] = value;
+    else if (spec < ROP_CONSTS)
+        Global(i, spec - ROP_GLOBAL) = value;
+    else
+        VM_abort(i, "bad register 0x%02x", spec);
+}
+#endif
+
 void VM_abort(Interpreter *i, const char *fmt, ...)
 {
     char buf[100], *p = buf;
@@ -343,9 +878,15 @@ void VM_abort(Interpreter *i, const char *fmt, ...)
 }
 
 #ifdef VM_DEBUG
-static void ShowStack(Interpreter *i)
+static void ShowStack(Interpreter *i, int cache, VMVALUE tos, VMVALUE nos)
 {
     VMVALUE *p;
+    if (cache == TOS_NONE && i->sp >= i->stackTop)
+        return;
+    if (cache != TOS_NONE)
+        VM_printf(" %d", tos);
+    if (cache == TOS_TWO)
+        VM_printf(" %d", nos);
     if (i->sp < i->stackTop) {
         VM_printf(" %d", i->tos);
         for (p = i->sp; p < i->stackTop - 1; ++p) {
@@ -353,7 +894,7 @@ static void ShowStack(Interpreter *i)
                 VM_printf(" <fp>");
             VM_printf(" %d", *p);
         }
-        VM_printf("\n");
     }
+    VM_printf("\n");
 }
 #endif
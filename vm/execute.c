@@ -6,7 +6,9 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "db_vm.h"
+#include "db_vmdebug.h"
 
 #define RGB_SIZE    60
 
@@ -21,25 +23,38 @@ typedef struct {
 
 #define STACK_SIZE 32
 
+static void WriteProfile(FILE *fp, ImageHdr *image, VMUVALUE *counts);
+
 int main(int argc, char *argv[])
 {
+    char *imageFile = NULL, *profileFile = NULL;
     Interpreter i;
     ImageHdr *image = NULL;
-    size_t imageSize;
+    size_t imageSize, bssSize;
     VMVALUE stack[STACK_SIZE];
-    int stackSize = STACK_SIZE;
+    int stackSize = STACK_SIZE, n;
     FILE *fp;
 	VM_variables *vars;
     
     /* check the argument list */
-    if (argc != 2) {
-        fprintf(stderr, "usage: execute <image>\n");
+    for (n = 1; n < argc; ++n) {
+        if (argv[n][0] == '-' && argv[n][1] == 'p' && argv[n][2] && !profileFile)
+            profileFile = &argv[n][2];
+        else if (argv[n][0] != '-' && !imageFile)
+            imageFile = argv[n];
+        else {
+            imageFile = NULL;
+            break;
+        }
+    }
+    if (!imageFile) {
+        fprintf(stderr, "usage: execute [-p<profile>] <image>\n");
         return 1;
     }
     
     /* open the image file */
-    if (!(fp = fopen(argv[1], "rb"))) {
-        fprintf(stderr, "error: can't open %s\n", argv[1]);
+    if (!(fp = fopen(imageFile, "rb"))) {
+        fprintf(stderr, "error: can't open %s\n", imageFile);
         return 1;
     }
     
@@ -58,6 +73,14 @@ int main(int argc, char *argv[])
     fread(image, 1, imageSize, fp);
     fclose(fp);
     
+    /* add the zero-filled BSS after the data */
+    bssSize = VMCODEUVALUE(&image->bssSize);
+    if (!(image = (ImageHdr *)realloc(image, imageSize + bssSize))) {
+        fprintf(stderr, "error: insufficient memory\n");
+        return 1;
+    }
+    memset((uint8_t *)image + imageSize, 0, bssSize);
+    
     /* initialize the image */
     i.image = image;
 	i.data = (uint8_t *)image + VMCODEUVALUE(&image->dataOffset) - DATA_OFFSET;
@@ -65,9 +88,36 @@ int main(int argc, char *argv[])
 	vars = (VM_variables *)(i.data + DATA_OFFSET);
 	vars->numLeds = 10;
 
+    /* count the branches and calls if a profile is wanted */
+    i.counts = NULL;
+    if (profileFile && !(i.counts = (VMUVALUE *)calloc(2 * VMCODEUVALUE(&image->dataOffset), sizeof(VMUVALUE)))) {
+        fprintf(stderr, "error: insufficient memory\n");
+        return 1;
+    }
+
     /* execute the code */
     Execute(&i, stack, stackSize);
 
+    /* write the profile */
+    if (profileFile) {
+        if (!(fp = fopen(profileFile, "w"))) {
+            fprintf(stderr, "error: can't create %s\n", profileFile);
+            return 1;
+        }
+        WriteProfile(fp, image, i.counts);
+        fclose(fp);
+    }
+
     return 0;
 }
 
+/* WriteProfile - write the hash of the profiled code and the text offset and the two counts of each branch or call that was executed */
+static void WriteProfile(FILE *fp, ImageHdr *image, VMUVALUE *counts)
+{
+    VMUVALUE textSize = VMCODEUVALUE(&image->dataOffset), offset;
+    fprintf(fp, "text %lu %08lx\n", (unsigned long)textSize, (unsigned long)TextHash((uint8_t *)image, textSize));
+    for (offset = 0; offset < textSize; ++offset, counts += 2)
+        if (counts[0] || counts[1])
+            fprintf(fp, "%lu %lu %lu\n", (unsigned long)offset, (unsigned long)counts[0], (unsigned long)counts[1]);
+}
+
@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <string.h>
 #include <avr/pgmspace.h>
 #define __DELAY_BACKWARD_COMPATIBLE__
 #include <util/delay.h>
@@ -24,12 +25,23 @@ VMVALUE stack[STACK_SIZE];
 int main(int argc, char *argv[])
 {
     Interpreter i;
+    VMUVALUE dataSize, bssSize;
     
     UART_init(115200);
     
     i.image = (ImageHdr *)vmimage;
     i.data = vmdata - DATA_OFFSET;
-    memcpy_P(vmdata, vmimage + VMCODEUVALUE(&i.image->dataOffset), VMCODEUVALUE(&i.image->dataSize));
+
+    /* make sure the data and the BSS fit before copying or clearing anything */
+    dataSize = VMCODEUVALUE(&i.image->dataSize);
+    bssSize = VMCODEUVALUE(&i.image->bssSize);
+    if (dataSize > VMDATA_SIZE || bssSize > VMDATA_SIZE - dataSize) {
+        VM_printf("error: insufficient data space\n");
+        for (;;)
+            ;
+    }
+    memcpy_P(vmdata, vmimage + VMCODEUVALUE(&i.image->dataOffset), dataSize);
+    memset(vmdata + dataSize, 0, bssSize);
 
     Execute(&i, stack, STACK_SIZE);
     
@@ -1,13 +1,15 @@
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 #include <propeller.h>
 #include "db_vm.h"
 #include "db_system.h"
 
+#define VMIMAGE_SIZE    8192
 #define STACK_SIZE      32
 
-/* code space */
-uint8_t vmimage[] = {
+/* code space (the space after the image holds the zero-filled BSS) */
+uint8_t vmimage[VMIMAGE_SIZE] = {
 #include "vmimage.h"
 };
 
@@ -21,6 +23,14 @@ int main(int argc, char *argv[])
     i.image = (ImageHdr *)vmimage;
     i.data = vmimage + i.image->dataOffset - DATA_OFFSET;
 
+    /* add the zero-filled BSS after the data */
+    if (i.image->bssSize > sizeof(vmimage) - i.image->imageSize) {
+        VM_printf("error: insufficient data space\n");
+        for (;;)
+            ;
+    }
+    memset(vmimage + i.image->imageSize, 0, i.image->bssSize);
+
     Execute(&i, stack, STACK_SIZE);
     
     for (;;)